@@ -44,6 +44,14 @@ extern "C" {
 #endif
 		struct hid_device_;
 		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
+		struct hid_report_decoder_;
+		typedef struct hid_report_decoder_ hid_report_decoder; /**< opaque report decoder */
+		struct hid_report_encoder_;
+		typedef struct hid_report_encoder_ hid_report_encoder; /**< opaque report encoder */
+		struct hid_device_set_;
+		typedef struct hid_device_set_ hid_device_set; /**< opaque set of devices to wait on */
+		struct hid_context_;
+		typedef struct hid_context_ hid_context; /**< opaque context which devices are opened through */
 
 		/** hidapi info structure */
 		struct hid_device_info {
@@ -63,13 +71,15 @@ extern "C" {
 			/** Product string */
 			wchar_t *product_string;
 			/** Usage Page for this Device/Interface
-			    (Windows/Mac only). */
+			    (Windows/Mac/Linux; on Linux/libusb, only while the
+			    kernel's HID driver is bound to the interface). */
 			unsigned short usage_page;
 			/** Usage for this Device/Interface
-			    (Windows/Mac only).*/
+			    (Windows/Mac/Linux; on Linux/libusb, only while the
+			    kernel's HID driver is bound to the interface).*/
 			unsigned short usage;
 			/** The USB interface which this logical device
-			    represents. Valid on the Linux/libusb implementation
+			    represents. Valid on the Linux implementations
 			    in all cases, and valid on the Windows implementation
 			    only if the device contains more than one interface. */
 			int interface_number;
@@ -78,6 +88,261 @@ extern "C" {
 			struct hid_device_info *next;
 		};
 
+		/** hidapi enumeration filter. Initialize with
+		    hid_init_enumerate_filter(), which sets every criterion to
+		    match any device, and then set the criteria of interest. */
+		struct hid_enumerate_filter {
+			/** Vendor ID to match, in the bits set in
+			    vendor_id_mask. */
+			unsigned short vendor_id;
+			/** Bits of vendor_id which must match (0 for any). */
+			unsigned short vendor_id_mask;
+			/** Product ID to match, in the bits set in
+			    product_id_mask. */
+			unsigned short product_id;
+			/** Bits of product_id which must match (0 for any). */
+			unsigned short product_id_mask;
+			/** USB interface number (-1 for any). */
+			int interface_number;
+			/** Usage Page (0 for any). */
+			unsigned short usage_page;
+			/** Usage (0 for any). */
+			unsigned short usage;
+			/** USB bus number (0 for any). */
+			int bus_number;
+			/** Prefix of the serial number (NULL for any). */
+			const wchar_t *serial_number;
+		};
+
+		/** Report types, as in the Main item which declares a field.
+		    (The enum has no tag, since linux/hid.h already declares an
+		    enum hid_report_type.) */
+		enum {
+			HID_REPORT_INPUT,
+			HID_REPORT_OUTPUT,
+			HID_REPORT_FEATURE,
+			HID_REPORT_TYPE_COUNT
+		};
+
+		/** One field of a report, as declared by an Input, Output or
+		    Feature item of the report descriptor. A Variable item is
+		    split into one field per element so that each has its own
+		    usage; an Array item is a single field of report_count
+		    elements, each holding the index of one of its usages.
+		    Constant items without usages (padding) are not
+		    listed. */
+		struct hid_report_field {
+			/** Report ID (0 if the device doesn't use numbered
+			    reports). */
+			unsigned char report_id;
+			/** One of HID_REPORT_INPUT, HID_REPORT_OUTPUT or
+			    HID_REPORT_FEATURE. */
+			unsigned char type;
+			/** Data bits of the Main item (Constant, Variable,
+			    Relative, ...; see the HID specification, section
+			    6.2.2.5). */
+			unsigned short flags;
+			/** Offset of the first bit of the field in the report,
+			    not counting the report ID byte. */
+			unsigned int bit_offset;
+			/** Size of each element in bits (Report Size). */
+			unsigned int bit_size;
+			/** Number of elements (1 for Variable items). */
+			unsigned int report_count;
+			/** Logical range of each element. */
+			int logical_minimum;
+			int logical_maximum;
+			/** Physical range of each element. Both are 0 if the
+			    descriptor doesn't declare one, in which case it is
+			    the same as the logical range. */
+			int physical_minimum;
+			int physical_maximum;
+			/** Unit and Unit Exponent (HID specification, section
+			    6.2.2.7). */
+			unsigned int unit;
+			int unit_exponent;
+			/** Usage Page and Usage of a Variable item. For Array
+			    items, these are those of the first usage. */
+			unsigned short usage_page;
+			unsigned short usage;
+			/** The lowest and highest usage of an Array item. The
+			    usages in between only all belong to the item if
+			    it declared them with Usage Minimum and Maximum;
+			    use usages to tell what an element selects. */
+			unsigned short usage_minimum;
+			unsigned short usage_maximum;
+			/** The usages of an Array item, in the order they were
+			    declared, as Usage Page << 16 | Usage. An element
+			    with value v selects usages[v - logical_minimum],
+			    or nothing if that is out of range. NULL for
+			    Variable items. */
+			const unsigned int *usages;
+			unsigned int num_usages;
+		};
+
+		/** Lengths of one numbered (or the unnumbered) report, in
+		    bytes, not counting the report ID byte. A length of 0
+		    means that the device has no such report. */
+		struct hid_report_info {
+			/** Report ID (0 if the device doesn't use numbered
+			    reports). */
+			unsigned char report_id;
+			/** Length of the report of each type, indexed by
+			    HID_REPORT_INPUT, HID_REPORT_OUTPUT and
+			    HID_REPORT_FEATURE. */
+			unsigned int length[HID_REPORT_TYPE_COUNT];
+		};
+
+		/** A parsed HID report descriptor. */
+		struct hid_report_descriptor {
+			/** Usage Page and Usage of the first top-level
+			    collection. */
+			unsigned short usage_page;
+			unsigned short usage;
+			/** Whether reports are prefixed with a report ID. */
+			int uses_numbered_reports;
+			/** The fields of all reports, ordered by report ID,
+			    then by type, then by bit_offset. */
+			struct hid_report_field *fields;
+			size_t num_fields;
+			/** One entry per report ID, in ascending order. */
+			struct hid_report_info *reports;
+			size_t num_reports;
+		};
+
+		/** How a device queues input reports; see hid_set_input_mode(). */
+		enum {
+			/** One queue for all reports (the default). */
+			HID_INPUT_MODE_FIFO,
+			/** One queue per report ID. */
+			HID_INPUT_MODE_PER_REPORT_ID,
+			/** Only the newest report of each report ID. */
+			HID_INPUT_MODE_LATEST
+		};
+
+		/** A value to store in a report with hid_encode_report(). */
+		struct hid_usage_value {
+			/** Usage Page and Usage of the field. */
+			unsigned short usage_page;
+			unsigned short usage;
+			/** Which of the Variable fields with this usage to store
+			    the value in (0 for the first), or which element of
+			    the Array field containing this usage to select it
+			    in. */
+			unsigned int index;
+			/** The logical value. It is truncated to the size of
+			    the field. Ignored for Array fields. */
+			int value;
+		};
+
+		/** Kernels which hid_decode_reports_columnar() can use. */
+		enum {
+			HID_DECODE_KERNEL_SCALAR,
+			HID_DECODE_KERNEL_SSE2,
+			HID_DECODE_KERNEL_AVX2
+		};
+
+		/** How a set of devices waits for input; see
+		    hid_device_set_set_engine(). */
+		enum {
+			/** epoll on hidraw, a ready list on libusb. */
+			HID_IO_ENGINE_DEFAULT,
+			/** io_uring (hidraw only). */
+			HID_IO_ENGINE_IO_URING
+		};
+
+		/** How a read waits for a report; see
+		    hid_set_wait_strategy(). */
+		enum {
+			/** Sleep until a report arrives (the default). */
+			HID_WAIT_BLOCK,
+			/** Spin for a while, then sleep. */
+			HID_WAIT_SPIN_THEN_BLOCK,
+			/** Spin until a report arrives or the time is up. */
+			HID_WAIT_BUSY_POLL
+		};
+
+		/** Configuration of a hid_context. Initialize with
+		    hid_init_context_config(), which sets the defaults, and
+		    then change the settings of interest. */
+		struct hid_context_config {
+			/** The number of reports each queue of a device holds,
+			    as set by hid_set_input_mode() (0 for the
+			    default). */
+			int queue_length;
+			/** How devices queue Input reports, as set by
+			    hid_set_input_mode(). */
+			int input_mode;
+			/** The SCHED_FIFO priority of the event threads, or 0
+			    for normal scheduling. */
+			int event_thread_priority;
+			/** The number of event threads, each with its own
+			    libusb context, which the devices are divided
+			    between (0 for 1). */
+			int event_threads;
+			/** How devices are assigned to event threads:
+			    HID_SHARD_ROUND_ROBIN or HID_SHARD_BANDWIDTH. */
+			int shard_assignment;
+			/** Whether to pin each event thread to its own CPU,
+			    out of those which the process may run on. */
+			int pin_event_threads;
+			/** The number of worker threads which run the input
+			    callbacks of the devices (see
+			    hid_set_input_callback()), or 0 to run them on the
+			    event threads. */
+			int callback_workers;
+		};
+
+		/** How a hid_context assigns devices to its event threads. */
+		enum {
+			/** Each device goes to the next thread in turn. */
+			HID_SHARD_ROUND_ROBIN,
+			/** Each device goes to the thread whose devices have
+			    the least bandwidth, as estimated from the packet
+			    size and polling interval of their Input
+			    endpoints. */
+			HID_SHARD_BANDWIDTH
+		};
+
+		/** Counters of a device's Input reports; see
+		    hid_get_input_stats(). */
+		struct hid_input_stats {
+			/** Reports received from the device. */
+			unsigned long received;
+			/** Reports dropped because a queue was full. */
+			unsigned long dropped;
+			/** Reports waiting to be read. */
+			unsigned long queued;
+		};
+
+		/** How hid_set_aggregation() combines the values of a field. */
+		enum {
+			HID_AGGREGATE_MIN,
+			HID_AGGREGATE_MAX,
+			HID_AGGREGATE_MEAN
+		};
+
+		/** One value decoded from a report by hid_decode_report(). */
+		struct hid_field_value {
+			/** The field the value belongs to. */
+			const struct hid_report_field *field;
+			/** Element of an Array field (0 for Variable fields). */
+			unsigned int index;
+			/** Usage Page and Usage of the value. For an Array
+			    element, this is the usage it selects, or 0 if it
+			    selects none. */
+			unsigned short usage_page;
+			unsigned short usage;
+			/** The logical value, sign-extended if the field's
+			    logical range is signed. */
+			int value;
+			/** The value scaled from the logical to the physical
+			    range, in the field's unit times 10^unit_exponent.
+			    This is value itself for Array elements and for
+			    fields without a physical range. */
+			double physical_value;
+		};
+
 
 		/** @brief Enumerate the HID Devices.
 
@@ -110,6 +375,171 @@ extern "C" {
 		*/
 		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
 
+		/** @brief Initialize an enumeration filter to match all
+			devices.
+
+			@ingroup API
+			@param filter The filter to initialize.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_init_enumerate_filter(struct hid_enumerate_filter *filter);
+
+		/** @brief Enumerate the HID Devices which match a filter.
+
+			This function returns a linked list of all the HID devices
+			attached to the system which match every criterion of
+			@p filter. Each criterion is checked as early as possible,
+			so that no device is opened or queried for information
+			once it is known not to match. Linux only.
+
+			On Linux/libusb, the serial number is the only string that
+			is fetched from a device before the other criteria have
+			been checked. Usage Page and Usage are checked before the
+			device is opened, and only match while the kernel's HID
+			driver is bound to the interface.
+
+			@ingroup API
+			@param filter The criteria which devices must match, or
+				NULL to return all HID devices.
+
+		    @returns
+		    	This function returns a pointer to a linked list of type
+		    	struct #hid_device_info, or NULL if no devices match or in
+		    	the case of failure. Free this linked list by calling
+		    	hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_filtered(const struct hid_enumerate_filter *filter);
+
+		/** @brief Callback for hid_enumerate_each().
+
+			@ingroup API
+			@param dev The device found. The record and its strings
+				are only valid until the callback returns, and its
+				next pointer is always NULL.
+			@param user_data The pointer passed to hid_enumerate_each().
+
+			@returns
+				Return 0 to continue the enumeration, or non-zero to
+				stop it.
+		*/
+		typedef int (HID_API_CALL *hid_enumerate_cb)(const struct hid_device_info *dev, void *user_data);
+
+		/** @brief Enumerate the HID Devices which match a filter,
+			one at a time.
+
+			Instead of building a linked list, this function calls
+			@p callback for each device which matches @p filter as soon
+			as the device has been found, so the caller can begin
+			working with the first device while the rest of the system
+			is still being searched. The callback runs on the calling
+			thread, and can stop the enumeration early. On Linux/libusb,
+			devices are reported in the order in which their strings
+			arrive. Linux only.
+
+			@ingroup API
+			@param filter The criteria which devices must match, or
+				NULL to match all HID devices.
+			@param callback The function to call for each device.
+			@param user_data A pointer which is passed to @p callback.
+
+			@returns
+				This function returns the number of devices passed to
+				@p callback, or -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enumerate_each(const struct hid_enumerate_filter *filter, hid_enumerate_cb callback, void *user_data);
+
+		/** @brief Enumerate the HID Devices into caller-provided storage.
+
+			This function performs the same search as hid_enumerate(),
+			but instead of allocating a linked list, it writes one
+			record per device into @p devs and copies the path and
+			strings of each record into the @p strings pool. The
+			string pointers in each record point into @p strings, and
+			the next pointer of each record points to the following
+			element of @p devs (NULL for the last one), so the result
+			can be walked like the list returned by hid_enumerate().
+			Do not call hid_free_enumeration() on it.
+
+			A record is only written if both it and all of its strings
+			fit. Devices which do not fit are still counted, so that the
+			caller can size its buffers and call again.
+
+			Linux only.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the types of device
+				to open.
+			@param product_id The Product ID (PID) of the types of
+				device to open.
+			@param devs An array of records to fill in.
+			@param num_devs The number of elements in @p devs.
+			@param strings A buffer to hold the strings of the records,
+				aligned for wchar_t, as memory from malloc() is.
+				It may be NULL if @p strings_len is 0.
+			@param strings_len On input, the size of @p strings in
+				bytes. On output, the number of bytes required to hold
+				the strings of all the devices found.
+
+			@returns
+				This function returns the number of devices found, which
+				is larger than @p num_devs if @p devs was too small, or -1
+				on error, including a misaligned @p strings. The result is complete if the return value is
+				at most @p num_devs and @p strings_len did not grow.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enumerate_into(unsigned short vendor_id, unsigned short product_id, struct hid_device_info *devs, size_t num_devs, void *strings, size_t *strings_len);
+
+		/** @brief Set how long enumeration waits for device strings.
+
+			On Linux/libusb, the strings of all the devices are
+			requested from the devices at the same time, and
+			enumeration waits at most this long for them to arrive.
+			Devices which have not answered by then are reported without
+			their strings. On other platforms the strings come from the
+			operating system, and this setting has no effect. The
+			default is 1000 milliseconds.
+
+			@ingroup API
+			@param milliseconds The deadline for each enumeration, in
+				milliseconds.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_enumerate_timeout(int milliseconds);
+
+		/** @brief Enable or disable the enumeration cache.
+
+			When the cache is enabled, the first enumeration scans the
+			system for all HID devices and keeps the result. Later
+			enumerations from any thread are answered from it, for as
+			long as hid_enumerate_generation() does not change. Filters
+			on the bus number always scan the system. The cache is
+			disabled by default. Linux only.
+
+			@ingroup API
+			@param enable 1 to enable the cache, or 0 to disable it and
+				free its contents.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_enumerate_cache(int enable);
+
+		/** @brief Get the generation of the set of attached devices.
+
+			The value returned changes whenever a HID device may have
+			been attached or removed, so a caller which saves it can
+			skip re-enumerating until it changes. Checking is cheap: it
+			uses hotplug notifications where they are available, and
+			otherwise compares the list of device nodes without talking
+			to any device. Linux only.
+
+			@ingroup API
+
+			@returns
+				This function returns the current generation.
+		*/
+		unsigned long HID_API_EXPORT HID_API_CALL hid_enumerate_generation(void);
+
 		/** @brief Open a HID device using a Vendor ID (VID), Product ID
 			(PID) and optionally a serial number.
 
@@ -143,6 +573,85 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** @brief Initialize a context configuration with the
+			defaults.
+
+			@ingroup API
+			@param config The configuration to initialize.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_init_context_config(struct hid_context_config *config);
+
+		/** @brief Create a context to open devices through.
+
+			On Linux/libusb, each context has its own libusb
+			context, and its own thread which handles the events of
+			the devices opened through it. Devices in different
+			contexts don't contend for the same libusb event lock,
+			and a context can be torn down without affecting the
+			others. A context can also have several event threads,
+			each with its own libusb context and share of the
+			devices, so that many devices can be handled on several
+			CPUs. hid_open() and hid_open_path() use a default
+			context, which lasts as long as the process. Devices
+			opened through a context start out with its
+			configuration. On Linux/hidraw, where the kernel reads
+			the devices, devices get a read thread (see
+			hid_start_read_thread()) if the configuration's
+			queue_length isn't 0, and the event thread and callback
+			worker settings are ignored. Linux only.
+
+			@ingroup API
+			@param config The configuration, or NULL for the
+				defaults.
+
+			@returns
+				This function returns a pointer to a #hid_context
+				object on success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_context * HID_API_CALL hid_context_init(const struct hid_context_config *config);
+
+		/** @brief Tear down a context.
+
+			Closes the devices which are still open through the
+			context, and frees it.
+
+			@ingroup API
+			@param ctx A context returned from hid_context_init().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_context_exit(hid_context *ctx);
+
+		/** @brief Open a HID device through a context.
+
+			Works like hid_open(). Linux only.
+
+			@ingroup API
+			@param ctx A context returned from hid_context_init().
+			@param vendor_id The Vendor ID (VID) of the device to open.
+			@param product_id The Product ID (PID) of the device to open.
+			@param serial_number The Serial Number of the device to open
+				(Optionally NULL).
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number);
+
+		/** @brief Open a HID device by its path name through a
+			context.
+
+			Works like hid_open_path(). Linux only.
+
+			@ingroup API
+			@param ctx A context returned from hid_context_init().
+			@param path The path name of the device to open.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_context_open_path(hid_context *ctx, const char *path);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -191,6 +700,33 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
 
+		/** @brief Read an Input report from a HID device until a deadline.
+
+			Works like hid_read_timeout(), but waits until an
+			absolute time on CLOCK_MONOTONIC (as returned by
+			clock_gettime()), in nanoseconds, instead of for a
+			number of milliseconds. The deadline doesn't move when
+			the system clock is set, and a loop can read at a fixed
+			rate without the error of each timeout adding up. A
+			deadline which has passed makes it return at once, as
+			a timeout of 0 does. Linux only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read. For devices with
+				multiple reports, make sure to read an extra byte for
+				the report number.
+			@param deadline_ns The CLOCK_MONOTONIC time to wait until,
+				in nanoseconds, or -1 for blocking wait.
+
+			@returns
+				This function returns the actual number of bytes
+				read, 0 if no report arrived in time, and -1 on
+				error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_deadline(hid_device *device, unsigned char *data, size_t length, long long deadline_ns);
+
 		/** @brief Read an Input report from a HID device.
 
 			Input reports are returned
@@ -210,6 +746,487 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *device, unsigned char *data, size_t length);
 
+		/** @brief Read an Input report with a given report ID.
+
+			Works like hid_read_timeout(), but only returns reports
+			with the ID @p report_id, leaving others queued. The
+			device must be in HID_INPUT_MODE_PER_REPORT_ID or
+			HID_INPUT_MODE_LATEST mode.
+			Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param report_id The report ID to read (0 if the device
+				doesn't use numbered reports).
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read.
+			@param milliseconds timeout in milliseconds or -1 for
+				blocking wait.
+
+			@returns
+				This function returns the actual number of bytes
+				read, 0 if no report arrived in time, and -1 on
+				error or if the device isn't queueing reports by
+				report ID.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_report_id_timeout(hid_device *device, unsigned char report_id, unsigned char *data, size_t length, int milliseconds);
+
+		/** @brief Set how a device queues Input reports.
+
+			In HID_INPUT_MODE_FIFO mode, every report goes to one
+			queue, so a report ID which is sent often can push
+			reports with other IDs out of it. In
+			HID_INPUT_MODE_PER_REPORT_ID mode, each report ID has
+			its own queue. hid_read() still returns the oldest
+			report of any ID, and hid_read_report_id_timeout()
+			returns the oldest of one ID. When a queue is full, its
+			oldest report is dropped. HID_INPUT_MODE_LATEST is like
+			HID_INPUT_MODE_PER_REPORT_ID with queues of one report,
+			which each new report overwrites in place, so readers
+			always get the newest report of each ID and never a
+			backlog. Reports already queued are dropped when the
+			mode is set. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param mode HID_INPUT_MODE_FIFO,
+				HID_INPUT_MODE_PER_REPORT_ID or
+				HID_INPUT_MODE_LATEST.
+			@param queue_length The number of reports each queue
+				holds, or 0 for the default of 32. Ignored in
+				HID_INPUT_MODE_LATEST.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_mode(hid_device *device, int mode, int queue_length);
+
+		/** @brief Read Input reports in a background thread.
+
+			The hidraw driver only buffers a few reports per reader,
+			and drops reports when the application doesn't read
+			them quickly enough. With a read thread, reports are
+			read from the driver as soon as they arrive, and queued
+			in user space until hid_read() returns them. Timeouts,
+			non-blocking reads, device sets and hid_get_input_stats()
+			work as without a thread. The thread must be started
+			before the device is added to a device set, and runs
+			until the device is closed.
+
+			The libusb implementation always reads in a background
+			thread; there this only sets the length of the queues,
+			as hid_set_input_mode() does. Linux only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param queue_length The number of reports to queue, or 0
+				for the default (1024 on hidraw, 32 on libusb). When
+				the queue is full, the oldest report is dropped.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_start_read_thread(hid_device *device, int queue_length);
+
+		/** @brief Get the counters of a device's Input reports.
+
+			On hidraw without a read thread, the kernel queues the
+			reports, so only the reports which have been read are
+			counted, as received. Linux only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats Where to store the counters.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_input_stats(hid_device *device, struct hid_input_stats *stats);
+
+		/** @brief Set how reads wait for Input reports.
+
+			Sleeping until a report arrives costs the time it takes
+			the thread to wake up, which can be tens of
+			microseconds. Spinning returns sooner, at the cost of a
+			busy CPU. With HID_WAIT_SPIN_THEN_BLOCK, reads which
+			wait spin for @p spin_microseconds before sleeping. With
+			HID_WAIT_BUSY_POLL, they spin until a report arrives or
+			their timeout expires. Non-blocking reads never wait.
+			On hidraw without a read thread, spinning means calling
+			poll() without a timeout; reads on devices in an
+			io_uring set always block. Linux only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param strategy HID_WAIT_BLOCK, HID_WAIT_SPIN_THEN_BLOCK
+				or HID_WAIT_BUSY_POLL.
+			@param spin_microseconds How long to spin with
+				HID_WAIT_SPIN_THEN_BLOCK.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_wait_strategy(hid_device *device, int strategy, int spin_microseconds);
+
+		/** @brief Callback for hid_set_flow_control().
+
+			Called when a device's queues fill up to the high
+			watermark and it stops being polled, and when they have
+			been read down to the low watermark and polling resumes.
+			It is called from the thread which read the device or
+			received the report, with no locks held. hid_close()
+			waits for it to return, so it must not close the
+			device.
+
+			@ingroup API
+			@param device The device.
+			@param above 1 if the high watermark was reached, 0 if
+				polling resumed.
+			@param user_data The pointer passed to
+				hid_set_flow_control().
+		*/
+		typedef void (HID_API_CALL *hid_watermark_callback)(hid_device *device, int above, void *user_data);
+
+		/** @brief Stop polling a device while its queues are full.
+
+			Normally, when the application falls behind, the oldest
+			queued reports are dropped. With flow control, reports
+			are never dropped. Instead, once @p high_watermark
+			reports are queued, the Input endpoint isn't polled any
+			more, so the device NAKs and buffers reports on its
+			side, as far as it can. Polling resumes once reads have
+			brought the number of queued reports down to
+			@p low_watermark. In HID_INPUT_MODE_LATEST, new reports
+			still replace unread ones. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param high_watermark The number of queued reports at
+				which polling stops, or 0 to turn flow control
+				off.
+			@param low_watermark The number of queued reports at
+				which polling resumes. Must be less than
+				@p high_watermark.
+			@param callback A function to call when either
+				watermark is crossed, or NULL.
+			@param user_data A pointer to pass to @p callback.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_flow_control(hid_device *device, int high_watermark, int low_watermark, hid_watermark_callback callback, void *user_data);
+
+		/** @brief Only poll a device while its reports are wanted.
+
+			Normally a device's Input endpoint is polled for as
+			long as it is open, even if the application only writes
+			to it, which uses bus bandwidth and CPU time, and keeps
+			the device from suspending. With demand polling, the
+			endpoint stops being polled once no read has been
+			waiting on the device for @p idle_milliseconds, and
+			polling resumes at the next read, which therefore may
+			find no reports even though the device sent some.
+			Devices in a device set, or with snapshots enabled, are
+			always polled. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param idle_milliseconds How long to keep polling after
+				the last read, or 0 to always poll (the
+				default).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_demand_polling(hid_device *device, int idle_milliseconds);
+
+		/** @brief Function called with each Input report of a device,
+			set by hid_set_input_callback().
+
+			@ingroup API
+			@param device The device.
+			@param data The report, starting with the report ID if
+				the device uses numbered reports. It is only
+				valid until the callback returns.
+			@param length The length of the report.
+			@param user_data The pointer passed to
+				hid_set_input_callback().
+		*/
+		typedef void (HID_API_CALL *hid_input_callback)(hid_device *device, const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Have a function called with each Input report of a
+			device instead of queueing it.
+
+			Reports are passed to @p callback in the order they
+			arrived, after hid_set_change_only(),
+			hid_set_decimation() and hid_set_aggregation() have
+			had their say, and are no longer queued for
+			hid_read(). Reports already queued stay there. Unless
+			the device's context has callback workers (see
+			hid_context_config), the callback runs on the event
+			thread, and a slow callback delays the reports of the
+			other devices of that thread. The event thread can't
+			handle events while it runs the callback, so the
+			callback then must not close any device of the context,
+			remove its callback or wait for its reports, which all
+			wait for the event thread. With callback workers, the
+			event thread only hands the reports over, and the
+			workers run the callbacks, taking work from each other
+			when they run out; the callbacks of one device still
+			never run concurrently or out of order. If the callback
+			falls more than the device's queue length behind, the
+			oldest reports are dropped. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param callback The function to call, or NULL to go
+				back to queueing reports. Once this function
+				has returned with NULL, the old callback isn't
+				running and won't be called again. The same
+				goes for hid_close(), so neither may be called
+				on the device from its own callback.
+			@param user_data A pointer to pass to @p callback.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_callback(hid_device *device, hid_input_callback callback, void *user_data);
+
+		/** @brief Start keeping a snapshot of the newest report of
+			each report ID.
+
+			Once enabled, the reader thread copies every Input report
+			into the snapshot of its report ID, besides queueing it as
+			usual. Any number of threads can then read the snapshots
+			with hid_read_snapshot() without locking, and without
+			consuming reports from the queues. Snapshots stay enabled
+			until the device is closed. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enable_snapshots(hid_device *device);
+
+		/** @brief Read the snapshot of the newest report with a given
+			report ID.
+
+			This doesn't take a lock, and never waits for the reader
+			thread: if it races with an update, it copies the report
+			again. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param report_id The report ID to read (0 if the device
+				doesn't use numbered reports).
+			@param data A buffer to put the report into.
+			@param length The size of @p data.
+			@param sequence If not NULL, the number of reports with
+				this ID received so far is stored here. Callers can
+				compare it with the previous one to see if the
+				report changed.
+
+			@returns
+				This function returns the number of bytes copied, 0
+				if no report with this ID has arrived yet, and -1 if
+				snapshots aren't enabled.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_snapshot(hid_device *device, unsigned char report_id, unsigned char *data, size_t length, unsigned long *sequence);
+
+		/** @brief Only queue Input reports which changed.
+
+			When enabled, each Input report is compared with the last
+			report of the same ID which was queued, and is dropped if
+			it is the same, ignoring the bits set with
+			hid_set_change_mask(). Snapshots (see
+			hid_enable_snapshots()) are still updated. Linux/libusb
+			only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param enable 1 to drop unchanged reports, 0 to queue
+				every report (the default).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_change_only(hid_device *device, int enable);
+
+		/** @brief Set which bits of a report don't count as changes.
+
+			Bits which are set in @p mask are ignored when
+			hid_set_change_only() compares reports with the ID
+			@p report_id, so fields such as counters and timestamps
+			don't make a report count as changed. The mask is laid
+			out like the report, including the report ID byte if
+			the device uses numbered reports. A mask for some fields
+			can be made by encoding them with the value -1 into a
+			zeroed report, with an encoder created for
+			HID_REPORT_INPUT. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param report_id The report ID the mask is for (0 if the
+				device doesn't use numbered reports).
+			@param mask The bits to ignore, or NULL to compare every
+				bit.
+			@param length The length of @p mask. Bits past it are
+				compared.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_change_mask(hid_device *device, unsigned char report_id, const unsigned char *mask, size_t length);
+
+		/** @brief Only queue every Nth Input report of each report ID.
+
+			The reader thread drops the other reports before they
+			are queued, so readers aren't woken for them. Snapshots
+			(see hid_enable_snapshots()) are still updated with every
+			report. Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param n Queue the first of every @p n reports, or 0 or
+				1 to queue every report (the default).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_decimation(hid_device *device, int n);
+
+		/** @brief Queue one aggregated Input report per report ID per
+			time window.
+
+			The reader thread decodes the reports it receives and
+			keeps, for each report ID, the minimum, maximum and sum
+			of each field. When a window ends, it queues the last
+			report of the window, with each Variable field replaced
+			by its minimum, maximum or mean over the window (Array
+			fields, such as lists of pressed keys, are left as they
+			were in the last report). The reports themselves are not
+			queued. A window starts with the first report after the
+			previous one ended, so no reports are queued while the
+			device sends nothing. Decimation (see
+			hid_set_decimation()) takes precedence over aggregation.
+			Linux/libusb only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param function HID_AGGREGATE_MIN, HID_AGGREGATE_MAX or
+				HID_AGGREGATE_MEAN.
+			@param milliseconds The length of the windows, or 0 to
+				queue every report (the default).
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				or if the report descriptor is unknown.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_aggregation(hid_device *device, int function, int milliseconds);
+
+		/** @brief Create a set of devices to wait on.
+
+			One thread can wait for input from any of the devices
+			in a set with hid_device_set_wait(), instead of one
+			thread per device calling hid_read_timeout(). Linux only.
+
+			@ingroup API
+
+			@returns
+				This function returns a pointer to the set, or NULL
+				in the case of failure. Free it by calling
+				hid_device_set_free().
+		*/
+		HID_API_EXPORT hid_device_set * HID_API_CALL hid_device_set_create(void);
+
+		/** @brief Free a set of devices.
+
+			The devices themselves are not closed. Linux only.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_create().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_device_set_free(hid_device_set *set);
+
+		/** @brief Select how a set of devices does I/O.
+
+			With HID_IO_ENGINE_IO_URING, a read is kept posted on
+			each device through one io_uring, and the reports are
+			collected in batches, so that reading many devices takes
+			few system calls. hid_read() and hid_write() on the
+			devices of the set go through the io_uring as well, and
+			must be called from the thread which calls
+			hid_device_set_wait(). Each device keeps up to 64
+			reports; when it has more, the oldest are dropped.
+
+			The engine can only be changed while the set is empty.
+			Linux/hidraw only.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_create().
+			@param engine HID_IO_ENGINE_DEFAULT or
+				HID_IO_ENGINE_IO_URING.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				or if the engine isn't available, in which case
+				the set keeps its current engine.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_device_set_set_engine(hid_device_set *set, int engine);
+
+		/** @brief Add a device to a set.
+
+			A device can be in one set at a time. It is removed
+			from its set when it is closed. Linux only.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_create().
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				or if the device is already in a set.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_device_set_add(hid_device_set *set, hid_device *device);
+
+		/** @brief Remove a device from a set.
+
+			Linux only.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_create().
+			@param device A device in @p set.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				or if the device isn't in @p set.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_device_set_remove(hid_device_set *set, hid_device *device);
+
+		/** @brief Wait until any device in a set has input.
+
+			A device is ready when hid_read() would return without
+			waiting: when it has an Input report, or when it has
+			been disconnected. Devices stay ready until their input
+			is read, so a device which isn't read is returned again
+			by the next call. Linux only.
+
+			@ingroup API
+			@param set A set returned from hid_device_set_create().
+			@param ready An array to put the ready devices into.
+			@param max_ready The size of @p ready.
+			@param milliseconds timeout in milliseconds or -1 for
+				blocking wait.
+
+			@returns
+				This function returns the number of devices put in
+				@p ready, 0 if none was ready in time, and -1 on
+				error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_device_set_wait(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds);
+
 		/** @brief Set the device handle to be non-blocking.
 
 			In non-blocking mode calls to hid_read() will return
@@ -335,6 +1352,239 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *device, int string_index, wchar_t *string, size_t maxlen);
 
+		/** @brief Parse a HID report descriptor.
+
+			Parses every Main, Global and Local item of a report
+			descriptor into the list of fields and the report
+			lengths it describes. Parsing stops at the first
+			truncated item. Linux only.
+
+			@ingroup API
+			@param data The report descriptor.
+			@param length The length of @p data in bytes.
+
+			@returns
+				This function returns a pointer to the parsed
+				descriptor, or NULL if it is malformed or in the case
+				of failure. Free it
+				by calling hid_free_report_descriptor().
+		*/
+		struct hid_report_descriptor HID_API_EXPORT * HID_API_CALL hid_parse_report_descriptor(const unsigned char *data, size_t length);
+
+		/** @brief Free a parsed HID report descriptor.
+
+			Frees a descriptor returned by hid_parse_report_descriptor().
+			Linux only.
+
+			@ingroup API
+			@param descriptor The descriptor to free.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_free_report_descriptor(struct hid_report_descriptor *descriptor);
+
+		/** @brief Get the parsed report descriptor of a device.
+
+			The descriptor is read and parsed once, when the device
+			is opened. Linux only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the device's parsed report
+				descriptor, which is freed by hid_close(), or NULL if
+				it couldn't be read.
+		*/
+		const struct hid_report_descriptor HID_API_EXPORT * HID_API_CALL hid_get_report_descriptor(hid_device *device);
+
+		/** @brief Create a decoder for the reports of a descriptor.
+
+			Compiles the shifts, masks, sign extensions and scaling
+			needed to extract every field of every report of
+			@p type, so that hid_decode_report() doesn't have to
+			look at the descriptor. Linux only.
+
+			@ingroup API
+			@param descriptor A parsed report descriptor, which must
+				outlive the decoder.
+			@param type HID_REPORT_INPUT, HID_REPORT_OUTPUT or
+				HID_REPORT_FEATURE.
+
+			@returns
+				This function returns a pointer to the decoder, or
+				NULL in the case of failure. Free it by calling
+				hid_report_decoder_free().
+		*/
+		HID_API_EXPORT hid_report_decoder * HID_API_CALL hid_report_decoder_create(const struct hid_report_descriptor *descriptor, int type);
+
+		/** @brief Free a report decoder.
+
+			Linux only.
+
+			@ingroup API
+			@param decoder A decoder returned from
+				hid_report_decoder_create().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_report_decoder_free(hid_report_decoder *decoder);
+
+		/** @brief Get the largest number of values in one report.
+
+			A values array of this size is large enough for
+			hid_decode_report() to decode any report. Linux only.
+
+			@ingroup API
+			@param decoder A decoder returned from
+				hid_report_decoder_create().
+
+			@returns
+				This function returns the number of values.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_report_decoder_max_values(hid_report_decoder *decoder);
+
+		/** @brief Decode a report into its field values.
+
+			@p data is a report as returned by hid_read(), starting
+			with the report ID if the device uses numbered reports.
+			The values are stored in the order of the fields in the
+			descriptor. Fields which lie past the end of a short
+			report are left out. Linux only.
+
+			@ingroup API
+			@param decoder A decoder returned from
+				hid_report_decoder_create().
+			@param data The report.
+			@param length The length of @p data in bytes.
+			@param values The array to store the values in.
+			@param max_values The number of elements in @p values.
+
+			@returns
+				This function returns the number of values stored,
+				or -1 if the report ID is unknown.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_report_decoder *decoder, const unsigned char *data, size_t length, struct hid_field_value *values, size_t max_values);
+
+		/** @brief Decode many reports into one array per value.
+
+			Decodes @p num_reports full-length reports, which must all
+			have the same report ID, and stores the logical value of
+			each into the array for it. Column i receives the values
+			which hid_decode_report() stores in values[i] for a
+			full-length report. This is meant for decoding captured
+			reports in bulk. Linux only.
+
+			@ingroup API
+			@param decoder A decoder returned from
+				hid_report_decoder_create().
+			@param reports The reports, each as returned by
+				hid_read().
+			@param stride The distance between the starts of two
+				reports in bytes, which must be at least the
+				length of a report.
+			@param num_reports The number of reports.
+			@param columns An array of @p num_columns arrays of
+				@p num_reports ints each. Columns which are NULL
+				are skipped.
+			@param num_columns The number of elements in
+				@p columns.
+
+			@returns
+				This function returns the number of reports decoded,
+				or -1 if the report ID is unknown or @p stride is
+				too short.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_decode_reports_columnar(hid_report_decoder *decoder, const unsigned char *reports, size_t stride, size_t num_reports, int **columns, size_t num_columns);
+
+		/** @brief Choose the kernel of hid_decode_reports_columnar().
+
+			hid_report_decoder_create() picks the fastest kernel the
+			CPU supports, so this is only needed to compare them.
+			Linux only.
+
+			@ingroup API
+			@param decoder A decoder returned from
+				hid_report_decoder_create().
+			@param kernel HID_DECODE_KERNEL_SCALAR,
+				HID_DECODE_KERNEL_SSE2 or HID_DECODE_KERNEL_AVX2.
+
+			@returns
+				This function returns 0 on success and -1 if the
+				CPU doesn't support @p kernel.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_report_decoder_set_kernel(hid_report_decoder *decoder, int kernel);
+
+		/** @brief Create an encoder for the reports of a descriptor.
+
+			Compiles where every usage of every report of @p type
+			is stored, so that hid_encode_report() doesn't have to
+			look at the descriptor. Each opened device already has
+			encoders for its output and feature reports; see
+			hid_get_report_encoder(). Linux only.
+
+			@ingroup API
+			@param descriptor A parsed report descriptor, which must
+				outlive the encoder.
+			@param type HID_REPORT_OUTPUT or HID_REPORT_FEATURE.
+
+			@returns
+				This function returns a pointer to the encoder, or
+				NULL in the case of failure. Free it by calling
+				hid_report_encoder_free().
+		*/
+		HID_API_EXPORT hid_report_encoder * HID_API_CALL hid_report_encoder_create(const struct hid_report_descriptor *descriptor, int type);
+
+		/** @brief Free a report encoder.
+
+			Linux only.
+
+			@ingroup API
+			@param encoder An encoder returned from
+				hid_report_encoder_create().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_report_encoder_free(hid_report_encoder *encoder);
+
+		/** @brief Get the encoder of a device's reports.
+
+			The encoders are compiled once, when the device is
+			opened. Linux only.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param type HID_REPORT_OUTPUT or HID_REPORT_FEATURE.
+
+			@returns
+				This function returns the encoder, which is freed by
+				hid_close(), or NULL if the device's report
+				descriptor couldn't be read.
+		*/
+		HID_API_EXPORT hid_report_encoder * HID_API_CALL hid_get_report_encoder(hid_device *device, int type);
+
+		/** @brief Encode a report from values keyed by usage.
+
+			Stores the report ID (0 if the device doesn't use
+			numbered reports) in the first byte of @p data, followed
+			by the report with each of @p values packed into its
+			field and every other field set to 0. The result can be
+			passed to hid_write() or hid_send_feature_report() as it
+			is. Linux only.
+
+			@ingroup API
+			@param encoder An encoder returned from
+				hid_report_encoder_create() or
+				hid_get_report_encoder().
+			@param report_id The report ID (0 if the device doesn't
+				use numbered reports).
+			@param values The values to store.
+			@param num_values The number of elements in @p values.
+			@param data The buffer to put the report into.
+			@param length The size of @p data in bytes.
+
+			@returns
+				This function returns the length of the report
+				including the report ID byte, or -1 if the report
+				ID is unknown, @p data is too short, or a usage
+				isn't in the report.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_encode_report(hid_report_encoder *encoder, unsigned char report_id, const struct hid_usage_value *values, size_t num_values, unsigned char *data, size_t length);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			@ingroup API
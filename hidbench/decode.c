@@ -0,0 +1,413 @@
+/*******************************************************
+ HIDAPI - Report decoding benchmark
+
+ Decodes generated input reports of a gamepad-like
+ report descriptor with hid_decode_report(), and with
+ a naive decoder which reads each field bit by bit.
+ Then decodes a batch of reports into columns with
+ hid_decode_reports_columnar(), using each kernel the
+ CPU supports. Before that, checks an Array item whose
+ usages aren't contiguous. No device is needed.
+
+ Copyright 2009, All Rights Reserved.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hidapi.h"
+
+/* Report 1: 16 buttons, a hat switch, four signed 16-bit axes with a
+   physical range, two 12-bit triggers and an 8-bit slider. */
+static const unsigned char report_descriptor[] = {
+	0x05, 0x01,       /* Usage Page (Generic Desktop) */
+	0x09, 0x05,       /* Usage (Game Pad) */
+	0xa1, 0x01,       /* Collection (Application) */
+	0x85, 0x01,       /*   Report ID (1) */
+	0x05, 0x09,       /*   Usage Page (Button) */
+	0x19, 0x01,       /*   Usage Minimum (1) */
+	0x29, 0x10,       /*   Usage Maximum (16) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x25, 0x01,       /*   Logical Maximum (1) */
+	0x75, 0x01,       /*   Report Size (1) */
+	0x95, 0x10,       /*   Report Count (16) */
+	0x81, 0x02,       /*   Input (Data,Var,Abs) */
+	0x05, 0x01,       /*   Usage Page (Generic Desktop) */
+	0x09, 0x39,       /*   Usage (Hat switch) */
+	0x25, 0x07,       /*   Logical Maximum (7) */
+	0x75, 0x04,       /*   Report Size (4) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0x81, 0x42,       /*   Input (Data,Var,Abs,Null) */
+	0x75, 0x04,       /*   Report Size (4) */
+	0x81, 0x01,       /*   Input (Const) */
+	0x09, 0x30,       /*   Usage (X) */
+	0x09, 0x31,       /*   Usage (Y) */
+	0x09, 0x33,       /*   Usage (Rx) */
+	0x09, 0x34,       /*   Usage (Ry) */
+	0x16, 0x00, 0x80, /*   Logical Minimum (-32768) */
+	0x26, 0xff, 0x7f, /*   Logical Maximum (32767) */
+	0x36, 0x00, 0xfc, /*   Physical Minimum (-1024) */
+	0x46, 0x00, 0x04, /*   Physical Maximum (1024) */
+	0x75, 0x10,       /*   Report Size (16) */
+	0x95, 0x04,       /*   Report Count (4) */
+	0x81, 0x02,       /*   Input (Data,Var,Abs) */
+	0x09, 0x32,       /*   Usage (Z) */
+	0x09, 0x35,       /*   Usage (Rz) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x26, 0xff, 0x0f, /*   Logical Maximum (4095) */
+	0x35, 0x00,       /*   Physical Minimum (0) */
+	0x45, 0x00,       /*   Physical Maximum (0) */
+	0x75, 0x0c,       /*   Report Size (12) */
+	0x95, 0x02,       /*   Report Count (2) */
+	0x81, 0x02,       /*   Input (Data,Var,Abs) */
+	0x09, 0x36,       /*   Usage (Slider) */
+	0x26, 0xff, 0x00, /*   Logical Maximum (255) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0x81, 0x02,       /*   Input (Data,Var,Abs) */
+	0xc0              /* End Collection */
+};
+
+/* A Consumer Control array whose usages are listed out of order, as
+   many keyboards and remotes declare them. */
+static const unsigned char consumer_descriptor[] = {
+	0x05, 0x0c,       /* Usage Page (Consumer) */
+	0x09, 0x01,       /* Usage (Consumer Control) */
+	0xa1, 0x01,       /* Collection (Application) */
+	0x85, 0x02,       /*   Report ID (2) */
+	0x15, 0x01,       /*   Logical Minimum (1) */
+	0x25, 0x04,       /*   Logical Maximum (4) */
+	0x09, 0xe9,       /*   Usage (Volume Increment) */
+	0x09, 0xea,       /*   Usage (Volume Decrement) */
+	0x09, 0xe2,       /*   Usage (Mute) */
+	0x09, 0xcd,       /*   Usage (Play/Pause) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0x81, 0x00,       /*   Input (Data,Array,Abs) */
+	0xc0              /* End Collection */
+};
+
+static const unsigned short consumer_usages[] = { 0xe9, 0xea, 0xe2, 0xcd };
+
+/* A vendor-defined report which declares the reserved Report ID 0, as a
+   few devices do, and prefixes its reports with it. */
+static const unsigned char zero_id_descriptor[] = {
+	0x06, 0x00, 0xff, /* Usage Page (Vendor Defined) */
+	0x09, 0x01,       /* Usage (1) */
+	0xa1, 0x01,       /* Collection (Application) */
+	0x85, 0x00,       /*   Report ID (0) */
+	0x09, 0x02,       /*   Usage (2) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x26, 0xff, 0x00, /*   Logical Maximum (255) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0x81, 0x02,       /*   Input (Data,Var,Abs) */
+	0xc0              /* End Collection */
+};
+
+#define NUM_REPORTS 1024
+#define RUNS 5
+#define BATCH_REPORTS (64 * 1024)
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Times hid_decode_reports_columnar() with each kernel on a batch of
+   reports, after checking that it agrees with hid_decode_report(). */
+static int bench_columnar(hid_report_decoder *dec, int max_values, size_t report_len)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+	struct hid_field_value *values;
+	unsigned char *reports;
+	int **columns;
+	int kernel, i, j, r, n;
+
+	values = calloc(max_values, sizeof(struct hid_field_value));
+	columns = calloc(max_values, sizeof(int *));
+	for (i = 0; i < max_values; i++)
+		columns[i] = malloc(BATCH_REPORTS * sizeof(int));
+	reports = malloc(BATCH_REPORTS * report_len);
+	for (i = 0; i < BATCH_REPORTS; i++) {
+		reports[i * report_len] = 1;
+		for (j = 1; j < (int)report_len; j++)
+			reports[i * report_len + j] = rand();
+	}
+
+	for (kernel = HID_DECODE_KERNEL_SCALAR; kernel <= HID_DECODE_KERNEL_AVX2; kernel++) {
+		double best = 0.0;
+
+		if (hid_report_decoder_set_kernel(dec, kernel) < 0) {
+			printf("columnar, %-6s          not supported by this CPU\n", names[kernel]);
+			continue;
+		}
+
+		for (r = 0; r < RUNS; r++) {
+			double t = now_ns();
+			hid_decode_reports_columnar(dec, reports, report_len, BATCH_REPORTS, columns, max_values);
+			t = now_ns() - t;
+			if (r == 0 || t < best)
+				best = t;
+		}
+
+		for (i = 0; i < BATCH_REPORTS; i++) {
+			n = hid_decode_report(dec, reports + i * report_len, report_len, values, max_values);
+			for (j = 0; j < n; j++) {
+				if (columns[j][i] != values[j].value) {
+					printf("Columnar decoding (%s) disagrees on value %d of report %d\n", names[kernel], j, i);
+					return -1;
+				}
+			}
+		}
+
+		printf("columnar, %-6s   %12.0f reports/s\n", names[kernel], BATCH_REPORTS / (best / 1e9));
+	}
+
+	for (i = 0; i < max_values; i++)
+		free(columns[i]);
+	free(columns);
+	free(values);
+	free(reports);
+
+	return 0;
+}
+
+/* Checks that each element value of the Consumer Control array selects
+   the usage it was declared with, and that 0 selects none, and that
+   hid_encode_report() picks the same values. The array is declared as an
+   Input item, so the encoder is made for Input reports. Returns 0, or -1
+   if not. */
+static int check_array_usages(void)
+{
+	struct hid_report_descriptor *desc;
+	const struct hid_report_field *f;
+	hid_report_decoder *dec;
+	hid_report_encoder *enc;
+	struct hid_field_value value;
+	unsigned int i;
+
+	desc = hid_parse_report_descriptor(consumer_descriptor, sizeof(consumer_descriptor));
+	if (!desc || desc->num_fields != 1) {
+		printf("Unable to parse the Consumer Control descriptor\n");
+		return -1;
+	}
+	f = &desc->fields[0];
+	if (f->num_usages != 4 || f->usage_minimum != 0xcd || f->usage_maximum != 0xea) {
+		printf("Wrong usages for the Consumer Control array\n");
+		return -1;
+	}
+	for (i = 0; i < f->num_usages; i++) {
+		if (f->usages[i] != (0x0cu << 16 | consumer_usages[i])) {
+			printf("Wrong usage %u of the Consumer Control array\n", i);
+			return -1;
+		}
+	}
+
+	dec = hid_report_decoder_create(desc, HID_REPORT_INPUT);
+	for (i = 0; i <= 4; i++) {
+		unsigned char report[2] = { 0x02, i };
+		unsigned short expected = i? consumer_usages[i - 1]: 0;
+		if (hid_decode_report(dec, report, sizeof(report), &value, 1) != 1 ||
+		    value.usage != expected || value.usage_page != (expected? 0x0c: 0)) {
+			printf("Consumer Control value %u decodes to the wrong usage\n", i);
+			return -1;
+		}
+	}
+
+	enc = hid_report_encoder_create(desc, HID_REPORT_INPUT);
+	for (i = 1; i <= 4; i++) {
+		struct hid_usage_value usage = { 0x0c, consumer_usages[i - 1], 0, 0 };
+		unsigned char report[2];
+		if (hid_encode_report(enc, 0x02, &usage, 1, report, sizeof(report)) != 2 ||
+		    report[1] != i) {
+			printf("Consumer Control usage %u encodes to the wrong value\n", i);
+			return -1;
+		}
+	}
+
+	hid_report_encoder_free(enc);
+	hid_report_decoder_free(dec);
+	hid_free_report_descriptor(desc);
+	return 0;
+}
+
+/* Checks that a descriptor which declares Report ID 0 still parses, with
+   numbered reports, and that its reports decode. Returns 0, or -1 if
+   not. */
+static int check_zero_report_id(void)
+{
+	struct hid_report_descriptor *desc;
+	hid_report_decoder *dec;
+	struct hid_field_value value;
+	const unsigned char report[2] = { 0x00, 0x2a };
+
+	desc = hid_parse_report_descriptor(zero_id_descriptor, sizeof(zero_id_descriptor));
+	if (!desc || !desc->uses_numbered_reports || desc->num_fields != 1 ||
+	    desc->fields[0].report_id != 0 || desc->usage_page != 0xff00) {
+		printf("Unable to parse the Report ID 0 descriptor\n");
+		hid_free_report_descriptor(desc);
+		return -1;
+	}
+
+	dec = hid_report_decoder_create(desc, HID_REPORT_INPUT);
+	if (hid_decode_report(dec, report, sizeof(report), &value, 1) != 1 ||
+	    value.usage != 2 || value.value != 0x2a) {
+		printf("A report with ID 0 decodes wrongly\n");
+		hid_report_decoder_free(dec);
+		hid_free_report_descriptor(desc);
+		return -1;
+	}
+
+	hid_report_decoder_free(dec);
+	hid_free_report_descriptor(desc);
+	return 0;
+}
+
+/* Decodes a report the way hand-written code usually does: by walking
+   the fields and reading each one a bit at a time. */
+static int naive_decode(const struct hid_report_descriptor *desc, const unsigned char *data,
+                        int *values, double *physical)
+{
+	size_t i;
+	int n = 0;
+	const unsigned char *payload = data + 1;
+
+	for (i = 0; i < desc->num_fields; i++) {
+		const struct hid_report_field *f = &desc->fields[i];
+		unsigned int b;
+		unsigned int raw = 0;
+		int value;
+
+		if (f->type != HID_REPORT_INPUT || f->report_id != data[0])
+			continue;
+
+		for (b = 0; b < f->bit_size; b++) {
+			unsigned int bit = f->bit_offset + b;
+			raw |= ((payload[bit / 8] >> (bit % 8)) & 1) << b;
+		}
+		value = raw;
+		if (f->logical_minimum < 0 && (raw & (1u << (f->bit_size - 1))))
+			value = raw - (1 << f->bit_size);
+
+		values[n] = value;
+		if (f->physical_minimum || f->physical_maximum)
+			physical[n] = f->physical_minimum +
+				(double)(value - f->logical_minimum) *
+				(f->physical_maximum - f->physical_minimum) /
+				((double)f->logical_maximum - f->logical_minimum);
+		else
+			physical[n] = value;
+		n++;
+	}
+
+	return n;
+}
+
+int main(int argc, char* argv[])
+{
+	int iterations = (argc > 1)? atoi(argv[1]): 1000000;
+	struct hid_report_descriptor *desc;
+	hid_report_decoder *dec;
+	struct hid_field_value *values;
+	int naive_values[64];
+	double naive_physical[64];
+	unsigned char *reports;
+	size_t report_len;
+	double start, fast, naive;
+	long sum = 0;
+	int i, j, n, r, max_values;
+
+	if (iterations <= 0) {
+		printf("usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	if (check_array_usages() < 0)
+		return 1;
+	if (check_zero_report_id() < 0)
+		return 1;
+
+	desc = hid_parse_report_descriptor(report_descriptor, sizeof(report_descriptor));
+	if (!desc) {
+		printf("Unable to parse the report descriptor\n");
+		return 1;
+	}
+	dec = hid_report_decoder_create(desc, HID_REPORT_INPUT);
+	max_values = hid_report_decoder_max_values(dec);
+	values = calloc(max_values, sizeof(struct hid_field_value));
+
+	report_len = 1 + desc->reports[0].length[HID_REPORT_INPUT];
+	reports = malloc(NUM_REPORTS * report_len);
+	srand(1);
+	for (i = 0; i < NUM_REPORTS; i++) {
+		reports[i * report_len] = 1;
+		for (j = 1; j < (int)report_len; j++)
+			reports[i * report_len + j] = rand();
+	}
+
+	/* Check that both decoders agree. */
+	for (i = 0; i < NUM_REPORTS; i++) {
+		n = hid_decode_report(dec, reports + i * report_len, report_len, values, max_values);
+		if (n != naive_decode(desc, reports + i * report_len, naive_values, naive_physical)) {
+			printf("Decoders disagree on the number of values\n");
+			return 1;
+		}
+		for (j = 0; j < n; j++) {
+			double diff = values[j].physical_value - naive_physical[j];
+			if (values[j].value != naive_values[j] || diff > 1e-9 || diff < -1e-9) {
+				printf("Decoders disagree on value %d of report %d\n", j, i);
+				return 1;
+			}
+		}
+	}
+
+	/* The best of several runs, to filter out noise. */
+	fast = naive = 0.0;
+	for (r = 0; r < RUNS; r++) {
+		double t;
+
+		start = now_ns();
+		for (i = 0; i < iterations; i++) {
+			n = hid_decode_report(dec, reports + (i % NUM_REPORTS) * report_len, report_len, values, max_values);
+			sum += values[n - 1].value;
+		}
+		t = (now_ns() - start) / iterations;
+		if (r == 0 || t < fast)
+			fast = t;
+
+		start = now_ns();
+		for (i = 0; i < iterations; i++) {
+			n = naive_decode(desc, reports + (i % NUM_REPORTS) * report_len, naive_values, naive_physical);
+			sum += naive_values[n - 1];
+		}
+		t = (now_ns() - start) / iterations;
+		if (r == 0 || t < naive)
+			naive = t;
+	}
+
+	printf("fields per report:     %d (%d bytes)\n", max_values, (int)report_len);
+	printf("hid_decode_report():   %8.1f ns/report %12.0f reports/s\n", fast, 1e9 / fast);
+	printf("bit-by-bit decoding:   %8.1f ns/report %12.0f reports/s\n", naive, 1e9 / naive);
+	if (fast > 0.0)
+		printf("speedup:               %8.1fx\n", naive / fast);
+	printf("(checksum %ld)\n", sum);
+
+	if (bench_columnar(dec, max_values, report_len) < 0)
+		return 1;
+
+	free(reports);
+	free(values);
+	hid_report_decoder_free(dec);
+	hid_free_report_descriptor(desc);
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+/*******************************************************
+ HIDAPI - Enumeration benchmark
+
+ Times repeated calls to hid_enumerate(0,0) with the
+ enumeration cache disabled and enabled.
+
+ Copyright 2009, All Rights Reserved.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hidapi.h"
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Enumerates iterations times, and returns the average time per call in
+   microseconds. */
+static double run(int iterations, int *num_devices)
+{
+	double start;
+	int i;
+
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		struct hid_device_info *devs, *cur;
+		int n = 0;
+
+		devs = hid_enumerate(0x0, 0x0);
+		for (cur = devs; cur; cur = cur->next)
+			n++;
+		hid_free_enumeration(devs);
+		*num_devices = n;
+	}
+
+	return (now_us() - start) / iterations;
+}
+
+int main(int argc, char* argv[])
+{
+	int iterations = (argc > 1)? atoi(argv[1]): 100;
+	int num_devices = 0;
+	double uncached, cached, gen;
+	int i;
+
+	if (iterations <= 0) {
+		printf("usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	hid_set_enumerate_cache(0);
+	uncached = run(iterations, &num_devices);
+
+	hid_set_enumerate_cache(1);
+	cached = run(iterations, &num_devices);
+
+	gen = now_us();
+	for (i = 0; i < iterations; i++)
+		hid_enumerate_generation();
+	gen = (now_us() - gen) / iterations;
+	hid_set_enumerate_cache(0);
+
+	printf("devices:                     %d\n", num_devices);
+	printf("hid_enumerate(), no cache:   %10.1f us/call\n", uncached);
+	printf("hid_enumerate(), cached:     %10.1f us/call\n", cached);
+	printf("hid_enumerate_generation():  %10.1f us/call\n", gen);
+	if (cached > 0.0)
+		printf("speedup:                     %10.1fx\n", uncached / cached);
+
+	return 0;
+}
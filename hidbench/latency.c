@@ -0,0 +1,136 @@
+/*******************************************************
+ HIDAPI - Read latency benchmark
+
+ Measures the round trip of an Output report to a device
+ which echoes each Output report back as an Input report
+ (as many test firmwares do) and doesn't use numbered
+ reports, with each wait strategy of
+ hid_set_wait_strategy(). The difference between the
+ strategies is the time it takes hid_read() to return once
+ the echo has arrived.
+
+ Usage: latency vendor_id product_id [iterations [length]]
+ with the IDs in hex. length is the size of the reports,
+ not counting the report ID.
+
+ Copyright 2009, All Rights Reserved.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hidapi.h"
+
+#define SPIN_MICROSECONDS 250
+#define TIMEOUT_MS 1000
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Sends iterations reports and times each echo. Returns 0, or -1 if an
+   echo doesn't arrive. */
+static int run(hid_device *dev, int iterations, size_t length, double *times)
+{
+	unsigned char out[65], in[65];
+	int i, res;
+
+	for (i = 0; i < iterations; i++) {
+		double start;
+
+		memset(out, 0, sizeof(out));
+		out[0] = 0x0;
+		out[1] = i & 0xff;
+		out[2] = (i >> 8) & 0xff;
+
+		start = now_us();
+		if (hid_write(dev, out, length + 1) < 0) {
+			printf("Unable to write\n");
+			return -1;
+		}
+		do {
+			res = hid_read_timeout(dev, in, sizeof(in), TIMEOUT_MS);
+		} while (res > 0 && (in[0] != out[1] || in[1] != out[2]));
+		if (res <= 0) {
+			printf("No echo of report %d\n", i);
+			return -1;
+		}
+		times[i] = now_us() - start;
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	static const char *names[] = { "block", "spin then block", "busy poll" };
+	unsigned short vendor_id, product_id;
+	int iterations = 1000;
+	size_t length = 64;
+	hid_device *dev;
+	double *times;
+	int strategy;
+
+	if (argc < 3) {
+		printf("usage: %s vendor_id product_id [iterations [length]]\n", argv[0]);
+		return 1;
+	}
+	vendor_id = strtol(argv[1], NULL, 16);
+	product_id = strtol(argv[2], NULL, 16);
+	if (argc > 3)
+		iterations = atoi(argv[3]);
+	if (argc > 4)
+		length = atoi(argv[4]);
+	if (iterations <= 0 || length < 2 || length > 64) {
+		printf("iterations must be positive, and length between 2 and 64\n");
+		return 1;
+	}
+
+	dev = hid_open(vendor_id, product_id, NULL);
+	if (!dev) {
+		printf("Unable to open the device\n");
+		return 1;
+	}
+	times = malloc(iterations * sizeof(double));
+
+	printf("%-16s %10s %10s %10s %10s\n", "strategy", "min us", "median us", "p99 us", "mean us");
+	for (strategy = HID_WAIT_BLOCK; strategy <= HID_WAIT_BUSY_POLL; strategy++) {
+		double sum = 0.0;
+		int i;
+
+		if (hid_set_wait_strategy(dev, strategy, SPIN_MICROSECONDS) < 0) {
+			printf("%-16s not supported\n", names[strategy]);
+			continue;
+		}
+		if (run(dev, iterations, length, times) < 0)
+			break;
+
+		qsort(times, iterations, sizeof(double), compare_doubles);
+		for (i = 0; i < iterations; i++)
+			sum += times[i];
+		printf("%-16s %10.1f %10.1f %10.1f %10.1f\n", names[strategy],
+		       times[0], times[iterations / 2],
+		       times[(int)(iterations * 0.99)], sum / iterations);
+	}
+
+	free(times);
+	hid_close(dev);
+
+	return 0;
+}
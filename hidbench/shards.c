@@ -0,0 +1,145 @@
+/*******************************************************
+ HIDAPI - Event thread scaling benchmark
+
+ Opens every device with the given IDs through a context
+ with 1, 2, 4, ... event threads, reads them for a while,
+ and reports the rate at which Input reports arrive, with
+ each way of assigning devices to the threads. With many
+ fast devices, a single event thread can't keep up, and
+ the rate grows with the number of threads until the
+ devices or the bus are the limit.
+
+ Usage: shards vendor_id product_id [seconds [max_threads]]
+ with the IDs in hex.
+
+ Copyright 2009, All Rights Reserved.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hidapi.h"
+
+#define MAX_DEVICES 256
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Opens the devices through a context with the given configuration and
+   reads them for the given time. Returns 0, or -1 if no device can be
+   opened. */
+static int run(struct hid_device_info *devs, const struct hid_context_config *config,
+               double seconds, double *rate, double *dropped)
+{
+	hid_context *ctx;
+	hid_device *handles[MAX_DEVICES];
+	struct hid_device_info *cur;
+	struct hid_input_stats stats;
+	unsigned long received = 0, lost = 0;
+	unsigned char buf[65];
+	double start, elapsed;
+	int num = 0, i;
+
+	ctx = hid_context_init(config);
+	if (!ctx)
+		return -1;
+	for (cur = devs; cur && num < MAX_DEVICES; cur = cur->next) {
+		hid_device *dev = hid_context_open_path(ctx, cur->path);
+		if (dev)
+			handles[num++] = dev;
+	}
+	if (num == 0) {
+		hid_context_exit(ctx);
+		return -1;
+	}
+
+	/* Keep the queues drained, so that the event threads are the
+	   limit rather than the reader. */
+	start = now_s();
+	do {
+		for (i = 0; i < num; i++)
+			while (hid_read_timeout(handles[i], buf, sizeof(buf), 0) > 0)
+				;
+		elapsed = now_s() - start;
+	} while (elapsed < seconds);
+
+	for (i = 0; i < num; i++) {
+		if (hid_get_input_stats(handles[i], &stats) == 0) {
+			received += stats.received;
+			lost += stats.dropped;
+		}
+	}
+	*rate = received / elapsed;
+	*dropped = lost / elapsed;
+
+	/* Closes the devices. */
+	hid_context_exit(ctx);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	static const char *names[] = { "round robin", "bandwidth" };
+	unsigned short vendor_id, product_id;
+	double seconds = 5.0;
+	int max_threads = 8;
+	struct hid_device_info *devs;
+	int threads, assignment;
+
+	if (argc < 3) {
+		printf("usage: %s vendor_id product_id [seconds [max_threads]]\n", argv[0]);
+		return 1;
+	}
+	vendor_id = strtol(argv[1], NULL, 16);
+	product_id = strtol(argv[2], NULL, 16);
+	if (argc > 3)
+		seconds = atof(argv[3]);
+	if (argc > 4)
+		max_threads = atoi(argv[4]);
+	if (seconds <= 0.0 || max_threads <= 0) {
+		printf("seconds and max_threads must be positive\n");
+		return 1;
+	}
+
+	devs = hid_enumerate(vendor_id, product_id);
+	if (!devs) {
+		printf("No matching devices\n");
+		return 1;
+	}
+
+	printf("%-8s %-12s %14s %14s\n", "threads", "assignment", "reports/s", "dropped/s");
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		for (assignment = HID_SHARD_ROUND_ROBIN; assignment <= HID_SHARD_BANDWIDTH; assignment++) {
+			struct hid_context_config config;
+			double rate, dropped;
+
+			/* With one thread, there is nothing to assign. */
+			if (threads == 1 && assignment != HID_SHARD_ROUND_ROBIN)
+				continue;
+
+			hid_init_context_config(&config);
+			config.event_threads = threads;
+			config.shard_assignment = assignment;
+			config.pin_event_threads = 1;
+			if (run(devs, &config, seconds, &rate, &dropped) < 0) {
+				printf("Unable to open the devices\n");
+				hid_free_enumeration(devs);
+				return 1;
+			}
+			printf("%-8d %-12s %14.0f %14.0f\n", threads, names[assignment], rate, dropped);
+		}
+	}
+
+	hid_free_enumeration(devs);
+
+	return 0;
+}
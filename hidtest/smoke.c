@@ -0,0 +1,136 @@
+/*******************************************************
+ HIDAPI - Open/read/close smoke test
+
+ Opens a device with the given IDs with hid_open(), and
+ through contexts with each input mode, several event
+ threads and callback workers, reads from it for a moment,
+ and closes it again. The device doesn't have to send
+ anything; this catches opens, reads and closes which
+ crash or fail. The exit status is the number of failed
+ configurations.
+
+ Usage: smoke vendor_id product_id
+ with the IDs in hex.
+
+ Copyright 2009, All Rights Reserved.
+
+ This contents of this file may be used by anyone
+ for any reason without any conditions and may be
+ used as a starting point for your own applications
+ which use HIDAPI.
+********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "hidapi.h"
+
+/* Reads a few times with a short timeout. Returns 0, or -1 if a read
+   fails. */
+static int read_some(hid_device *dev)
+{
+	unsigned char buf[256];
+	int i;
+
+	for (i = 0; i < 5; i++)
+		if (hid_read_timeout(dev, buf, sizeof(buf), 20) < 0)
+			return -1;
+	return 0;
+}
+
+static void HID_API_CALL count_report(hid_device *dev, const unsigned char *data, size_t length, void *user_data)
+{
+	(void)dev;
+	(void)data;
+	(void)length;
+	__atomic_fetch_add((unsigned long *)user_data, 1, __ATOMIC_RELAXED);
+}
+
+/* Opens the device through a context with the given configuration, reads
+   from it, and closes it, with hid_close() or hid_context_exit(). Returns
+   0, or -1 on failure. */
+static int run(const char *name, const struct hid_context_config *config,
+               unsigned short vendor_id, unsigned short product_id, int callback)
+{
+	hid_context *ctx;
+	hid_device *dev;
+	unsigned long reports = 0;
+	int res = 0;
+
+	ctx = hid_context_init(config);
+	if (!ctx) {
+		printf("%-24s FAIL (context)\n", name);
+		return -1;
+	}
+
+	/* Twice, to close it both ways. */
+	dev = hid_context_open(ctx, vendor_id, product_id, NULL);
+	if (!dev)
+		res = -1;
+	else {
+		if (callback && hid_set_input_callback(dev, count_report, &reports) < 0)
+			res = -1;
+		else if (!callback && read_some(dev) < 0)
+			res = -1;
+		hid_close(dev);
+	}
+
+	if (res == 0) {
+		dev = hid_context_open(ctx, vendor_id, product_id, NULL);
+		if (!dev || read_some(dev) < 0)
+			res = -1;
+	}
+	hid_context_exit(ctx);
+
+	printf("%-24s %s\n", name, (res < 0)? "FAIL": "ok");
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned short vendor_id, product_id;
+	struct hid_context_config config;
+	hid_device *dev;
+	int failed = 0;
+
+	if (argc < 3) {
+		printf("usage: %s vendor_id product_id\n", argv[0]);
+		return 1;
+	}
+	vendor_id = strtol(argv[1], NULL, 16);
+	product_id = strtol(argv[2], NULL, 16);
+
+	dev = hid_open(vendor_id, product_id, NULL);
+	if (!dev || read_some(dev) < 0) {
+		printf("%-24s FAIL\n", "hid_open");
+		failed++;
+	}
+	else
+		printf("%-24s ok\n", "hid_open");
+	if (dev)
+		hid_close(dev);
+
+	hid_init_context_config(&config);
+	failed += run("fifo", &config, vendor_id, product_id, 0) < 0;
+
+	hid_init_context_config(&config);
+	config.input_mode = HID_INPUT_MODE_PER_REPORT_ID;
+	failed += run("per report ID", &config, vendor_id, product_id, 0) < 0;
+
+	hid_init_context_config(&config);
+	config.input_mode = HID_INPUT_MODE_LATEST;
+	failed += run("latest", &config, vendor_id, product_id, 0) < 0;
+
+	hid_init_context_config(&config);
+	config.event_threads = 2;
+	config.shard_assignment = HID_SHARD_BANDWIDTH;
+	failed += run("2 event threads", &config, vendor_id, product_id, 0) < 0;
+
+	hid_init_context_config(&config);
+	failed += run("inline callback", &config, vendor_id, product_id, 1) < 0;
+
+	hid_init_context_config(&config);
+	config.callback_workers = 2;
+	failed += run("callback workers", &config, vendor_id, product_id, 1) < 0;
+
+	return failed;
+}
@@ -22,6 +22,9 @@
         http://github.com/signal11/hidapi .
 ********************************************************/
 
+/* For pthread_attr_setaffinity_np() */
+#define _GNU_SOURCE
+
 /* C */
 #include <stdio.h>
 #include <string.h>
@@ -38,8 +41,16 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
 
 /* GNU / LibUSB */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "libusb.h"
 #include "iconv.h"
 
@@ -56,20 +67,91 @@ extern "C" {
 #endif
 
 
-/* Uncomment to enable the retrieval of Usage and Usage Page in
-hid_enumerate(). Warning, this is very invasive as it requires the detach
-and re-attach of the kernel driver. See comments inside hid_enumerate().
-Linux/libusb HIDAPI programs are encouraged to use the interface number
-instead to differentiate between interfaces on a composite HID device. */
+/* Usage and Usage Page are normally read from the copy of the report
+descriptor the kernel keeps in sysfs, which is only there while the kernel's
+HID driver is bound to the interface. Uncomment to fall back to requesting
+the descriptor from the device in hid_enumerate() when it isn't. Warning,
+this is very invasive as it requires the detach and re-attach of the kernel
+driver. See the comments on get_usage_invasive(). Linux/libusb HIDAPI
+programs are encouraged to use the interface number instead to
+differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
+/* Report descriptors are at most this long (HID_MAX_DESCRIPTOR_SIZE in
+   the kernel). */
+#define MAX_REPORT_DESCRIPTOR_SIZE 4096
+
 /* Linked List of input reports received from the device. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
+	size_t capacity; /* size of data */
+	unsigned long seq; /* order of arrival */
 	struct input_report *next;
 };
 
+/* A bounded FIFO of input reports. When it is full, the oldest report is
+   dropped to make room. This way it doesn't grow forever if the user never
+   reads anything from the device. */
+struct input_queue {
+	struct input_report *head;
+	struct input_report *tail;
+	int count;
+};
+
+/* Number of reports each queue holds unless hid_set_input_mode() says
+   otherwise. */
+#define DEFAULT_QUEUE_LENGTH 32
+
+/* The newest report of one report ID, for hid_read_snapshot(). It is a
+   seqlock: the reader thread makes seq odd while it updates the report
+   and even again when it is done, and readers retry if seq was odd or
+   changed while they copied the report. */
+struct report_snapshot {
+	unsigned long seq;
+	size_t len;
+	unsigned char data[];
+};
+
+/* A set of devices to wait on. Devices which may have input are kept in
+   a ready list, to which read_callback() adds a device when one of its
+   queues stops being empty, or when it is disconnected. Devices are taken
+   off the list by hid_device_set_wait() once they turn out to have
+   nothing to read. */
+struct hid_device_set_ {
+	pthread_mutex_t mutex; /* Protects the ready list */
+	pthread_cond_t condition;
+	hid_device *members;
+	hid_device *ready_head;
+	hid_device *ready_tail;
+};
+
+/* The reports of one report ID received in the current window of
+   hid_set_aggregation(): their number, the fields of their values, the
+   sum, minimum and maximum of each value, and the last report. */
+struct aggregate {
+	int count;
+	int num_values;
+	long long window_end; /* CLOCK_MONOTONIC milliseconds */
+	const struct hid_report_field **fields;
+	long long *sum;
+	int *min;
+	int *max;
+	unsigned char *last;
+	size_t len;
+};
+
+/* The last queued report of one report ID, for hid_set_change_only(),
+   and the bits of it which are ignored when comparing. data and ignore
+   each hold input_ep_max_packet_size bytes, and ignore is zeroed past the
+   mask which the user gave. */
+struct change_filter {
+	int has_report;
+	size_t len;
+	unsigned char *data;
+	unsigned char *ignore;
+};
+
 
 struct hid_device_ {
 	/* Handle to the actual device. */
@@ -91,22 +173,216 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 	
-	/* Read thread objects */
-	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	/* The event thread of the context the device was opened through
+	   which reads it, the next device of that thread, protected by the
+	   shard's mutex, and the estimated bandwidth of the device's Input
+	   endpoint, in bytes per second. */
+	struct event_shard *shard;
+	hid_device *next_in_shard;
+	long long bandwidth;
+
+	/* Read objects */
+	pthread_mutex_t mutex; /* Protects the input queues */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Received input reports. In HID_INPUT_MODE_FIFO, they are all in
+	   input_queue. In HID_INPUT_MODE_PER_REPORT_ID and
+	   HID_INPUT_MODE_LATEST, each report ID has its own queue in
+	   report_queues, and nonempty_queues has a bit set for each queue
+	   which holds reports. */
+	int input_mode;
+	int queue_length;
+	struct input_queue input_queue;
+	struct input_queue *report_queues;
+	uint64_t nonempty_queues[4];
+	int num_queued; /* in all the queues */
+	unsigned long next_seq; /* also read without mutex, by spinning readers */
+
+	/* Flow control, protected by mutex; see hid_set_flow_control(). If
+	   high_watermark is more than 0, reports aren't dropped. Instead,
+	   once that many are queued, the transfer isn't resubmitted
+	   (input_paused is set) until readers bring the number down to
+	   low_watermark. watermark_notifications counts the crossings whose
+	   callbacks are yet to return, which hid_close() waits for. */
+	int high_watermark;
+	int low_watermark;
+	hid_watermark_callback watermark_callback;
+	void *watermark_user_data;
+	int input_paused;
+	int watermark_notifications;
+
+	/* Demand-driven polling, protected by mutex; see
+	   hid_set_demand_polling(). If idle_timeout is more than 0, the
+	   transfer is cancelled (polling_idle is set) once nobody has read
+	   from the device for that many milliseconds, and submitted again by
+	   the next read. transfer_submitted is set while the transfer is in
+	   flight, and idle_cancel while it is being cancelled for being idle
+	   rather than by hid_close(). */
+	int idle_timeout;
+	long long last_demand; /* CLOCK_MONOTONIC milliseconds */
+	int active_readers;
+	int polling_idle;
+	int transfer_submitted;
+	int idle_cancel;
+
+	/* Input callbacks, protected by mutex; see hid_set_input_callback().
+	   If input_callback is set, reports go to callback_reports instead of
+	   the queues. callback_scheduled is set from when a report arrives
+	   in an empty callback_reports until the reports have run out, and
+	   meanwhile only one thread at a time runs the callbacks, so they run
+	   in order. dispatch_needed tells the thread which set it to call
+	   dispatch_callbacks() once it has unlocked mutex. callback_worker is
+	   the worker whose deque the device is put on, and prev_task and
+	   next_task link it into a deque, protected by the worker's mutex.
+	   next_task also links the devices which the event thread is about to
+	   dispatch. */
+	hid_input_callback input_callback;
+	void *input_callback_data;
+	struct input_queue callback_reports;
+	int callback_scheduled;
+	int dispatch_needed;
+	int callback_worker;
+	hid_device *prev_task;
+	hid_device *next_task;
+
+	/* How readers wait for reports; see hid_set_wait_strategy(). */
+	int wait_strategy;
+	int spin_us;
+
+	/* Counters for hid_get_input_stats(). */
+	unsigned long reports_received;
+	unsigned long reports_dropped;
+
+	/* Snapshots of the newest report of each report ID. Each one is
+	   allocated by the reader thread when the first report with its ID
+	   arrives, and freed when the device is closed. */
+	int snapshots_enabled;
+	struct report_snapshot **snapshots;
+
+	/* Whether unchanged reports are dropped, and the filters which they
+	   are compared with, indexed by report ID. The filters are
+	   allocated on demand, and protected by mutex. */
+	int change_only;
+	struct change_filter **change_filters;
+
+	/* Rate reduction, done by the reader thread before reports are
+	   queued, and protected by mutex. If decimation is more than 1, only
+	   every decimation-th report of each report ID is queued. If
+	   aggregate_window is more than 0, the reports of each ID are
+	   aggregated over windows of that many milliseconds, and the
+	   windows with reports are in pending_aggregates. */
+	int decimation;
+	unsigned int *decimation_counts;
+	int aggregate_function;
+	int aggregate_window;
+	hid_report_decoder *aggregate_decoder;
+	struct hid_field_value *aggregate_values;
+	int aggregate_max_values;
+	struct aggregate **aggregates;
+	uint64_t pending_aggregates[4];
+
+	/* The set the device is in, or NULL, protected by mutex. next_member,
+	   in_ready_list and next_ready are protected by the mutex of the set. */
+	hid_device_set *set;
+	hid_device *next_member;
+	int in_ready_list;
+	hid_device *next_ready;
+
+	/* Whether any queue holds a report. It is written with mutex locked,
+	   but also read by hid_device_set_wait() without it. */
+	int readable;
+
+	/* The parsed report descriptor and the encoders compiled from it,
+	   or NULL. */
+	struct hid_report_descriptor *report_descriptor;
+	hid_report_encoder *output_encoder;
+	hid_report_encoder *feature_encoder;
 };
 
-static int initialized = 0;
+/* An event thread of a context, and the libusb context whose events it
+   handles, which the devices assigned to the thread are opened in. The
+   thread is started when its first device is opened. */
+struct event_shard {
+	hid_context *context;
+	libusb_context *usb;
+	pthread_mutex_t mutex; /* Protects devices, load and the thread */
+	hid_device *devices;
+	long long load; /* The sum of the bandwidth of the devices */
+	int cpu; /* The CPU to pin the thread to, or -1 */
+	pthread_t thread;
+	int thread_running;
+	int shutdown_thread;
+};
+
+/* A worker thread which runs input callbacks, and its deque of devices
+   whose callbacks are due. The owner takes devices from the top, so that
+   none waits long, and the other workers steal from the bottom when they
+   run out. */
+struct callback_worker {
+	struct callback_pool *pool;
+	pthread_mutex_t mutex; /* Protects the deque */
+	hid_device *top;
+	hid_device *bottom;
+	pthread_t thread;
+};
+
+/* The callback workers of a context. Idle workers wait on condition
+   until num_tasks, the number of devices in the deques, isn't 0. */
+struct callback_pool {
+	struct callback_worker *workers;
+	int num_workers;
+	unsigned int next_worker; /* For spreading devices over the workers */
+	pthread_mutex_t mutex; /* Protects num_tasks and shutdown */
+	pthread_cond_t condition;
+	int num_tasks;
+	int shutdown;
+};
+
+/* Devices whose callbacks run on a worker run this many before the
+   worker moves on to the next device, so that a busy device doesn't
+   keep the others of the worker waiting. */
+#define CALLBACK_BATCH 16
+
+/* The event threads which read the devices opened through a context,
+   and its callback workers, or NULL. */
+struct hid_context_ {
+	struct hid_context_config config;
+	struct event_shard *shards;
+	int num_shards;
+	unsigned int next_shard; /* For HID_SHARD_ROUND_ROBIN */
+	struct callback_pool *callbacks;
+};
+
+/* The context which hid_open() and hid_open_path() use, created on
+   first use. */
+static pthread_mutex_t default_context_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hid_context *default_context = NULL;
+
+/* The libusb context of the enumeration and of hotplug notification,
+   created on first use. It has no open devices, so handling its events
+   while enumerating runs no read callbacks, and doesn't contend with
+   any event thread. */
+static pthread_mutex_t enumerate_usb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *enumerate_usb = NULL;
 
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static int return_data(hid_device *dev, struct input_queue *q, unsigned char *data, size_t length);
+static hid_device *open_path(hid_context *ctx, const char *path);
+static int set_input_mode(hid_device *dev, int mode, int queue_length);
+
+/* Initializes a condition variable which waits on CLOCK_MONOTONIC, so
+   deadlines don't move when the system clock is set. */
+static void init_condition(pthread_cond_t *condition)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(condition, &attr);
+	pthread_condattr_destroy(&attr);
+}
 
 static hid_device *new_hid_device(void)
 {
@@ -122,11 +398,61 @@ static hid_device *new_hid_device(void)
 	dev->blocking = 1;
 	dev->shutdown_thread = 0;
 	dev->transfer = NULL;
-	dev->input_reports = NULL;
+	dev->input_mode = HID_INPUT_MODE_FIFO;
+	dev->queue_length = DEFAULT_QUEUE_LENGTH;
+	dev->report_queues = NULL;
+	dev->next_seq = 0;
+	dev->num_queued = 0;
+	dev->high_watermark = 0;
+	dev->low_watermark = 0;
+	dev->watermark_callback = NULL;
+	dev->watermark_user_data = NULL;
+	dev->input_paused = 0;
+	dev->watermark_notifications = 0;
+	dev->idle_timeout = 0;
+	dev->last_demand = 0;
+	dev->active_readers = 0;
+	dev->polling_idle = 0;
+	dev->transfer_submitted = 0;
+	dev->idle_cancel = 0;
+	dev->input_callback = NULL;
+	dev->input_callback_data = NULL;
+	dev->callback_scheduled = 0;
+	dev->dispatch_needed = 0;
+	dev->callback_worker = 0;
+	dev->prev_task = NULL;
+	dev->next_task = NULL;
+	dev->wait_strategy = HID_WAIT_BLOCK;
+	dev->spin_us = 0;
+	dev->reports_received = 0;
+	dev->reports_dropped = 0;
+	dev->snapshots_enabled = 0;
+	dev->snapshots = NULL;
+	dev->change_only = 0;
+	dev->change_filters = NULL;
+	dev->decimation = 0;
+	dev->decimation_counts = NULL;
+	dev->aggregate_function = HID_AGGREGATE_MEAN;
+	dev->aggregate_window = 0;
+	dev->aggregate_decoder = NULL;
+	dev->aggregate_values = NULL;
+	dev->aggregate_max_values = 0;
+	dev->aggregates = NULL;
+	dev->set = NULL;
+	dev->next_member = NULL;
+	dev->in_ready_list = 0;
+	dev->next_ready = NULL;
+	dev->readable = 0;
+	dev->report_descriptor = NULL;
+	dev->output_encoder = NULL;
+	dev->feature_encoder = NULL;
 	
+	dev->shard = NULL;
+	dev->next_in_shard = NULL;
+	dev->bandwidth = 0;
+
 	pthread_mutex_init(&dev->mutex, NULL);
-	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	init_condition(&dev->condition);
 	
 	return dev;
 }
@@ -134,10 +460,35 @@ static hid_device *new_hid_device(void)
 static void free_hid_device(hid_device *dev)
 {
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	hid_report_encoder_free(dev->output_encoder);
+	hid_report_encoder_free(dev->feature_encoder);
+	hid_free_report_descriptor(dev->report_descriptor);
+	free(dev->report_queues);
+	if (dev->snapshots) {
+		int i;
+		for (i = 0; i < 256; i++)
+			free(dev->snapshots[i]);
+		free(dev->snapshots);
+	}
+	if (dev->change_filters) {
+		int i;
+		for (i = 0; i < 256; i++)
+			free(dev->change_filters[i]);
+		free(dev->change_filters);
+	}
+	free(dev->decimation_counts);
+	if (dev->aggregates) {
+		int i;
+		for (i = 0; i < 256; i++)
+			free(dev->aggregates[i]);
+		free(dev->aggregates);
+	}
+	free(dev->aggregate_values);
+	hid_report_decoder_free(dev->aggregate_decoder);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -150,163 +501,54 @@ static void register_error(hid_device *device, const char *op)
 }
 #endif
 
-#ifdef INVASIVE_GET_USAGE
-/* Get bytes from a HID Report Descriptor.
-   Only call with a num_bytes of 0, 1, 2, or 4. */
-static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
-{
-	/* Return if there aren't enough bytes. */
-	if (cur + num_bytes >= len)
-		return 0;
-
-	if (num_bytes == 0)
-		return 0;
-	else if (num_bytes == 1) {
-		return rpt[cur+1];
-	}
-	else if (num_bytes == 2) {
-		return (rpt[cur+2] * 256 + rpt[cur+1]);
-	}
-	else if (num_bytes == 4) {
-		return (rpt[cur+4] * 0x01000000 +
-		        rpt[cur+3] * 0x00010000 +
-		        rpt[cur+2] * 0x00000100 +
-		        rpt[cur+1] * 0x00000001);
-	}
-	else
-		return 0;
-}
-
 /* Retrieves the device's Usage Page and Usage from the report
-   descriptor. The algorithm is simple, as it just returns the first
-   Usage and Usage Page that it finds in the descriptor.
+   descriptor, as the usage of its first top-level collection.
    The return value is 0 on success and -1 on failure. */
 static int get_usage(uint8_t *report_descriptor, size_t size,
                      unsigned short *usage_page, unsigned short *usage)
 {
-	int i = 0;
-	int size_code;
-	int data_len, key_size;
-	int usage_found = 0, usage_page_found = 0;
-	
-	while (i < size) {
-		int key = report_descriptor[i];
-		int key_cmd = key & 0xfc;
-
-		//printf("key: %02hhx\n", key);
-		
-		if ((key & 0xf0) == 0xf0) {
-			/* This is a Long Item. The next byte contains the
-			   length of the data section (value) for this key.
-			   See the HID specification, version 1.11, section
-			   6.2.2.3, titled "Long Items." */
-			if (i+1 < size)
-				data_len = report_descriptor[i+1];
-			else
-				data_len = 0; /* malformed report */
-			key_size = 3;
-		}
-		else {
-			/* This is a Short Item. The bottom two bits of the
-			   key contain the size code for the data section
-			   (value) for this key.  Refer to the HID
-			   specification, version 1.11, section 6.2.2.2,
-			   titled "Short Items." */
-			size_code = key & 0x3;
-			switch (size_code) {
-			case 0:
-			case 1:
-			case 2:
-				data_len = size_code;
-				break;
-			case 3:
-				data_len = 4;
-				break;
-			default:
-				/* Can't ever happen since size_code is & 0x3 */
-				data_len = 0;
-				break;
-			};
-			key_size = 1;
-		}
-		
-		if (key_cmd == 0x4) {
-			*usage_page  = get_bytes(report_descriptor, size, data_len, i);
-			usage_page_found = 1;
-			//printf("Usage Page: %x\n", (uint32_t)*usage_page);
-		}
-		if (key_cmd == 0x8) {
-			*usage = get_bytes(report_descriptor, size, data_len, i);
-			usage_found = 1;
-			//printf("Usage: %x\n", (uint32_t)*usage);
-		}
+	struct hid_report_descriptor *desc;
 
-		if (usage_page_found && usage_found)
-			return 0; /* success */
-		
-		/* Skip over this key and it's associated data */
-		i += data_len + key_size;
-	}
-	
-	return -1; /* failure */
-}
-#endif // INVASIVE_GET_USAGE
+	desc = hid_parse_report_descriptor(report_descriptor, size);
+	if (!desc)
+		return -1;
 
+	*usage_page = desc->usage_page;
+	*usage = desc->usage;
+	hid_free_report_descriptor(desc);
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
-{
-	uint16_t buf[32];
-	int len;
-	
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
-	
-	return buf[1]; // First two bytes are len and descriptor type.
+	return 0;
 }
 
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+
+/* Picks the language to request strings in, given the list of language
+   IDs the device reports in USB string #0 (buf, len bytes long). This is
+   the language of the current locale if the device supports it, and the
+   first language the device lists otherwise. */
+static uint16_t choose_language(const unsigned char *buf, int len, uint16_t wanted)
 {
-	uint16_t buf[32];
-	int len;
 	int i;
-	
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
+
 	if (len < 4)
 		return 0x0;
-	
-	
-	len /= 2; /* language IDs are two-bytes each. */
-	/* Start at index 1 because there are two bytes of protocol data. */
-	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
+
+	/* Start at byte 2 because there are two bytes of protocol data.
+	   Language IDs are two bytes each, little endian. */
+	for (i = 2; i+1 < len; i += 2) {
+		if ((buf[i] | buf[i+1] << 8) == wanted)
+			return wanted;
 	}
 
-	return 0;
+	return buf[2] | buf[3] << 8;
 }
 
-
-/* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+/* Converts the string descriptor in buf (len bytes long, including the
+   two-byte header) to a wide string. maxlen is the size of string in
+   multiples of wchar_t. The return value is 0 on success and -1 on
+   failure. buf must be at least 512 bytes long. */
+static int convert_string_descriptor(char *buf, int len, wchar_t *string, size_t maxlen)
 {
-	char buf[512];
-	int len;
-	wchar_t *str = NULL;
+	int ret = -1;
 	wchar_t wbuf[256];
 
 	/* iconv variables */
@@ -317,31 +559,19 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	char *inptr;
 	char *outptr;
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-		
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			idx,
-			lang,
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 0)
-		return NULL;
-	
-	buf[sizeof(buf)-1] = '\0';
-	
-	if (len+1 < sizeof(buf))
+	if (len < 2)
+		return -1;
+
+	buf[511] = '\0';
+
+	if (len+1 < 512)
 		buf[len+1] = '\0';
-	
+
 	/* Initialize iconv. */
 	ic = iconv_open("UTF-32", "UTF-16");
 	if (ic == (iconv_t)-1)
-		return NULL;
-	
+		return -1;
+
 	/* Convert to UTF-32 (wchar_t on glibc systems).
 	   Skip the first character (2-bytes). */
 	inptr = buf+2;
@@ -356,288 +586,1977 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
 	if (outbytes >= sizeof(wbuf[0]))
 		*((wchar_t*)outptr) = 0x00000000;
-	
-	/* Allocate and copy the string. */
-	str = wcsdup(wbuf+1);
+
+	/* Copy the string, skipping the byte order mark. */
+	wcsncpy(string, wbuf+1, maxlen);
+	string[maxlen-1] = L'\0';
+	ret = 0;
 
 err:
 	iconv_close(ic);
-	
-	return str;
+
+	return ret;
 }
 
-static char *make_path(libusb_device *dev, int interface_number)
+/* This function fills string with the USB device string numbered by the
+   index. maxlen is the size of string in multiples of wchar_t. The return
+   value is 0 on success and -1 on failure. */
+static int get_usb_string_buf(libusb_device_handle *dev, uint8_t idx, wchar_t *string, size_t maxlen)
 {
-	char str[64];
-	snprintf(str, sizeof(str), "%04x:%04x:%02x",
+	char buf[512];
+	int len;
+
+	/* Determine which language to use. */
+	uint16_t lang;
+	len = libusb_get_string_descriptor(dev,
+			0x0, /* String ID */
+			0x0, /* Language */
+			(unsigned char*)buf,
+			sizeof(buf));
+	lang = choose_language((unsigned char*)buf, len,
+	                       get_usb_code_for_current_locale());
+
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			idx,
+			lang,
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 0)
+		return -1;
+
+	return convert_string_descriptor(buf, len, string, maxlen);
+}
+
+static void format_path(char *str, size_t len, libusb_device *dev, int interface_number)
+{
+	snprintf(str, len, "%04x:%04x:%02x",
 		libusb_get_bus_number(dev),
 		libusb_get_device_address(dev),
 		interface_number);
-	str[sizeof(str)-1] = '\0';
-	
-	return strdup(str);
+	str[len-1] = '\0';
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+static char *make_path(libusb_device *dev, int interface_number)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
-	
-	struct hid_device_info *root = NULL; // return object
-	struct hid_device_info *cur_dev = NULL;
-	
-	setlocale(LC_ALL,"");
-	
-	if (!initialized) {
-		libusb_init(NULL);
-		initialized = 1;
-	}
-	
-	num_devs = libusb_get_device_list(NULL, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
-
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
-		
-		/* HID's are defined at the interface level. */
-		if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
-			continue;
+	char str[64];
+	format_path(str, sizeof(str), dev, interface_number);
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 && product_id == 0x0) ||
-						    (vendor_id == dev_vid && product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
-							
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
-							
-							res = libusb_open(dev, &handle);
-
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+	return strdup(str);
+}
 
-#ifdef INVASIVE_GET_USAGE
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								int detached = 0;
-								unsigned char data[256];
-							
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
-								res = libusb_claim_interface(handle, interface_num);
-								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
-								}
-								else
-									LOG("Can't claim interface %d\n", res);
-
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
-#endif /*******************/
-
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
-
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
-							
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
-					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
-		}
-	}
+/* enumerate() calls an enum_sink_fn once for each matching device. The
+   record and its strings are only valid for the duration of the call, and
+   its next pointer is always NULL. Returning non-zero stops the
+   enumeration. This is the same contract as hid_enumerate_each()'s
+   callback, which is passed straight through. */
+typedef hid_enumerate_cb enum_sink_fn;
 
-	libusb_free_device_list(devs, 1);
+/* Returns non-zero if the bits of value selected by mask match want. */
+#define MATCH_MASKED(value, want, mask) ((((value) ^ (want)) & (mask)) == 0)
 
-	return root;
+static int serial_matches(const struct hid_enumerate_filter *filter, const wchar_t *serial)
+{
+	if (!filter->serial_number)
+		return 1;
+	if (!serial)
+		return 0;
+	return wcsncmp(serial, filter->serial_number, wcslen(filter->serial_number)) == 0;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+static int usage_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
-	}
+	return (!filter->usage_page || filter->usage_page == info->usage_page) &&
+	       (!filter->usage || filter->usage == info->usage);
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+/* Reads the report descriptor of an interface from the copy the kernel
+   keeps in sysfs, at
+   /sys/bus/usb/devices/<bus>-<port>[.<port>...]:<config>.<interface>/
+   <bus>:<vendor>:<product>.<instance>/report_descriptor.
+   This doesn't touch the device at all, but only works while the kernel's
+   HID driver is bound to the interface. The return value is the length of
+   the descriptor, or -1 on failure. */
+static int read_sysfs_report_descriptor(libusb_device *dev, int config, int interface_num,
+                                        uint8_t *buf, size_t len)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
-	
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
-	}
+	uint8_t ports[8];
+	char path[256];
+	char file[PATH_MAX];
+	int num_ports, i, n;
+	DIR *dir;
+	struct dirent *entry;
+	int res = -1;
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	}
+	/* Root hubs have no port numbers, and aren't HID devices anyway. */
+	num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	if (num_ports <= 0)
+		return -1;
 
-	hid_free_enumeration(devs);
-	
-	return handle;
-}
+	n = snprintf(path, sizeof(path), "/sys/bus/usb/devices/%d-", libusb_get_bus_number(dev));
+	for (i = 0; i < num_ports; i++)
+		n += snprintf(path + n, sizeof(path) - n, (i == 0)? "%d": ".%d", ports[i]);
+	snprintf(path + n, sizeof(path) - n, ":%d.%d", config, interface_num);
 
-static void read_callback(struct libusb_transfer *transfer)
-{
-	hid_device *dev = transfer->user_data;
-	
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((entry = readdir(dir)) != NULL) {
+		unsigned int bus, vendor, product, instance;
+		int fd;
+
+		if (sscanf(entry->d_name, "%x:%x:%x.%x", &bus, &vendor, &product, &instance) != 4)
+			continue;
+
+		snprintf(file, sizeof(file), "%s/%s/report_descriptor", path, entry->d_name);
+		fd = open(file, O_RDONLY);
+		if (fd < 0)
+			continue;
+		res = read(fd, buf, len);
+		close(fd);
+		if (res <= 0)
+			res = -1;
+		break;
+	}
+
+	closedir(dir);
+	return res;
+}
+
+#ifdef INVASIVE_GET_USAGE
+/* Reads the Usage Page and Usage of an interface from its report
+   descriptor, which has to be requested from the device itself.
+
+   This section is removed because it is too invasive on the system.
+   Getting a Usage Page and Usage requires parsing the HID Report
+   descriptor. Getting a HID Report descriptor involves claiming the
+   interface. Claiming the interface involves detaching the kernel driver.
+   Detaching the kernel driver is hard on the system because it will
+   unclaim interfaces (if another app has them claimed) and the
+   re-attachment of the driver will sometimes change /dev entry names.
+   It is for these reasons that this section is #if 0. For composite
+   devices, use the interface field in the hid_device_info struct to
+   distinguish between interfaces. */
+static void get_usage_invasive(libusb_device_handle *handle, int interface_num,
+                               unsigned short *usage_page, unsigned short *usage)
+{
+	int res;
+	int detached = 0;
+	unsigned char data[256];
+
+	/* Usage Page and Usage */
+	res = libusb_kernel_driver_active(handle, interface_num);
+	if (res == 1) {
+		res = libusb_detach_kernel_driver(handle, interface_num);
+		if (res < 0)
+			LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+		else
+			detached = 1;
+	}
+	res = libusb_claim_interface(handle, interface_num);
+	if (res >= 0) {
+		/* Get the HID Report Descriptor. */
+		res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
+		if (res >= 0) {
+			/* Parse the usage and usage page
+			   out of the report descriptor. */
+			get_usage(data, res, usage_page, usage);
+		}
+		else
+			LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+		/* Release the interface */
+		res = libusb_release_interface(handle, interface_num);
+		if (res < 0)
+			LOG("Can't release the interface.\n");
+	}
+	else
+		LOG("Can't claim interface %d\n", res);
+
+	/* Re-attach kernel driver if necessary. */
+	if (detached) {
+		res = libusb_attach_kernel_driver(handle, interface_num);
+		if (res < 0)
+			LOG("Couldn't re-attach kernel driver.\n");
+	}
+}
+#endif /* INVASIVE_GET_USAGE */
+
+/* How long enumerate() waits for devices to return their strings. */
+static int enumerate_timeout = 1000; /* milliseconds */
+
+/* String requests made for each device. The language list has to come
+   back before the others can be sent. */
+enum {
+	STRING_REQ_LANGUAGES,
+	STRING_REQ_SERIAL,
+	STRING_REQ_MANUFACTURER,
+	STRING_REQ_PRODUCT,
+	NUM_STRING_REQS
+};
+
+struct pending_device;
+
+/* One asynchronous GET_DESCRIPTOR(String) request. */
+struct string_request {
+	struct pending_device *pd;
+	struct libusb_transfer *transfer;
+	int in_flight; /* boolean */
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 512];
+};
+
+/* One matching HID interface of a pending_device. */
+struct pending_interface {
+	int number;
+	unsigned short usage_page;
+	unsigned short usage;
+	int usage_unknown; /* boolean: no report descriptor in sysfs */
+};
+
+/* A device which passed all the checks that could be made without
+   talking to it, and whose strings are being fetched. */
+struct pending_device {
+	struct enumerate_state *state;
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	struct libusb_device_descriptor desc;
+
+	struct pending_interface *interfaces;
+	int num_interfaces;
+
+	uint16_t lang;
+	wchar_t serial[256];
+	wchar_t manufacturer[256];
+	wchar_t product[256];
+	int have_serial;
+	int have_manufacturer;
+	int have_product;
+
+	struct string_request reqs[NUM_STRING_REQS];
+	int num_in_flight;
+
+	struct pending_device *next;      /* All pending devices */
+	struct pending_device *next_done; /* Devices ready to be reported */
+};
+
+/* State shared between enumerate() and the transfer callbacks, which may
+   run on any thread which handles libusb events. */
+struct enumerate_state {
+	const struct hid_enumerate_filter *filter;
+	pthread_mutex_t mutex; /* Protects everything below */
+	int expired; /* No more requests may be submitted. */
+	int num_busy; /* Devices with requests in flight */
+	struct pending_device *done_head;
+	struct pending_device *done_tail;
+};
+
+static void string_request_cb(struct libusb_transfer *transfer);
+
+/* Submits string request which for pd, with a timeout of timeout
+   milliseconds. Must be called with the state mutex locked. Returns 0 on
+   success and -1 on failure. */
+static int submit_string_request(struct pending_device *pd, int which, uint8_t idx, int timeout)
+{
+	struct string_request *req = &pd->reqs[which];
+
+	if (pd->state->expired)
+		return -1;
+
+	libusb_fill_control_setup(req->buf,
+		LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_STRING << 8) | idx,
+		(which == STRING_REQ_LANGUAGES)? 0x0: pd->lang,
+		sizeof(req->buf) - LIBUSB_CONTROL_SETUP_SIZE);
+	libusb_fill_control_transfer(req->transfer, pd->handle, req->buf,
+		string_request_cb, req, timeout);
+	if (libusb_submit_transfer(req->transfer) < 0)
+		return -1;
+
+	req->in_flight = 1;
+	pd->num_in_flight++;
+	return 0;
+}
+
+/* Puts pd on the list of devices which are ready to be reported. Must be
+   called with the state mutex locked. */
+static void finish_pending_device(struct pending_device *pd)
+{
+	struct enumerate_state *state = pd->state;
+
+	state->num_busy--;
+	if (state->done_tail)
+		state->done_tail->next_done = pd;
+	else
+		state->done_head = pd;
+	state->done_tail = pd;
+}
+
+/* Sends the requests for the strings after the language list has come
+   back. If the filter needs a serial number prefix, the other strings
+   are only requested once the serial number has come back and
+   matched. */
+static void request_strings(struct pending_device *pd, int serial_known)
+{
+	const struct hid_enumerate_filter *filter = pd->state->filter;
+
+	if (!serial_known && filter->serial_number) {
+		/* Without a serial number, the device can't match. */
+		if (pd->desc.iSerialNumber > 0)
+			submit_string_request(pd, STRING_REQ_SERIAL, pd->desc.iSerialNumber, enumerate_timeout);
+		return;
+	}
+	if (!serial_known && pd->desc.iSerialNumber > 0)
+		submit_string_request(pd, STRING_REQ_SERIAL, pd->desc.iSerialNumber, enumerate_timeout);
+	if (pd->desc.iManufacturer > 0)
+		submit_string_request(pd, STRING_REQ_MANUFACTURER, pd->desc.iManufacturer, enumerate_timeout);
+	if (pd->desc.iProduct > 0)
+		submit_string_request(pd, STRING_REQ_PRODUCT, pd->desc.iProduct, enumerate_timeout);
+}
+
+static void string_request_cb(struct libusb_transfer *transfer)
+{
+	struct string_request *req = transfer->user_data;
+	struct pending_device *pd = req->pd;
+	int which = req - pd->reqs;
+	int ok = transfer->status == LIBUSB_TRANSFER_COMPLETED;
+	char *data = (char*) libusb_control_transfer_get_data(transfer);
+
+	pthread_mutex_lock(&pd->state->mutex);
+	req->in_flight = 0;
+	pd->num_in_flight--;
+
+	switch (which) {
+	case STRING_REQ_LANGUAGES:
+		pd->lang = choose_language((unsigned char*) data,
+			(ok)? transfer->actual_length: 0,
+			get_usb_code_for_current_locale());
+		request_strings(pd, 0);
+		break;
+	case STRING_REQ_SERIAL:
+		pd->have_serial = ok &&
+			convert_string_descriptor(data, transfer->actual_length, pd->serial, 256) == 0;
+		if (pd->state->filter->serial_number &&
+		    serial_matches(pd->state->filter, (pd->have_serial)? pd->serial: NULL))
+			request_strings(pd, 1);
+		break;
+	case STRING_REQ_MANUFACTURER:
+		pd->have_manufacturer = ok &&
+			convert_string_descriptor(data, transfer->actual_length, pd->manufacturer, 256) == 0;
+		break;
+	case STRING_REQ_PRODUCT:
+		pd->have_product = ok &&
+			convert_string_descriptor(data, transfer->actual_length, pd->product, 256) == 0;
+		break;
+	}
+
+	if (pd->num_in_flight == 0)
+		finish_pending_device(pd);
+	pthread_mutex_unlock(&pd->state->mutex);
+}
+
+/* Cancels the requests of all the devices. Their callbacks still have
+   to run before the devices can be freed. */
+static void cancel_pending_devices(struct enumerate_state *state, struct pending_device *all)
+{
+	struct pending_device *pd;
+	int i;
+
+	pthread_mutex_lock(&state->mutex);
+	state->expired = 1;
+	for (pd = all; pd; pd = pd->next) {
+		for (i = 0; i < NUM_STRING_REQS; i++) {
+			if (pd->reqs[i].in_flight)
+				libusb_cancel_transfer(pd->reqs[i].transfer);
+		}
+	}
+	pthread_mutex_unlock(&state->mutex);
+}
+
+static void free_pending_device(struct pending_device *pd)
+{
+	int i;
+
+	for (i = 0; i < NUM_STRING_REQS; i++)
+		libusb_free_transfer(pd->reqs[i].transfer);
+	if (pd->handle)
+		libusb_close(pd->handle);
+	free(pd->interfaces);
+	free(pd);
+}
+
+/* Drops the interfaces of pd whose usage doesn't match the filter. Interfaces
+   whose usage is still unknown are kept if keep_unknown is set. Returns the
+   number of interfaces left. */
+static int drop_unmatched_usages(struct pending_device *pd, int keep_unknown)
+{
+	int i, k;
+
+	for (i = 0, k = 0; i < pd->num_interfaces; i++) {
+		struct hid_device_info info;
+		info.usage_page = pd->interfaces[i].usage_page;
+		info.usage = pd->interfaces[i].usage;
+		if ((keep_unknown && pd->interfaces[i].usage_unknown) ||
+		    usage_matches(pd->state->filter, &info))
+			pd->interfaces[k++] = pd->interfaces[i];
+	}
+	pd->num_interfaces = k;
+
+	return k;
+}
+
+/* Creates a pending_device for dev, with the interfaces of conf_desc
+   which pass filter. The return value is NULL if there are none. */
+static struct pending_device *new_pending_device(libusb_device *dev,
+                                                 const struct libusb_device_descriptor *desc,
+                                                 const struct libusb_config_descriptor *conf_desc,
+                                                 struct enumerate_state *state)
+{
+	const struct hid_enumerate_filter *filter = state->filter;
+	struct pending_device *pd;
+	int j, k, i;
+
+	pd = calloc(1, sizeof(struct pending_device));
+	pd->state = state;
+	pd->dev = dev;
+	pd->desc = *desc;
+	pd->interfaces = calloc(conf_desc->bNumInterfaces, sizeof(struct pending_interface));
+
+	for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			const struct libusb_interface_descriptor *intf_desc;
+			intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+				continue;
+			if (filter->interface_number >= 0 &&
+			    filter->interface_number != intf_desc->bInterfaceNumber)
+				continue;
+			pd->interfaces[pd->num_interfaces++].number = intf_desc->bInterfaceNumber;
+			break; /* Each interface only counts once. */
+		}
+	}
+
+	if (pd->num_interfaces == 0) {
+		free_pending_device(pd);
+		return NULL;
+	}
+
+	/* Usage Page and Usage. These come from sysfs, so interfaces can be
+	   dropped on them before the device is opened. */
+	for (i = 0; i < pd->num_interfaces; i++) {
+		uint8_t rpt[MAX_REPORT_DESCRIPTOR_SIZE];
+		int len = read_sysfs_report_descriptor(dev, conf_desc->bConfigurationValue,
+		                                       pd->interfaces[i].number, rpt, sizeof(rpt));
+		if (len > 0)
+			get_usage(rpt, len, &pd->interfaces[i].usage_page, &pd->interfaces[i].usage);
+		else
+			pd->interfaces[i].usage_unknown = 1;
+	}
+
+#ifdef INVASIVE_GET_USAGE
+	if (drop_unmatched_usages(pd, 1) == 0) {
+		free_pending_device(pd);
+		return NULL;
+	}
+#endif
+
+	if (libusb_open(dev, &pd->handle) < 0)
+		pd->handle = NULL;
+
+#ifdef INVASIVE_GET_USAGE
+	if (pd->handle) {
+		for (i = 0; i < pd->num_interfaces; i++) {
+			if (!pd->interfaces[i].usage_unknown)
+				continue;
+			get_usage_invasive(pd->handle, pd->interfaces[i].number,
+				&pd->interfaces[i].usage_page, &pd->interfaces[i].usage);
+			pd->interfaces[i].usage_unknown = 0;
+		}
+	}
+#endif
+
+	if (drop_unmatched_usages(pd, 0) == 0) {
+		free_pending_device(pd);
+		return NULL;
+	}
+
+	for (i = 0; i < NUM_STRING_REQS; i++) {
+		pd->reqs[i].pd = pd;
+		pd->reqs[i].transfer = libusb_alloc_transfer(0);
+	}
+
+	return pd;
+}
+
+/* Hands each matching interface of pd to sink. Returns non-zero if sink
+   asked to stop. */
+static int report_pending_device(struct pending_device *pd,
+                                 enum_sink_fn sink, void *user_data, int *count)
+{
+	const struct hid_enumerate_filter *filter = pd->state->filter;
+	struct hid_device_info info;
+	char path[64];
+	int i;
+
+	if (!serial_matches(filter, (pd->have_serial)? pd->serial: NULL))
+		return 0;
+
+	memset(&info, 0, sizeof(info));
+	info.path = path;
+	info.serial_number = (pd->have_serial)? pd->serial: NULL;
+	info.manufacturer_string = (pd->have_manufacturer)? pd->manufacturer: NULL;
+	info.product_string = (pd->have_product)? pd->product: NULL;
+
+	/* VID/PID */
+	info.vendor_id = pd->desc.idVendor;
+	info.product_id = pd->desc.idProduct;
+
+	/* Release Number */
+	info.release_number = pd->desc.bcdDevice;
+
+	for (i = 0; i < pd->num_interfaces; i++) {
+		format_path(path, sizeof(path), pd->dev, pd->interfaces[i].number);
+		info.usage_page = pd->interfaces[i].usage_page;
+		info.usage = pd->interfaces[i].usage;
+
+		/* Interface Number */
+		info.interface_number = pd->interfaces[i].number;
+
+		(*count)++;
+		if (sink(&info, user_data))
+			return 1;
+	}
+
+	return 0;
+}
+
+static long long get_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Turns a timeout in milliseconds into a CLOCK_MONOTONIC deadline in
+   nanoseconds. -1 (wait forever) stays -1, and 0 (don't wait) stays 0,
+   which is always in the past. */
+static long long deadline_after(int milliseconds)
+{
+	if (milliseconds < 0)
+		return -1;
+	if (milliseconds == 0)
+		return 0;
+	return get_time_ns() + milliseconds * 1000000LL;
+}
+
+/* Tells the CPU that this is a spin loop. */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* Returns the default context, creating it if needed, or NULL if it
+   can't be created. */
+static hid_context *get_default_context(void)
+{
+	hid_context *ctx;
+
+	pthread_mutex_lock(&default_context_mutex);
+	if (!default_context)
+		default_context = hid_context_init(NULL);
+	ctx = default_context;
+	pthread_mutex_unlock(&default_context_mutex);
+
+	return ctx;
+}
+
+/* Returns the libusb context of the enumeration, creating it if needed,
+   or NULL if it can't be created. */
+static libusb_context *get_enumerate_usb(void)
+{
+	libusb_context *usb;
+
+	pthread_mutex_lock(&enumerate_usb_mutex);
+	if (!enumerate_usb && libusb_init(&enumerate_usb) < 0)
+		enumerate_usb = NULL;
+	usb = enumerate_usb;
+	pthread_mutex_unlock(&enumerate_usb_mutex);
+
+	return usb;
+}
+
+/* Walks the HID interfaces of all the USB devices, and hands the ones which
+   match filter to sink. Each criterion is checked as soon as the
+   information it needs is at hand, so that devices are only opened if
+   they pass everything that can be checked without opening them.
+
+   The strings of all the devices which pass are then requested at the
+   same time, with asynchronous transfers, so that the enumeration takes
+   about as long as the slowest device rather than the sum of all of
+   them. Devices are handed to sink as soon as their strings have come
+   back, and the ones which haven't answered after enumerate_timeout
+   milliseconds are reported without their strings. The return value is
+   the number of devices handed to sink, or -1 on failure. */
+static int scan_devices(const struct hid_enumerate_filter *filter,
+                        enum_sink_fn sink, void *user_data)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t num_devs;
+	int i = 0;
+	int count = 0;
+	int done = 0;
+	long long deadline;
+	struct enumerate_state state;
+	struct pending_device *all = NULL;
+	libusb_context *usb;
+
+	setlocale(LC_ALL,"");
+
+	usb = get_enumerate_usb();
+	if (!usb)
+		return -1;
+
+	num_devs = libusb_get_device_list(usb, &devs);
+	if (num_devs < 0)
+		return -1;
+
+	state.filter = filter;
+	pthread_mutex_init(&state.mutex, NULL);
+	state.expired = 0;
+	state.num_busy = 0;
+	state.done_head = NULL;
+	state.done_tail = NULL;
+	deadline = get_time_ms() + enumerate_timeout;
+
+	while ((dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct libusb_config_descriptor *conf_desc = NULL;
+		struct pending_device *pd;
+		int res;
+
+		/* The bus number comes straight from the device list. */
+		if (filter->bus_number > 0 &&
+		    filter->bus_number != libusb_get_bus_number(dev))
+			continue;
+
+		res = libusb_get_device_descriptor(dev, &desc);
+		if (res < 0)
+			continue;
+
+		/* HID's are defined at the interface level. */
+		if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
+			continue;
+
+		/* Check the VID/PID against the filter */
+		if (!MATCH_MASKED(desc.idVendor, filter->vendor_id, filter->vendor_id_mask) ||
+		    !MATCH_MASKED(desc.idProduct, filter->product_id, filter->product_id_mask))
+			continue;
+
+		res = libusb_get_active_config_descriptor(dev, &conf_desc);
+		if (res < 0)
+			libusb_get_config_descriptor(dev, 0, &conf_desc);
+		if (!conf_desc)
+			continue;
+
+		pd = new_pending_device(dev, &desc, conf_desc, &state);
+		libusb_free_config_descriptor(conf_desc);
+		if (!pd)
+			continue;
+		pd->next = all;
+		all = pd;
+
+		/* Start with the list of languages. Devices which can't be
+		   asked for strings are reported without them, unless the
+		   filter needs a serial number. */
+		pthread_mutex_lock(&state.mutex);
+		state.num_busy++;
+		if (!pd->handle ||
+		    submit_string_request(pd, STRING_REQ_LANGUAGES, 0x0, enumerate_timeout) < 0)
+			finish_pending_device(pd);
+		pthread_mutex_unlock(&state.mutex);
+	}
+
+	/* Report the devices as they finish, until they all have or the
+	   time is up. */
+	for (;;) {
+		struct pending_device *ready;
+		long long remaining;
+		struct timeval tv;
+
+		pthread_mutex_lock(&state.mutex);
+		ready = state.done_head;
+		state.done_head = NULL;
+		state.done_tail = NULL;
+		pthread_mutex_unlock(&state.mutex);
+
+		while (ready) {
+			struct pending_device *next = ready->next_done;
+			if (!done && report_pending_device(ready, sink, user_data, &count)) {
+				/* The sink has seen enough. */
+				done = 1;
+				cancel_pending_devices(&state, all);
+			}
+			ready = next;
+		}
+
+		pthread_mutex_lock(&state.mutex);
+		if (state.num_busy == 0 && !state.done_head) {
+			pthread_mutex_unlock(&state.mutex);
+			break;
+		}
+		pthread_mutex_unlock(&state.mutex);
+
+		remaining = deadline - get_time_ms();
+		if (remaining <= 0 && !state.expired) {
+			/* Whatever is still outstanding gets cancelled, and its
+			   device reported with what it has so far. */
+			cancel_pending_devices(&state, all);
+		}
+		if (remaining < 1)
+			remaining = 1;
+		tv.tv_sec = remaining / 1000;
+		tv.tv_usec = (remaining % 1000) * 1000;
+		libusb_handle_events_timeout(usb, &tv);
+	}
+
+	while (all) {
+		struct pending_device *next = all->next;
+		free_pending_device(all);
+		all = next;
+	}
+	pthread_mutex_destroy(&state.mutex);
+
+	libusb_free_device_list(devs, 1);
+
+	return count;
+}
+
+/* Sets up filter the way hid_enumerate() has always matched: everything
+   if both IDs are 0, and the exact VID/PID otherwise. */
+static void init_vid_pid_filter(struct hid_enumerate_filter *filter,
+                                unsigned short vendor_id, unsigned short product_id)
+{
+	hid_init_enumerate_filter(filter);
+	if (vendor_id != 0x0 || product_id != 0x0) {
+		filter->vendor_id = vendor_id;
+		filter->vendor_id_mask = 0xffff;
+		filter->product_id = product_id;
+		filter->product_id_mask = 0xffff;
+	}
+}
+
+/* List of hid_device_info records built up by append_to_list(). */
+struct list_sink {
+	struct hid_device_info *root;
+	struct hid_device_info *cur;
+};
+
+static wchar_t *dup_wcs(const wchar_t *s)
+{
+	return (s)? wcsdup(s): NULL;
+}
+
+static int append_to_list(const struct hid_device_info *info, void *user_data)
+{
+	struct list_sink *list = user_data;
+	struct hid_device_info *tmp;
+
+	tmp = malloc(sizeof(struct hid_device_info));
+	if (list->cur) {
+		list->cur->next = tmp;
+	}
+	else {
+		list->root = tmp;
+	}
+	list->cur = tmp;
+
+	*tmp = *info;
+	tmp->next = NULL;
+	tmp->path = (info->path)? strdup(info->path): NULL;
+	tmp->serial_number = dup_wcs(info->serial_number);
+	tmp->manufacturer_string = dup_wcs(info->manufacturer_string);
+	tmp->product_string = dup_wcs(info->product_string);
+
+	return 0;
+}
+
+/* Caller-provided records and string pool filled in by append_to_pool(). */
+struct pool_sink {
+	struct hid_device_info *devs;
+	size_t num_devs;
+	char *strings;
+	size_t strings_len;
+
+	size_t count;        /* Devices seen, whether they fit or not. */
+	size_t strings_used; /* Bytes of the pool needed so far. */
+	int full;            /* Set once a record didn't fit. */
+};
+
+/* Reserves len bytes aligned to align from the string pool. Space is
+   accounted for even when it doesn't fit, in which case NULL is
+   returned. Offsets are aligned from the start of the pool, which is
+   wchar_t-aligned, so the space needed doesn't depend on where the pool
+   is, and a size query with no pool gives the size to allocate. */
+static void *pool_alloc(struct pool_sink *pool, size_t len, size_t align)
+{
+	size_t off = pool->strings_used;
+	off += (align - off % align) % align;
+	pool->strings_used = off + len;
+	if (pool->strings_used > pool->strings_len)
+		return NULL;
+	return pool->strings + off;
+}
+
+static char *pool_strdup(struct pool_sink *pool, const char *s)
+{
+	char *p;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	len = strlen(s) + 1;
+	p = pool_alloc(pool, len, 1);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+static wchar_t *pool_wcsdup(struct pool_sink *pool, const wchar_t *s)
+{
+	wchar_t *p;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	len = (wcslen(s) + 1) * sizeof(wchar_t);
+	p = pool_alloc(pool, len, sizeof(wchar_t));
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+static int append_to_pool(const struct hid_device_info *info, void *user_data)
+{
+	struct pool_sink *pool = user_data;
+	struct hid_device_info rec = *info;
+
+	rec.next = NULL;
+	rec.serial_number = pool_wcsdup(pool, info->serial_number);
+	rec.manufacturer_string = pool_wcsdup(pool, info->manufacturer_string);
+	rec.product_string = pool_wcsdup(pool, info->product_string);
+	rec.path = pool_strdup(pool, info->path);
+
+	/* Only write the record if it and its strings fit. Once one doesn't,
+	   stop writing so that the records stay contiguous. */
+	if (!pool->full &&
+	    pool->count < pool->num_devs &&
+	    pool->strings_used <= pool->strings_len) {
+		pool->devs[pool->count] = rec;
+		if (pool->count > 0)
+			pool->devs[pool->count-1].next = &pool->devs[pool->count];
+	}
+	else
+		pool->full = 1;
+	pool->count++;
+
+	return 0;
+}
+
+/* Returns non-zero if info, which was produced by scan_devices(), matches
+   every criterion of filter. */
+static int info_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
+{
+	return MATCH_MASKED(info->vendor_id, filter->vendor_id, filter->vendor_id_mask) &&
+	       MATCH_MASKED(info->product_id, filter->product_id, filter->product_id_mask) &&
+	       (filter->interface_number < 0 || filter->interface_number == info->interface_number) &&
+	       usage_matches(filter, info) &&
+	       serial_matches(filter, info->serial_number);
+}
+
+/* Process-wide enumeration cache. A snapshot holds the full list of HID
+   devices as of one generation of the device set. It is reference
+   counted so that the sinks can run without cache_mutex held. */
+struct cache_snapshot {
+	struct hid_device_info *devs;
+	unsigned long generation;
+	int refs;
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int cache_enabled = 0;
+static struct cache_snapshot *cache = NULL; /* Protected by cache_mutex */
+
+/* Bumped whenever the set of devices on the system changes. */
+static unsigned long device_generation = 1;
+
+/* Hotplug notification, where libusb supports it. */
+static int hotplug_state = 0; /* 0: not tried, 1: registered, -1: unsupported */
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+static libusb_hotplug_callback_handle hotplug_handle;
+
+static int hotplug_callback(libusb_context *ctx, libusb_device *device,
+                            libusb_hotplug_event event, void *user_data)
+{
+	__sync_fetch_and_add(&device_generation, 1);
+	return 0; /* Stay registered. */
+}
+#endif
+
+/* Bus addresses of all the devices at the last check_bus(), hashed. */
+static unsigned long bus_signature = 0;
+
+/* Checks whether the set of devices has changed since the last call, and
+   bumps device_generation if it has. Where libusb supports hotplug
+   notification, that is used. Otherwise the bus addresses of all the
+   devices are compared with the last call, which doesn't involve the
+   devices themselves. Called with cache_mutex locked. */
+static void check_bus(void)
+{
+	libusb_device **devs;
+	ssize_t num_devs, i;
+	unsigned long sig = 5381;
+	libusb_context *usb = get_enumerate_usb();
+
+	if (!usb)
+		return;
+
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	if (hotplug_state == 0) {
+		if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		    libusb_hotplug_register_callback(usb,
+		        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		        0,
+		        LIBUSB_HOTPLUG_MATCH_ANY,
+		        LIBUSB_HOTPLUG_MATCH_ANY,
+		        LIBUSB_HOTPLUG_MATCH_ANY,
+		        hotplug_callback, NULL, &hotplug_handle) == LIBUSB_SUCCESS)
+			hotplug_state = 1;
+		else
+			hotplug_state = -1;
+	}
+	if (hotplug_state == 1) {
+		/* Hotplug callbacks are run from event handling of the
+		   enumeration's context, which only enumerations do. */
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		libusb_handle_events_timeout_completed(usb, &tv, NULL);
+		return;
+	}
+#endif
+
+	num_devs = libusb_get_device_list(usb, &devs);
+	if (num_devs < 0)
+		return;
+	for (i = 0; i < num_devs; i++) {
+		sig = sig * 33 + (libusb_get_bus_number(devs[i]) << 8 |
+		                  libusb_get_device_address(devs[i]));
+	}
+	libusb_free_device_list(devs, 1);
+
+	if (sig != bus_signature) {
+		bus_signature = sig;
+		__sync_fetch_and_add(&device_generation, 1);
+	}
+}
+
+static void release_snapshot(struct cache_snapshot *snap)
+{
+	/* Called with cache_mutex locked. */
+	if (--snap->refs == 0) {
+		hid_free_enumeration(snap->devs);
+		free(snap);
+	}
+}
+
+/* Hands the devices in filter to sink, from the cache if it is enabled and
+   up to date, and from a fresh scan otherwise. Filters on the bus number
+   always scan, because the cached records don't carry it. */
+static int enumerate(const struct hid_enumerate_filter *filter,
+                     enum_sink_fn sink, void *user_data)
+{
+	struct cache_snapshot *snap;
+	struct hid_device_info *cur;
+	int count = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (!cache_enabled || filter->bus_number > 0) {
+		pthread_mutex_unlock(&cache_mutex);
+		return scan_devices(filter, sink, user_data);
+	}
+
+	check_bus();
+	if (!cache || cache->generation != __sync_fetch_and_add(&device_generation, 0)) {
+		/* Rescan with cache_mutex held, so that other threads wait
+		   for this scan rather than starting their own. Read the
+		   generation first, so that a change during the scan causes
+		   another one next time. */
+		struct hid_enumerate_filter match_all;
+		struct list_sink list;
+
+		snap = malloc(sizeof(struct cache_snapshot));
+		snap->generation = __sync_fetch_and_add(&device_generation, 0);
+		snap->refs = 1;
+		hid_init_enumerate_filter(&match_all);
+		list.root = NULL;
+		list.cur = NULL;
+		if (scan_devices(&match_all, append_to_list, &list) < 0) {
+			free(snap);
+			pthread_mutex_unlock(&cache_mutex);
+			return -1;
+		}
+		snap->devs = list.root;
+
+		if (cache)
+			release_snapshot(cache);
+		cache = snap;
+	}
+	snap = cache;
+	snap->refs++;
+	pthread_mutex_unlock(&cache_mutex);
+
+	for (cur = snap->devs; cur; cur = cur->next) {
+		struct hid_device_info info;
+
+		if (!info_matches(filter, cur))
+			continue;
+		info = *cur;
+		info.next = NULL;
+		count++;
+		if (sink(&info, user_data))
+			break;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	release_snapshot(snap);
+	pthread_mutex_unlock(&cache_mutex);
+
+	return count;
+}
+
+int HID_API_EXPORT hid_set_enumerate_cache(int enable)
+{
+	pthread_mutex_lock(&cache_mutex);
+	cache_enabled = enable;
+	if (!enable && cache) {
+		release_snapshot(cache);
+		cache = NULL;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	return 0;
+}
+
+unsigned long HID_API_EXPORT hid_enumerate_generation(void)
+{
+	pthread_mutex_lock(&cache_mutex);
+	check_bus();
+	pthread_mutex_unlock(&cache_mutex);
+
+	return __sync_fetch_and_add(&device_generation, 0);
+}
+
+void HID_API_EXPORT hid_init_enumerate_filter(struct hid_enumerate_filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->interface_number = -1;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	init_vid_pid_filter(&filter, vendor_id, product_id);
+	return hid_enumerate_filtered(&filter);
+}
+
+struct hid_device_info HID_API_EXPORT *hid_enumerate_filtered(const struct hid_enumerate_filter *filter)
+{
+	struct hid_enumerate_filter match_all;
+	struct list_sink list;
+
+	if (!filter) {
+		hid_init_enumerate_filter(&match_all);
+		filter = &match_all;
+	}
+
+	list.root = NULL; // return object
+	list.cur = NULL;
+	enumerate(filter, append_to_list, &list);
+
+	return list.root;
+}
+
+int HID_API_EXPORT hid_enumerate_each(const struct hid_enumerate_filter *filter, hid_enumerate_cb callback, void *user_data)
+{
+	struct hid_enumerate_filter match_all;
+
+	if (!filter) {
+		hid_init_enumerate_filter(&match_all);
+		filter = &match_all;
+	}
+
+	return enumerate(filter, callback, user_data);
+}
+
+int HID_API_EXPORT hid_enumerate_into(unsigned short vendor_id, unsigned short product_id, struct hid_device_info *devs, size_t num_devs, void *strings, size_t *strings_len)
+{
+	struct hid_enumerate_filter filter;
+	struct pool_sink pool;
+
+	if ((uintptr_t)strings % sizeof(wchar_t) != 0)
+		return -1;
+
+	init_vid_pid_filter(&filter, vendor_id, product_id);
+
+	pool.devs = devs;
+	pool.num_devs = num_devs;
+	pool.strings = strings;
+	pool.strings_len = *strings_len;
+	pool.count = 0;
+	pool.strings_used = 0;
+	pool.full = 0;
+
+	if (enumerate(&filter, append_to_pool, &pool) < 0)
+		return -1;
+
+	*strings_len = pool.strings_used;
+	return pool.count;
+}
+
+int HID_API_EXPORT hid_set_enumerate_timeout(int milliseconds)
+{
+	if (milliseconds <= 0)
+		return -1;
+
+	enumerate_timeout = milliseconds;
+	return 0;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+/* Opens the first device with the given IDs, and serial number if it
+   isn't NULL, through ctx. */
+static hid_device *open_first(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+	
+	devs = hid_enumerate(vendor_id, product_id);
+	cur_dev = devs;
+	while (cur_dev) {
+		if (cur_dev->vendor_id == vendor_id &&
+		    cur_dev->product_id == product_id) {
+			if (serial_number) {
+				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
+					path_to_open = cur_dev->path;
+					break;
+				}
+			}
+			else {
+				path_to_open = cur_dev->path;
+				break;
+			}
+		}
+		cur_dev = cur_dev->next;
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = open_path(ctx, path_to_open);
+	}
+
+	hid_free_enumeration(devs);
+	
+	return handle;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+{
+	hid_context *ctx = get_default_context();
+	if (!ctx)
+		return NULL;
+	return open_first(ctx, vendor_id, product_id, serial_number);
+}
+
+hid_device * HID_API_EXPORT hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	return open_first(ctx, vendor_id, product_id, serial_number);
+}
+
+/* Returns the queue which a report of the given ID goes to, or NULL if
+   reports aren't queued by report ID. */
+static struct input_queue *queue_for_report_id(hid_device *dev, int report_id)
+{
+	if (dev->input_mode != HID_INPUT_MODE_FIFO)
+		return &dev->report_queues[report_id];
+	return NULL;
+}
+
+/* Returns the queue which holds the oldest report, or NULL if there are
+   no reports. This should be called with dev->mutex locked. */
+static struct input_queue *oldest_queue(hid_device *dev)
+{
+	struct input_queue *oldest = NULL;
+	int w;
+
+	if (dev->input_mode == HID_INPUT_MODE_FIFO)
+		return dev->input_queue.head? &dev->input_queue: NULL;
+
+	for (w = 0; w < 4; w++) {
+		uint64_t bits = dev->nonempty_queues[w];
+		while (bits) {
+			int id = w * 64 + __builtin_ctzll(bits);
+			struct input_queue *q = &dev->report_queues[id];
+			if (!oldest || q->head->seq < oldest->head->seq)
+				oldest = q;
+			bits &= bits - 1;
+		}
+	}
+
+	return oldest;
+}
+
+/* Adds rpt to the back of q, dropping the report at the front if q is
+   full, unless flow control is on. Returns 1 if q was empty. This should
+   be called with dev->mutex locked. */
+static int queue_report(hid_device *dev, struct input_queue *q, struct input_report *rpt)
+{
+	int was_empty = (q->head == NULL);
+
+	rpt->seq = __atomic_fetch_add(&dev->next_seq, 1, __ATOMIC_RELEASE);
+	if (q->tail)
+		q->tail->next = rpt;
+	else
+		q->head = rpt;
+	q->tail = rpt;
+	q->count++;
+	dev->num_queued++;
+
+	/* With flow control, the watermarks bound the queues instead, except
+	   in HID_INPUT_MODE_LATEST. */
+	if (q->count > dev->queue_length &&
+	    (dev->high_watermark == 0 || dev->input_mode == HID_INPUT_MODE_LATEST)) {
+		return_data(dev, q, NULL, 0);
+		dev->reports_dropped++;
+	}
+
+	if (q != &dev->input_queue) {
+		int id = q - dev->report_queues;
+		dev->nonempty_queues[id / 64] |= (uint64_t)1 << (id % 64);
+	}
+	__atomic_store_n(&dev->readable, 1, __ATOMIC_RELEASE);
+
+	return was_empty;
+}
+
+/* Returns the report ID of a received report. Reports of devices which
+   don't use numbered reports all count as report ID 0. */
+static int report_id_of(hid_device *dev, const unsigned char *data, size_t len)
+{
+	if (dev->report_descriptor &&
+	    dev->report_descriptor->uses_numbered_reports &&
+	    len > 0)
+		return data[0];
+	return 0;
+}
+
+/* Copies a report into the snapshot of its report ID. This is only
+   called from the reader thread, so there is one writer. */
+static void update_snapshot(hid_device *dev, int report_id, const unsigned char *data, size_t len)
+{
+	struct report_snapshot *snap = dev->snapshots[report_id];
+	unsigned long seq;
+
+	if (!snap) {
+		snap = calloc(1, sizeof(*snap) + dev->input_ep_max_packet_size);
+		if (!snap)
+			return;
+		/* Publish it only once it is initialized. */
+		__atomic_store_n(&dev->snapshots[report_id], snap, __ATOMIC_RELEASE);
+	}
+	if (len > (size_t)dev->input_ep_max_packet_size)
+		len = dev->input_ep_max_packet_size;
+
+	seq = snap->seq;
+	__atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&snap->len, len, __ATOMIC_RELAXED);
+	memcpy(snap->data, data, len);
+	__atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Returns the change filter of a report ID, allocating it if needed, or
+   NULL if it can't be allocated. This should be called with dev->mutex
+   locked. */
+static struct change_filter *get_change_filter(hid_device *dev, int report_id)
+{
+	struct change_filter *f;
+	size_t cap = dev->input_ep_max_packet_size;
+
+	if (!dev->change_filters) {
+		dev->change_filters = calloc(256, sizeof(struct change_filter *));
+		if (!dev->change_filters)
+			return NULL;
+	}
+
+	f = dev->change_filters[report_id];
+	if (!f) {
+		f = calloc(1, sizeof(*f) + 2 * cap);
+		if (!f)
+			return NULL;
+		f->data = (unsigned char *)(f + 1);
+		f->ignore = f->data + cap;
+		dev->change_filters[report_id] = f;
+	}
+
+	return f;
+}
+
+/* Returns nonzero if the first len bytes of a and b differ in any bit
+   which isn't set in ignore. */
+static int reports_differ(const unsigned char *a, const unsigned char *b,
+                          const unsigned char *ignore, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+		                          _mm_loadu_si128((const __m128i *)(b + i)));
+		x = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(ignore + i)), x);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff)
+			return 1;
+	}
+#else
+	for (; i + 8 <= len; i += 8) {
+		uint64_t x, y, m;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		memcpy(&m, ignore + i, 8);
+		if ((x ^ y) & ~m)
+			return 1;
+	}
+#endif
+	for (; i < len; i++) {
+		if ((a[i] ^ b[i]) & ~ignore[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Returns nonzero if a report should be queued, and remembers it as the
+   last queued report of its ID if so. This should be called with
+   dev->mutex locked. */
+static int report_changed(hid_device *dev, int report_id, const unsigned char *data, size_t len)
+{
+	struct change_filter *f = get_change_filter(dev, report_id);
+
+	if (!f)
+		return 1;
+	if (len > (size_t)dev->input_ep_max_packet_size)
+		return 1;
+	if (f->has_report && f->len == len &&
+	    !reports_differ(f->data, data, f->ignore, len))
+		return 0;
+
+	memcpy(f->data, data, len);
+	f->len = len;
+	f->has_report = 1;
+	return 1;
+}
+
+/* Adds a device to the ready list of its set, and wakes a waiter. */
+static void mark_ready(hid_device_set *set, hid_device *dev)
+{
+	pthread_mutex_lock(&set->mutex);
+	if (!dev->in_ready_list) {
+		dev->in_ready_list = 1;
+		dev->next_ready = NULL;
+		if (set->ready_tail)
+			set->ready_tail->next_ready = dev;
+		else
+			set->ready_head = dev;
+		set->ready_tail = dev;
+		pthread_cond_signal(&set->condition);
+	}
+	pthread_mutex_unlock(&set->mutex);
+}
+
+/* Adds a report to the reports for the input callback, dropping the
+   oldest one if the callback has fallen queue_length behind, and
+   schedules the callback if it wasn't. This should be called with
+   dev->mutex locked. */
+static void queue_for_callback(hid_device *dev, const unsigned char *data, size_t len)
+{
+	struct input_queue *q = &dev->callback_reports;
+	struct input_report *rpt = malloc(sizeof(*rpt));
+
+	rpt->data = malloc(len);
+	memcpy(rpt->data, data, len);
+	rpt->len = len;
+	rpt->capacity = len;
+	rpt->seq = 0;
+	rpt->next = NULL;
+	if (q->tail)
+		q->tail->next = rpt;
+	else
+		q->head = rpt;
+	q->tail = rpt;
+	q->count++;
+
+	if (q->count > dev->queue_length) {
+		struct input_report *old = q->head;
+		q->head = old->next;
+		q->count--;
+		free(old->data);
+		free(old);
+		dev->reports_dropped++;
+	}
+
+	if (!dev->callback_scheduled) {
+		dev->callback_scheduled = 1;
+		dev->dispatch_needed = 1;
+	}
+}
 
+/* Frees the reports for the input callback. This should be called with
+   dev->mutex locked. */
+static void clear_callback_reports(hid_device *dev)
+{
+	struct input_report *rpt = dev->callback_reports.head;
+
+	while (rpt) {
+		struct input_report *next = rpt->next;
+		free(rpt->data);
+		free(rpt);
+		rpt = next;
+	}
+	dev->callback_reports.head = NULL;
+	dev->callback_reports.tail = NULL;
+	dev->callback_reports.count = 0;
+}
+
+/* Returns whether the caller should call dispatch_callbacks(), once it
+   has unlocked dev->mutex, for reports which it delivered. This should
+   be called with dev->mutex locked. */
+static int take_dispatch(hid_device *dev)
+{
+	int dispatch = dev->dispatch_needed;
+	dev->dispatch_needed = 0;
+	return dispatch;
+}
+
+/* Passes up to max of a device's reports to its input callback, in
+   order. Returns 1 if reports remain, in which case the device is still
+   scheduled and the caller has to see that they are run. Otherwise, the
+   device is no longer scheduled, and may have been closed by the time
+   this returns. If the callback was removed, the remaining reports are
+   dropped. */
+static int run_callbacks(hid_device *dev, int max)
+{
+	int n;
+
+	for (n = 0; ; n++) {
+		struct input_report *rpt;
+		hid_input_callback callback;
+		void *user_data;
+
+		pthread_mutex_lock(&dev->mutex);
+		rpt = dev->callback_reports.head;
+		callback = dev->input_callback;
+		user_data = dev->input_callback_data;
+		if (!rpt || !callback) {
+			clear_callback_reports(dev);
+			dev->callback_scheduled = 0;
+			/* hid_close() or hid_set_input_callback() may be
+			   waiting for the callbacks to stop. */
+			pthread_cond_broadcast(&dev->condition);
+			pthread_mutex_unlock(&dev->mutex);
+			return 0;
+		}
+		if (n == max) {
+			pthread_mutex_unlock(&dev->mutex);
+			return 1;
+		}
+		dev->callback_reports.head = rpt->next;
+		if (!rpt->next)
+			dev->callback_reports.tail = NULL;
+		dev->callback_reports.count--;
+		pthread_mutex_unlock(&dev->mutex);
+
+		callback(dev, rpt->data, rpt->len, user_data);
+		free(rpt->data);
+		free(rpt);
+	}
+}
+
+/* Puts a device at the bottom of a worker's deque, and wakes an idle
+   worker. */
+static void push_task(struct callback_pool *pool, int worker, hid_device *dev)
+{
+	struct callback_worker *w = &pool->workers[worker];
+
+	pthread_mutex_lock(&w->mutex);
+	dev->next_task = NULL;
+	dev->prev_task = w->bottom;
+	if (w->bottom)
+		w->bottom->next_task = dev;
+	else
+		w->top = dev;
+	w->bottom = dev;
+	pthread_mutex_unlock(&w->mutex);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->num_tasks++;
+	pthread_cond_signal(&pool->condition);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Takes a device off the top (or, when stealing, the bottom) of a
+   worker's deque. Returns NULL if the deque is empty. */
+static hid_device *pop_task(struct callback_worker *w, int steal)
+{
+	hid_device *dev;
+
+	pthread_mutex_lock(&w->mutex);
+	dev = steal? w->bottom: w->top;
+	if (dev) {
+		if (dev->prev_task)
+			dev->prev_task->next_task = dev->next_task;
+		else
+			w->top = dev->next_task;
+		if (dev->next_task)
+			dev->next_task->prev_task = dev->prev_task;
+		else
+			w->bottom = dev->prev_task;
+		dev->prev_task = NULL;
+		dev->next_task = NULL;
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return dev;
+}
+
+/* Runs the callbacks of the devices in a worker's deque, and steals
+   devices from the other workers when it is empty. */
+static void *callback_thread(void *param)
+{
+	struct callback_worker *self = param;
+	struct callback_pool *pool = self->pool;
+	int index = self - pool->workers;
+
+	for (;;) {
+		hid_device *dev = pop_task(self, 0);
+		int i;
+
+		for (i = 1; !dev && i < pool->num_workers; i++)
+			dev = pop_task(&pool->workers[(index + i) % pool->num_workers], 1);
+
+		if (dev) {
+			pthread_mutex_lock(&pool->mutex);
+			pool->num_tasks--;
+			pthread_mutex_unlock(&pool->mutex);
+
+			/* Give the other devices a turn if this one has more. */
+			if (run_callbacks(dev, CALLBACK_BATCH))
+				push_task(pool, index, dev);
+			continue;
+		}
+
+		/* num_tasks may be more than 0 while another worker is
+		   between taking a device and counting it, in which case
+		   this looks again. */
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->num_tasks == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->condition, &pool->mutex);
+		if (pool->num_tasks == 0 && pool->shutdown) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+/* Has the callbacks of a device whose reports were just scheduled run,
+   by the workers of its context if it has any, and otherwise right
+   away. This should be called without dev->mutex locked. */
+static void dispatch_callbacks(hid_device *dev)
+{
+	struct callback_pool *pool = dev->shard->context->callbacks;
+
+	if (pool)
+		push_task(pool, dev->callback_worker, dev);
+	else
+		run_callbacks(dev, INT_MAX);
+}
+
+/* Queues a report, or passes it to the input callback, unless it is
+   filtered out by hid_set_change_only(). This should be called with
+   dev->mutex locked. */
+static void deliver_report(hid_device *dev, int report_id, const unsigned char *data, size_t len)
+{
+	struct input_queue *q = queue_for_report_id(dev, report_id);
+	if (!q)
+		q = &dev->input_queue;
+
+	if (dev->change_only && !report_changed(dev, report_id, data, len)) {
+		/* Nothing new. Don't queue it or wake anyone. */
+	}
+	else if (dev->input_callback) {
+		queue_for_callback(dev, data, len);
+	}
+	else if (dev->input_mode == HID_INPUT_MODE_LATEST &&
+	    q->head && q->head->capacity >= len) {
+		/* Overwrite the unread report in place. */
+		memcpy(q->head->data, data, len);
+		q->head->len = len;
+		q->head->seq = __atomic_fetch_add(&dev->next_seq, 1, __ATOMIC_RELEASE);
+	}
+	else {
 		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
+		rpt->data = malloc(len);
+		memcpy(rpt->data, data, len);
+		rpt->len = len;
+		rpt->capacity = len;
 		rpt->next = NULL;
 
-		pthread_mutex_lock(&dev->mutex);
+		/* Readers only wait while the queue they read from is empty,
+		   so they only need waking when it stops being. */
+		if (queue_report(dev, q, rpt)) {
+			pthread_cond_broadcast(&dev->condition);
+			if (dev->set)
+				mark_ready(dev->set, dev);
+		}
+	}
+}
+
+/* Returns the aggregate of a report ID, allocating it if needed, or NULL
+   if it can't be allocated. This should be called with dev->mutex
+   locked. */
+static struct aggregate *get_aggregate(hid_device *dev, int report_id)
+{
+	struct aggregate *a = dev->aggregates[report_id];
+	size_t n = dev->aggregate_max_values;
+	size_t cap = dev->input_ep_max_packet_size;
+
+	if (!a) {
+		a = calloc(1, sizeof(*a) + n * (sizeof(*a->fields) + sizeof(*a->sum) + 2 * sizeof(*a->min)) + cap);
+		if (!a)
+			return NULL;
+		a->fields = (const struct hid_report_field **)(a + 1);
+		a->sum = (long long *)(a->fields + n);
+		a->min = (int *)(a->sum + n);
+		a->max = a->min + n;
+		a->last = (unsigned char *)(a->max + n);
+		dev->aggregates[report_id] = a;
+	}
+
+	return a;
+}
+
+/* Stores a value in a field of a report. */
+static void store_field(unsigned char *payload, const struct hid_report_field *field, int value)
+{
+	unsigned int i;
+
+	for (i = 0; i < field->bit_size; i++) {
+		unsigned int bit = field->bit_offset + i;
+		if ((value >> (i < 31? i: 31)) & 1)
+			payload[bit / 8] |= 1 << (bit % 8);
+		else
+			payload[bit / 8] &= ~(1 << (bit % 8));
+	}
+}
+
+/* Queues a report holding the aggregate of the reports of one ID
+   received in the current window: the last of them, with each Variable
+   field replaced by its minimum, maximum or mean. This should be called
+   with dev->mutex locked. */
+static void flush_aggregate(hid_device *dev, int report_id, struct aggregate *a)
+{
+	unsigned char *payload = a->last;
+	int i;
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+	if (dev->report_descriptor->uses_numbered_reports)
+		payload++;
+
+	for (i = 0; i < a->num_values; i++) {
+		int value;
+
+		if (!(a->fields[i]->flags & 0x2))
+			continue; /* Array elements are kept as they were last. */
+		if (dev->aggregate_function == HID_AGGREGATE_MIN)
+			value = a->min[i];
+		else if (dev->aggregate_function == HID_AGGREGATE_MAX)
+			value = a->max[i];
+		else
+			value = (int)((a->sum[i] + (a->sum[i] >= 0? a->count: -a->count) / 2) / a->count);
+		store_field(payload, a->fields[i], value);
+	}
+
+	deliver_report(dev, report_id, a->last, a->len);
+	a->count = 0;
+	dev->pending_aggregates[report_id / 64] &= ~((uint64_t)1 << (report_id % 64));
+}
+
+/* Queues the aggregates whose windows have ended. This should be called
+   with dev->mutex locked. */
+static void flush_aggregates(hid_device *dev, long long now)
+{
+	int w;
+
+	for (w = 0; w < 4; w++) {
+		uint64_t bits = dev->pending_aggregates[w];
+		while (bits) {
+			int id = w * 64 + __builtin_ctzll(bits);
+			struct aggregate *a = dev->aggregates[id];
+			if (now >= a->window_end)
+				flush_aggregate(dev, id, a);
+			bits &= bits - 1;
 		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-			
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}			
+	}
+}
+
+/* Adds a report to the aggregate of its ID, first queueing the aggregate
+   if its window has ended. Reports which can't be decoded are queued as
+   they are. This should be called with dev->mutex locked. */
+static void aggregate_report(hid_device *dev, int report_id, const unsigned char *data, size_t len)
+{
+	struct hid_field_value *values = dev->aggregate_values;
+	struct aggregate *a;
+	long long now = get_time_ms();
+	int i, n;
+
+	n = hid_decode_report(dev->aggregate_decoder, data, len, values, dev->aggregate_max_values);
+	a = get_aggregate(dev, report_id);
+	if (n <= 0 || !a || len > (size_t)dev->input_ep_max_packet_size) {
+		deliver_report(dev, report_id, data, len);
+		return;
+	}
+
+	/* A report of another length has other fields. */
+	if (a->count > 0 && (now >= a->window_end || n != a->num_values))
+		flush_aggregate(dev, report_id, a);
+
+	if (a->count == 0) {
+		a->window_end = now + dev->aggregate_window;
+		a->num_values = n;
+		for (i = 0; i < n; i++) {
+			a->fields[i] = values[i].field;
+			a->sum[i] = a->min[i] = a->max[i] = values[i].value;
 		}
-		pthread_mutex_unlock(&dev->mutex);
+		dev->pending_aggregates[report_id / 64] |= (uint64_t)1 << (report_id % 64);
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
+	else {
+		for (i = 0; i < n; i++) {
+			int v = values[i].value;
+			a->sum[i] += v;
+			if (v < a->min[i])
+				a->min[i] = v;
+			if (v > a->max[i])
+				a->max[i] = v;
+		}
+	}
+	a->count++;
+	memcpy(a->last, data, len);
+	a->len = len;
+}
+
+/* A crossing of a flow control watermark, which is reported once
+   dev->mutex is unlocked, so that the callback can call into hidapi. */
+struct watermark_event {
+	hid_watermark_callback callback;
+	void *user_data;
+	int above;
+};
+
+/* Records a crossing to report with report_watermark(). This should be
+   called with dev->mutex locked. */
+static void note_watermark(hid_device *dev, struct watermark_event *ev, int above)
+{
+	ev->callback = dev->watermark_callback;
+	ev->user_data = dev->watermark_user_data;
+	ev->above = above;
+	if (ev->callback)
+		dev->watermark_notifications++;
+}
+
+/* Calls the callback of a crossing recorded by note_watermark(). This
+   should be called with dev->mutex unlocked. The device can't be freed
+   until the callback has returned, since hid_close() waits for it. */
+static void report_watermark(hid_device *dev, const struct watermark_event *ev)
+{
+	if (!ev->callback)
+		return;
+
+	ev->callback(dev, ev->above, ev->user_data);
+
+	pthread_mutex_lock(&dev->mutex);
+	if (--dev->watermark_notifications == 0)
+		pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* Submits the transfer if the device is to be polled and the transfer
+   isn't in flight, or cancels it once the device is idle. This should be
+   called with dev->mutex locked. */
+static void update_polling(hid_device *dev)
+{
+	if (dev->shutdown_thread)
 		return;
+
+	if (!dev->input_paused && !dev->polling_idle) {
+		if (dev->transfer_submitted)
+			return;
+		if (libusb_submit_transfer(dev->transfer) < 0) {
+			/* The device is most likely gone. Once the queues are
+			   empty, reads return -1, as they do after a
+			   disconnect. */
+			dev->shutdown_thread = 1;
+			pthread_cond_broadcast(&dev->condition);
+			if (dev->set)
+				mark_ready(dev->set, dev);
+			return;
+		}
+		dev->transfer_submitted = 1;
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
+	else if (dev->polling_idle && dev->transfer_submitted && !dev->idle_cancel) {
+		/* Stop the host from polling the device until it is read
+		   from again. */
+		if (libusb_cancel_transfer(dev->transfer) == 0)
+			dev->idle_cancel = 1;
+	}
+}
+
+/* Lets polling resume once the queues have been read down to the low
+   watermark, or flow control was turned off. The caller then calls
+   update_polling(). This should be called with dev->mutex locked. */
+static void check_low_watermark(hid_device *dev, struct watermark_event *ev)
+{
+	if (!dev->input_paused)
 		return;
+	if (dev->high_watermark > 0 && dev->num_queued > dev->low_watermark)
+		return;
+
+	dev->input_paused = 0;
+	note_watermark(dev, ev, 0);
+}
+
+/* Records that someone wants the device's reports, resuming polling if
+   it was idle. This should be called with dev->mutex locked. */
+static void note_demand(hid_device *dev)
+{
+	if (dev->idle_timeout == 0)
+		return;
+
+	dev->last_demand = get_time_ms();
+	if (dev->polling_idle) {
+		dev->polling_idle = 0;
+		update_polling(dev);
+	}
+}
+
+/* Stops polling a device which nobody has read from for idle_timeout
+   milliseconds, unless it is in a set, has snapshots or has an input
+   callback, whose readers don't say when they are done. This should be
+   called with dev->mutex locked. */
+static void check_idle(hid_device *dev, long long now)
+{
+	if (dev->idle_timeout == 0 || dev->polling_idle || dev->active_readers > 0)
+		return;
+	if (dev->set || dev->input_callback ||
+	    __atomic_load_n(&dev->snapshots_enabled, __ATOMIC_ACQUIRE))
+		return;
+	if (now - dev->last_demand < dev->idle_timeout)
+		return;
+
+	dev->polling_idle = 1;
+	update_polling(dev);
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	hid_device *dev = transfer->user_data;
+	struct watermark_event ev = { NULL, NULL, 0 };
+	size_t len = transfer->actual_length;
+	int report_id = 0;
+	int idle_cancel;
+	int dispatch;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		report_id = report_id_of(dev, transfer->buffer, len);
+		if (__atomic_load_n(&dev->snapshots_enabled, __ATOMIC_ACQUIRE))
+			update_snapshot(dev, report_id, transfer->buffer, len);
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+
+	dev->transfer_submitted = 0;
+	idle_cancel = dev->idle_cancel;
+	dev->idle_cancel = 0;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		dev->reports_received++;
+		if (dev->decimation > 1) {
+			/* Queue the first of every decimation reports of each
+			   report ID. */
+			if (dev->decimation_counts[report_id]++ % dev->decimation == 0)
+				deliver_report(dev, report_id, transfer->buffer, len);
+		}
+		else if (dev->aggregate_window > 0)
+			aggregate_report(dev, report_id, transfer->buffer, len);
+		else
+			deliver_report(dev, report_id, transfer->buffer, len);
+
+		/* With flow control, stop polling the device once the
+		   queues are full. It then NAKs, and buffers what it can,
+		   until a reader resubmits the transfer. */
+		if (dev->high_watermark > 0 && !dev->input_paused &&
+		    dev->num_queued >= dev->high_watermark) {
+			dev->input_paused = 1;
+			note_watermark(dev, &ev, 1);
+		}
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED && idle_cancel) {
+		/* Cancelled by update_polling() because nobody reads. */
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+	         transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		/* Wake any readers, so they can return the error. */
+		dev->shutdown_thread = 1;
+		pthread_cond_broadcast(&dev->condition);
+		if (dev->set)
+			mark_ready(dev->set, dev);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
 		//LOG("Timeout (normal)\n");
@@ -645,21 +2564,224 @@ static void read_callback(struct libusb_transfer *transfer)
 	else {
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
-	
-	/* Re-submit the transfer object. */
-	libusb_submit_transfer(transfer);
+
+	/* Re-submit the transfer object, unless polling is to stop. */
+	update_polling(dev);
+	if (dev->shutdown_thread) {
+		/* hid_close() may be waiting for the transfer. */
+		pthread_cond_broadcast(&dev->condition);
+	}
+	dispatch = take_dispatch(dev);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	report_watermark(dev, &ev);
+	if (dispatch)
+		dispatch_callbacks(dev);
+}
+
+
+/* Handles the libusb events of a shard, which run read_callback() for
+   its devices, and does their periodic work: queueing the aggregates of
+   devices which went quiet, and stopping the polling of devices which
+   nobody reads. */
+static void *event_thread(void *param)
+{
+	struct event_shard *shard = param;
+	int busy = 1;
+
+	while (!__atomic_load_n(&shard->shutdown_thread, __ATOMIC_ACQUIRE)) {
+		int res;
+		struct timeval tv;
+		hid_device *dev;
+		hid_device *to_dispatch = NULL;
+		long long now;
+
+		/* While no device is polled, there are few events, and
+		   waking up less often saves CPU time. */
+		tv.tv_sec = 0;
+		tv.tv_usec = busy? 100: 10000; //TODO: Fix this value.
+		res = libusb_handle_events_timeout(shard->usb, &tv);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+			LOG("libusb_handle_events_timeout() failed with %d\n", res);
+
+		busy = 0;
+		now = get_time_ms();
+		pthread_mutex_lock(&shard->mutex);
+		for (dev = shard->devices; dev; dev = dev->next_in_shard) {
+			int dispatch;
+			pthread_mutex_lock(&dev->mutex);
+			if (dev->aggregate_window > 0)
+				flush_aggregates(dev, now);
+			check_idle(dev, now);
+			if (!dev->polling_idle)
+				busy = 1;
+			dispatch = take_dispatch(dev);
+			pthread_mutex_unlock(&dev->mutex);
+			if (dispatch) {
+				/* Scheduled devices aren't in any deque yet,
+				   and can't be closed until their callbacks
+				   have run. */
+				dev->next_task = to_dispatch;
+				to_dispatch = dev;
+			}
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		/* Callbacks may open other devices, which needs the shard's
+		   mutex. Closing devices of this shard can't be allowed,
+		   since that waits for this thread; see
+		   hid_set_input_callback(). */
+		while (to_dispatch) {
+			dev = to_dispatch;
+			to_dispatch = dev->next_task;
+			dispatch_callbacks(dev);
+		}
+	}
+
+	return NULL;
+}
+
+/* Estimates the bandwidth of an Input endpoint, in bytes per second,
+   assuming it sends a full packet at every polling interval. */
+static long long endpoint_bandwidth(libusb_device *usb_dev, const struct libusb_endpoint_descriptor *ep)
+{
+	int packet_size = ep->wMaxPacketSize & 0x7ff;
+	int packets = ((ep->wMaxPacketSize >> 11) & 0x3) + 1;
+	int interval = ep->bInterval? ep->bInterval: 1;
+
+	/* At high speed and above, the interval is 2^(bInterval-1)
+	   microframes of 125us, and otherwise bInterval frames of 1ms. */
+	if (libusb_get_device_speed(usb_dev) >= LIBUSB_SPEED_HIGH) {
+		if (interval > 16)
+			interval = 16;
+		return (long long)packet_size * packets * 8000 / (1 << (interval - 1));
+	}
+	return (long long)packet_size * packets * 1000 / interval;
 }
 
+/* Estimates the bandwidth of the Input endpoint of the device at path,
+   looking it up in usb. Returns 0 if the device isn't found. */
+static long long estimate_bandwidth(libusb_context *usb, const char *path)
+{
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	long long bandwidth = 0;
+	int d = 0;
+
+	if (libusb_get_device_list(usb, &devs) < 0)
+		return 0;
+	while ((usb_dev = devs[d++]) != NULL) {
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int i,j,k;
+
+		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+			continue;
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				char *dev_path;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+					continue;
+				dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
+				if (!strcmp(dev_path, path)) {
+					/* The first interrupt IN endpoint, as in
+					   open_path(). */
+					for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+						const struct libusb_endpoint_descriptor *ep
+							= &intf_desc->endpoint[i];
+						if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+						    (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+							bandwidth = endpoint_bandwidth(usb_dev, ep);
+							break;
+						}
+					}
+				}
+				free(dev_path);
+			}
+		}
+		libusb_free_config_descriptor(conf_desc);
+	}
+	libusb_free_device_list(devs, 1);
+
+	return bandwidth;
+}
+
+/* Chooses the event thread of a context for a device with the given
+   bandwidth, according to the context's shard_assignment. */
+static struct event_shard *choose_shard(hid_context *ctx, long long bandwidth)
+{
+	struct event_shard *best;
+	long long best_load = 0;
+	int i;
+
+	if (ctx->num_shards == 1)
+		return &ctx->shards[0];
+	if (ctx->config.shard_assignment == HID_SHARD_ROUND_ROBIN)
+		return &ctx->shards[__atomic_fetch_add(&ctx->next_shard, 1, __ATOMIC_RELAXED) % ctx->num_shards];
 
-static void *read_thread(void *param)
+	/* Reserve the bandwidth right away, so that devices being opened
+	   at the same time spread out. start_reading() doesn't add it
+	   again, and hid_close() or a failed open takes it off. */
+	best = NULL;
+	for (i = 0; i < ctx->num_shards; i++) {
+		long long load;
+		pthread_mutex_lock(&ctx->shards[i].mutex);
+		load = ctx->shards[i].load;
+		pthread_mutex_unlock(&ctx->shards[i].mutex);
+		if (!best || load < best_load) {
+			best = &ctx->shards[i];
+			best_load = load;
+		}
+	}
+	pthread_mutex_lock(&best->mutex);
+	best->load += bandwidth;
+	pthread_mutex_unlock(&best->mutex);
+
+	return best;
+}
+
+/* Takes a device's bandwidth off the load of its shard. */
+static void release_bandwidth(struct event_shard *shard, long long bandwidth)
+{
+	pthread_mutex_lock(&shard->mutex);
+	shard->load -= bandwidth;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Sets up the transfer of a device which was just opened, and starts
+   reading it in its shard's event thread, starting the thread if this
+   is the shard's first device. Returns 0, or -1 on failure. */
+static int start_reading(struct event_shard *shard, hid_device *dev)
 {
-	hid_device *dev = param;
+	hid_context *ctx = shard->context;
 	unsigned char *buf;
 	const size_t length = dev->input_ep_max_packet_size;
+	int res;
+
+	if (ctx->callbacks)
+		dev->callback_worker = __atomic_fetch_add(&ctx->callbacks->next_worker, 1, __ATOMIC_RELAXED) % ctx->callbacks->num_workers;
+
+	/* The transfer doesn't exist yet, so this mustn't go through
+	   hid_set_input_mode(), which would submit it. Polling starts with
+	   the first submission below. */
+	pthread_mutex_lock(&dev->mutex);
+	res = set_input_mode(dev, ctx->config.input_mode, ctx->config.queue_length);
+	pthread_mutex_unlock(&dev->mutex);
+	if (res < 0)
+		return -1;
 
-	/* Set up the transfer object. */
+	/* Set up the transfer object. It is freed by hid_close(). */
 	buf = malloc(length);
 	dev->transfer = libusb_alloc_transfer(0);
+	if (!buf || !dev->transfer) {
+		free(buf);
+		libusb_free_transfer(dev->transfer);
+		dev->transfer = NULL;
+		return -1;
+	}
 	libusb_fill_interrupt_transfer(dev->transfer,
 		dev->device_handle,
 		dev->input_endpoint,
@@ -668,48 +2790,54 @@ static void *read_thread(void *param)
 		read_callback,
 		dev,
 		5000/*timeout*/);
-	
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
 
-	// Notify the main thread that the read thread is up and running.
-	pthread_barrier_wait(&dev->barrier);
-	
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		int res;
-		struct timeval tv;
+	pthread_mutex_lock(&shard->mutex);
+	if (!shard->thread_running) {
+		pthread_attr_t attr;
 
-		tv.tv_sec = 0;
-		tv.tv_usec = 100; //TODO: Fix this value.
-		res = libusb_handle_events_timeout(NULL, &tv);
-		if (res < 0) {
-			/* There was an error. Break out of this loop. */
-			break;
+		pthread_attr_init(&attr);
+		if (ctx->config.event_thread_priority > 0) {
+			struct sched_param param;
+			memset(&param, 0, sizeof(param));
+			param.sched_priority = ctx->config.event_thread_priority;
+			pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+			pthread_attr_setschedparam(&attr, &param);
 		}
+		if (shard->cpu >= 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(shard->cpu, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		res = pthread_create(&shard->thread, &attr, event_thread, shard);
+		pthread_attr_destroy(&attr);
+		if (res != 0) {
+			LOG("can't start the event thread: %d\n", res);
+			pthread_mutex_unlock(&shard->mutex);
+			free(buf);
+			libusb_free_transfer(dev->transfer);
+			dev->transfer = NULL;
+			return -1;
+		}
+		shard->thread_running = 1;
 	}
-	
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	if (libusb_cancel_transfer(dev->transfer) == 0) {
-		/* The transfer was cancelled, so wait for its completion. */
-		libusb_handle_events(NULL);
-	}
-
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
-	
-	return NULL;
-}
+	dev->shard = shard;
+	dev->next_in_shard = shard->devices;
+	shard->devices = dev;
+	pthread_mutex_unlock(&shard->mutex);
+
+	/* Make the first submission. Further submissions are made
+	   from inside read_callback(), or by update_polling() */
+	pthread_mutex_lock(&dev->mutex);
+	dev->last_demand = get_time_ms();
+	update_polling(dev);
+	pthread_mutex_unlock(&dev->mutex);
 
+	return 0;
+}
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+static hid_device *open_path(hid_context *ctx, const char *path)
 {
 	hid_device *dev = NULL;
 
@@ -721,15 +2849,20 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	int res;
 	int d = 0;
 	int good_open = 0;
+	struct event_shard *shard;
 	
 	setlocale(LC_ALL,"");
-	
-	if (!initialized) {
-		libusb_init(NULL);
-		initialized = 1;
+
+	/* Pick the event thread first, since the device has to be opened
+	   in its libusb context. */
+	if (ctx->num_shards > 1 && ctx->config.shard_assignment == HID_SHARD_BANDWIDTH) {
+		libusb_context *usb = get_enumerate_usb();
+		if (usb)
+			dev->bandwidth = estimate_bandwidth(usb, path);
 	}
+	shard = choose_shard(ctx, dev->bandwidth);
 	
-	num_devs = libusb_get_device_list(NULL, &devs);
+	num_devs = libusb_get_device_list(shard->usb, &devs);
 	while ((usb_dev = devs[d++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
@@ -786,6 +2919,22 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 						/* Store off the interface number */
 						dev->interface = intf_desc->bInterfaceNumber;
+
+						/* Get and parse the HID Report Descriptor.
+						   The interface is claimed, so this doesn't
+						   disturb anything. */
+						{
+							unsigned char rpt[MAX_REPORT_DESCRIPTOR_SIZE];
+							res = libusb_control_transfer(dev->device_handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_REPORT << 8, dev->interface, rpt, sizeof(rpt), 5000);
+							if (res > 0)
+								dev->report_descriptor = hid_parse_report_descriptor(rpt, res);
+							else
+								LOG("libusb_control_transfer() for getting the HID report descriptor failed with %d\n", res);
+							if (dev->report_descriptor) {
+								dev->output_encoder = hid_report_encoder_create(dev->report_descriptor, HID_REPORT_OUTPUT);
+								dev->feature_encoder = hid_report_encoder_create(dev->report_descriptor, HID_REPORT_FEATURE);
+							}
+						}
 												
 						/* Find the INPUT and OUTPUT endpoints. An
 						   OUTPUT endpoint is not required. */
@@ -819,10 +2968,12 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 						
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-						
-						// Wait here for the read thread to be initialized.
-						pthread_barrier_wait(&dev->barrier);
+						if (start_reading(shard, dev) < 0) {
+							LOG("can't start reading the device\n");
+							libusb_release_interface(dev->device_handle, dev->interface);
+							libusb_close(dev->device_handle);
+							good_open = 0;
+						}
 						
 					}
 					free(dev_path);
@@ -833,146 +2984,708 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 	}
 
-	libusb_free_device_list(devs, 1);
-	
-	// If we have a good handle, return it.
-	if (good_open) {
-		return dev;
+	libusb_free_device_list(devs, 1);
+	
+	// If we have a good handle, return it.
+	if (good_open) {
+		return dev;
+	}
+	else {
+		// Unable to open any devices.
+		if (dev->bandwidth)
+			release_bandwidth(shard, dev->bandwidth);
+		free_hid_device(dev);
+		return NULL;
+	}
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_context *ctx = get_default_context();
+	if (!ctx)
+		return NULL;
+	return open_path(ctx, path);
+}
+
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
+{
+	return open_path(ctx, path);
+}
+
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res;
+	int report_number = data[0];
+	int skipped_report_id = 0;
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrput out endpoint. Use the Control Endpoint */
+		res = libusb_control_transfer(dev->device_handle,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			(unsigned char *)data, length,
+			1000/*timeout millis*/);
+		
+		if (res < 0)
+			return -1;
+		
+		if (skipped_report_id)
+			length++;
+		
+		return length;
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		int actual_length;
+		res = libusb_interrupt_transfer(dev->device_handle,
+			dev->output_endpoint,
+			(unsigned char*)data,
+			length,
+			&actual_length, 1000);
+		
+		if (res < 0)
+			return -1;
+		
+		if (skipped_report_id)
+			actual_length++;
+		
+		return actual_length;
+	}
+}
+
+/* Helper function, to simplify hid_read().
+   This should be called with dev->mutex locked. */
+static int return_data(hid_device *dev, struct input_queue *q, unsigned char *data, size_t length)
+{
+	/* Copy the data out of the linked list item (rpt) into the
+	   return buffer (data), and delete the liked list item. */
+	struct input_report *rpt = q->head;
+	size_t len = (length < rpt->len)? length: rpt->len;
+	if (len > 0)
+		memcpy(data, rpt->data, len);
+	q->head = rpt->next;
+	if (!q->head) {
+		q->tail = NULL;
+		if (q != &dev->input_queue) {
+			int id = q - dev->report_queues;
+			dev->nonempty_queues[id / 64] &= ~((uint64_t)1 << (id % 64));
+		}
+		__atomic_store_n(&dev->readable,
+			dev->input_queue.head != NULL ||
+			(dev->nonempty_queues[0] | dev->nonempty_queues[1] |
+			 dev->nonempty_queues[2] | dev->nonempty_queues[3]) != 0,
+			__ATOMIC_RELEASE);
+	}
+	q->count--;
+	dev->num_queued--;
+	free(rpt->data);
+	free(rpt);
+	return len;
+}
+
+/* Frees every queued report. This should be called with dev->mutex
+   locked. */
+static void clear_queues(hid_device *dev)
+{
+	struct input_queue *q;
+
+	while ((q = oldest_queue(dev)) != NULL)
+		return_data(dev, q, NULL, 0);
+}
+
+/* Reads the oldest report, or if report_id isn't -1, the oldest report
+   with that ID, waiting for one until deadline, a CLOCK_MONOTONIC time in
+   nanoseconds. -1 waits forever, and 0 doesn't wait at all. */
+static int read_report(hid_device *dev, int report_id, unsigned char *data, size_t length, long long deadline)
+{
+	int bytes_read = -1;
+	struct timespec ts;
+	long long spin_end = 0;
+	struct watermark_event ev = { NULL, NULL, 0 };
+
+	if (dev->wait_strategy != HID_WAIT_BLOCK && deadline != 0) {
+		if (dev->wait_strategy == HID_WAIT_BUSY_POLL)
+			spin_end = LLONG_MAX;
+		else
+			spin_end = get_time_ns() + dev->spin_us * 1000LL;
+		if (deadline > 0 && spin_end > deadline)
+			spin_end = deadline;
+	}
+
+	/* dev->condition waits on CLOCK_MONOTONIC, so the deadline can be
+	   used as it is. */
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	dev->active_readers++;
+	note_demand(dev);
+
+	for (;;) {
+		struct input_queue *q;
+
+		if (report_id < 0)
+			q = oldest_queue(dev);
+		else {
+			q = queue_for_report_id(dev, report_id);
+			if (!q) {
+				/* Not queueing by report ID. */
+				bytes_read = -1;
+				break;
+			}
+		}
+
+		/* There's an input report queued up. Return it. */
+		if (q && q->head) {
+			bytes_read = return_data(dev, q, data, length);
+			check_low_watermark(dev, &ev);
+			update_polling(dev);
+			break;
+		}
+
+		if (dev->shutdown_thread) {
+			/* This means the device has been disconnected.
+			   An error code of -1 should be returned. */
+			bytes_read = -1;
+			break;
+		}
+
+		if (spin_end > 0) {
+			/* Spin until a report is queued, without the mutex,
+			   so that read_callback() isn't held up, then check
+			   again. Once the time is up, block. */
+			unsigned long seq = dev->next_seq;
+			pthread_mutex_unlock(&dev->mutex);
+			while (__atomic_load_n(&dev->next_seq, __ATOMIC_ACQUIRE) == seq &&
+			       !__atomic_load_n(&dev->shutdown_thread, __ATOMIC_ACQUIRE)) {
+				if (get_time_ns() >= spin_end) {
+					spin_end = 0;
+					break;
+				}
+				cpu_relax();
+			}
+			pthread_mutex_lock(&dev->mutex);
+			if (spin_end == 0 && dev->wait_strategy == HID_WAIT_BUSY_POLL) {
+				/* Busy polling only ends when the time is up. */
+				deadline = 0;
+			}
+			continue;
+		}
+
+		if (deadline == -1) {
+			/* Blocking */
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		}
+		else if (deadline > 0) {
+			/* Non-blocking, but called with a deadline. */
+			if (pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts) == ETIMEDOUT) {
+				bytes_read = 0;
+				break;
+			}
+		}
+		else {
+			/* Purely non-blocking */
+			bytes_read = 0;
+			break;
+		}
+	}
+
+	dev->active_readers--;
+	if (dev->idle_timeout > 0)
+		dev->last_demand = get_time_ms();
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	report_watermark(dev, &ev);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+#if 0
+	int transferred;
+	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
+	LOG("transferred: %d\n", transferred);
+	return transferred;
+#endif
+
+	return read_report(dev, -1, data, length, deadline_after(milliseconds));
+}
+
+int HID_API_EXPORT hid_read_deadline(hid_device *dev, unsigned char *data, size_t length, long long deadline_ns)
+{
+	return read_report(dev, -1, data, length, (deadline_ns < 0)? -1: deadline_ns);
+}
+
+int HID_API_EXPORT hid_read_report_id_timeout(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds)
+{
+	return read_report(dev, report_id, data, length, deadline_after(milliseconds));
+}
+
+/* Empties the queues of dev and switches it to the given mode, without
+   touching the polling. Returns 0, or -1 on failure. This should be
+   called with dev->mutex locked. */
+static int set_input_mode(hid_device *dev, int mode, int queue_length)
+{
+	if (mode != HID_INPUT_MODE_FIFO && mode != HID_INPUT_MODE_PER_REPORT_ID &&
+	    mode != HID_INPUT_MODE_LATEST)
+		return -1;
+	if (queue_length < 0)
+		return -1;
+
+	clear_queues(dev);
+	if (mode != HID_INPUT_MODE_FIFO && !dev->report_queues) {
+		dev->report_queues = calloc(256, sizeof(struct input_queue));
+		if (!dev->report_queues)
+			return -1;
+	}
+	dev->input_mode = mode;
+	if (mode == HID_INPUT_MODE_LATEST)
+		dev->queue_length = 1;
+	else
+		dev->queue_length = queue_length? queue_length: DEFAULT_QUEUE_LENGTH;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_input_mode(hid_device *dev, int mode, int queue_length)
+{
+	struct watermark_event ev = { NULL, NULL, 0 };
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (set_input_mode(dev, mode, queue_length) < 0) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+	check_low_watermark(dev, &ev);
+	update_polling(dev);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	report_watermark(dev, &ev);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_flow_control(hid_device *dev, int high_watermark, int low_watermark, hid_watermark_callback callback, void *user_data)
+{
+	struct watermark_event ev = { NULL, NULL, 0 };
+
+	if (high_watermark < 0 || low_watermark < 0)
+		return -1;
+	if (high_watermark > 0 && low_watermark >= high_watermark)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->high_watermark = high_watermark;
+	dev->low_watermark = low_watermark;
+	dev->watermark_callback = callback;
+	dev->watermark_user_data = user_data;
+	check_low_watermark(dev, &ev);
+	update_polling(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	report_watermark(dev, &ev);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_demand_polling(hid_device *dev, int idle_milliseconds)
+{
+	if (idle_milliseconds < 0)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (idle_milliseconds > 0)
+		dev->last_demand = get_time_ms();
+	dev->idle_timeout = idle_milliseconds;
+	if (idle_milliseconds == 0 && dev->polling_idle) {
+		dev->polling_idle = 0;
+		update_polling(dev);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	pthread_mutex_lock(&dev->mutex);
+	dev->input_callback = callback;
+	dev->input_callback_data = user_data;
+	if (callback) {
+		/* The callback wants the reports from now on. */
+		note_demand(dev);
+	}
+	else {
+		/* Whoever runs the callbacks drops the remaining reports
+		   once it sees that the callback is gone. */
+		while (dev->callback_scheduled)
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_start_read_thread(hid_device *dev, int queue_length)
+{
+	if (queue_length < 0)
+		return -1;
+
+	/* The device is read by the event thread of its context. */
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->input_mode != HID_INPUT_MODE_LATEST)
+		dev->queue_length = queue_length? queue_length: DEFAULT_QUEUE_LENGTH;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_wait_strategy(hid_device *dev, int strategy, int spin_microseconds)
+{
+	if (strategy != HID_WAIT_BLOCK && strategy != HID_WAIT_SPIN_THEN_BLOCK &&
+	    strategy != HID_WAIT_BUSY_POLL)
+		return -1;
+	if (spin_microseconds < 0)
+		return -1;
+
+	dev->wait_strategy = strategy;
+	dev->spin_us = spin_microseconds;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_input_stats(hid_device *dev, struct hid_input_stats *stats)
+{
+	pthread_mutex_lock(&dev->mutex);
+	stats->received = dev->reports_received;
+	stats->dropped = dev->reports_dropped;
+	stats->queued = dev->num_queued;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_enable_snapshots(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex);
+	if (!dev->snapshots) {
+		dev->snapshots = calloc(256, sizeof(struct report_snapshot *));
+		if (!dev->snapshots) {
+			pthread_mutex_unlock(&dev->mutex);
+			return -1;
+		}
+	}
+	__atomic_store_n(&dev->snapshots_enabled, 1, __ATOMIC_RELEASE);
+	note_demand(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_read_snapshot(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, unsigned long *sequence)
+{
+	struct report_snapshot *snap;
+	unsigned long seq;
+	size_t len;
+
+	if (!__atomic_load_n(&dev->snapshots_enabled, __ATOMIC_ACQUIRE))
+		return -1;
+
+	snap = __atomic_load_n(&dev->snapshots[report_id], __ATOMIC_ACQUIRE);
+	if (!snap) {
+		if (sequence)
+			*sequence = 0;
+		return 0;
 	}
-	else {
-		// Unable to open any devices.
-		free_hid_device(dev);
-		return NULL;
+
+	for (;;) {
+		seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* The reader thread is in the middle of an update. */
+			sched_yield();
+			continue;
+		}
+		len = __atomic_load_n(&snap->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, snap->data, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) == seq)
+			break;
 	}
+
+	if (sequence)
+		*sequence = seq / 2;
+	return len;
 }
 
+int HID_API_EXPORT hid_set_change_only(hid_device *dev, int enable)
+{
+	pthread_mutex_lock(&dev->mutex);
+	dev->change_only = enable;
+	if (dev->change_filters) {
+		/* Compare the next report with nothing, so that it is
+		   queued. */
+		int i;
+		for (i = 0; i < 256; i++) {
+			if (dev->change_filters[i])
+				dev->change_filters[i]->has_report = 0;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length)
 {
-	int res;
-	int report_number = data[0];
-	int skipped_report_id = 0;
+	struct change_filter *f;
+	size_t cap = dev->input_ep_max_packet_size;
 
-	if (report_number == 0x0) {
-		data++;
-		length--;
-		skipped_report_id = 1;
+	pthread_mutex_lock(&dev->mutex);
+	f = get_change_filter(dev, report_id);
+	if (!f) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
 	}
+	if (!mask)
+		length = 0;
+	else if (length > cap)
+		length = cap;
+	if (length > 0)
+		memcpy(f->ignore, mask, length);
+	memset(f->ignore + length, 0, cap - length);
+	pthread_mutex_unlock(&dev->mutex);
 
+	return 0;
+}
 
-	if (dev->output_endpoint <= 0) {
-		/* No interrput out endpoint. Use the Control Endpoint */
-		res = libusb_control_transfer(dev->device_handle,
-			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
-			0x09/*HID Set_Report*/,
-			(2/*HID output*/ << 8) | report_number,
-			dev->interface,
-			(unsigned char *)data, length,
-			1000/*timeout millis*/);
-		
-		if (res < 0)
-			return -1;
-		
-		if (skipped_report_id)
-			length++;
-		
-		return length;
-	}
-	else {
-		/* Use the interrupt out endpoint */
-		int actual_length;
-		res = libusb_interrupt_transfer(dev->device_handle,
-			dev->output_endpoint,
-			(unsigned char*)data,
-			length,
-			&actual_length, 1000);
-		
-		if (res < 0)
+int HID_API_EXPORT hid_set_decimation(hid_device *dev, int n)
+{
+	if (n < 0)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (n > 1 && !dev->decimation_counts) {
+		dev->decimation_counts = calloc(256, sizeof(unsigned int));
+		if (!dev->decimation_counts) {
+			pthread_mutex_unlock(&dev->mutex);
 			return -1;
-		
-		if (skipped_report_id)
-			actual_length++;
-		
-		return actual_length;
+		}
 	}
+	if (dev->decimation_counts)
+		memset(dev->decimation_counts, 0, 256 * sizeof(unsigned int));
+	dev->decimation = n;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
 }
 
-/* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT hid_set_aggregation(hid_device *dev, int function, int milliseconds)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
-	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
-	return len;
+	int res = 0;
+	int dispatch;
+
+	if (function != HID_AGGREGATE_MIN && function != HID_AGGREGATE_MAX &&
+	    function != HID_AGGREGATE_MEAN)
+		return -1;
+	if (milliseconds < 0)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	/* Queue what was aggregated with the old settings. */
+	flush_aggregates(dev, LLONG_MAX);
+
+	if (milliseconds > 0 && !dev->aggregate_decoder) {
+		if (!dev->report_descriptor) {
+			res = -1;
+			goto out;
+		}
+		dev->aggregate_decoder = hid_report_decoder_create(dev->report_descriptor, HID_REPORT_INPUT);
+		if (!dev->aggregate_decoder) {
+			res = -1;
+			goto out;
+		}
+		dev->aggregate_max_values = hid_report_decoder_max_values(dev->aggregate_decoder);
+		dev->aggregate_values = calloc(dev->aggregate_max_values + 1, sizeof(struct hid_field_value));
+		dev->aggregates = calloc(256, sizeof(struct aggregate *));
+		if (!dev->aggregate_values || !dev->aggregates) {
+			free(dev->aggregate_values);
+			free(dev->aggregates);
+			dev->aggregate_values = NULL;
+			dev->aggregates = NULL;
+			hid_report_decoder_free(dev->aggregate_decoder);
+			dev->aggregate_decoder = NULL;
+			res = -1;
+			goto out;
+		}
+	}
+	dev->aggregate_function = function;
+	dev->aggregate_window = milliseconds;
+
+out:
+	dispatch = take_dispatch(dev);
+	pthread_mutex_unlock(&dev->mutex);
+	if (dispatch)
+		dispatch_callbacks(dev);
+	return res;
 }
 
+hid_device_set * HID_API_EXPORT hid_device_set_create(void)
+{
+	hid_device_set *set = calloc(1, sizeof(hid_device_set));
+	if (!set)
+		return NULL;
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+	pthread_mutex_init(&set->mutex, NULL);
+	init_condition(&set->condition);
+	set->members = NULL;
+	set->ready_head = NULL;
+	set->ready_tail = NULL;
+
+	return set;
+}
+
+void HID_API_EXPORT hid_device_set_free(hid_device_set *set)
 {
-	int bytes_read = -1;
+	if (!set)
+		return;
 
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
+	/* Take the devices which are still in the set out of it. */
+	while (set->members)
+		hid_device_set_remove(set, set->members);
+
+	pthread_cond_destroy(&set->condition);
+	pthread_mutex_destroy(&set->mutex);
+	free(set);
+}
 
+int HID_API_EXPORT hid_device_set_set_engine(hid_device_set *set, int engine)
+{
+	/* Reports are already collected by the read threads. */
+	return (engine == HID_IO_ENGINE_DEFAULT)? 0: -1;
+}
+
+int HID_API_EXPORT hid_device_set_add(hid_device_set *set, hid_device *dev)
+{
 	pthread_mutex_lock(&dev->mutex);
+	if (dev->set) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+	dev->set = set;
+	note_demand(dev);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
+	pthread_mutex_lock(&set->mutex);
+	dev->next_member = set->members;
+	set->members = dev;
+	pthread_mutex_unlock(&set->mutex);
+
+	/* It may have reports queued already. */
+	mark_ready(set, dev);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_device_set_remove(hid_device_set *set, hid_device *dev)
+{
+	hid_device **p;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->set != set) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
 	}
-	
-	if (dev->shutdown_thread) {
-		/* This means the device has been disconnected.
-		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+	dev->set = NULL;
+	pthread_mutex_unlock(&dev->mutex);
+
+	pthread_mutex_lock(&set->mutex);
+	for (p = &set->members; *p != dev; p = &(*p)->next_member)
+		;
+	*p = dev->next_member;
+	if (dev->in_ready_list) {
+		hid_device *prev = NULL;
+		for (p = &set->ready_head; *p != dev; p = &(*p)->next_ready)
+			prev = *p;
+		*p = dev->next_ready;
+		if (set->ready_tail == dev)
+			set->ready_tail = prev;
+		dev->in_ready_list = 0;
 	}
-	
-	if (milliseconds == -1) {
-		/* Blocking */
-		pthread_cond_wait(&dev->condition, &dev->mutex);
-		bytes_read = return_data(dev, data, length);
+	pthread_mutex_unlock(&set->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_device_set_wait(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds)
+{
+	struct timespec ts;
+	int n = 0;
+
+	if (max_ready == 0)
+		return -1;
+
+	if (milliseconds > 0) {
+		/* set->condition waits on CLOCK_MONOTONIC. */
+		long long deadline = deadline_after(milliseconds);
+		ts.tv_sec = deadline / 1000000000LL;
+		ts.tv_nsec = deadline % 1000000000LL;
 	}
-	else if (milliseconds > 0) {
-		/* Non-blocking, but called with timeout. */
-		int res;
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += milliseconds / 1000;
-		ts.tv_nsec += (milliseconds % 1000) * 1000000;
-		if (ts.tv_nsec >= 1000000000L) {
-			ts.tv_sec++;
-			ts.tv_nsec -= 1000000000L;
+
+	pthread_mutex_lock(&set->mutex);
+
+	for (;;) {
+		hid_device **p = &set->ready_head;
+		hid_device *dev;
+
+		/* Drop the devices which have been read from since they were
+		   added. read_callback() sets readable before it adds a device,
+		   so a device which gets a report while this runs is either
+		   seen as readable here, or added again afterwards. */
+		while (*p && (size_t)n < max_ready) {
+			dev = *p;
+			if (__atomic_load_n(&dev->readable, __ATOMIC_ACQUIRE) ||
+			    __atomic_load_n(&dev->shutdown_thread, __ATOMIC_ACQUIRE)) {
+				ready[n++] = dev;
+				p = &dev->next_ready;
+			}
+			else {
+				*p = dev->next_ready;
+				dev->in_ready_list = 0;
+			}
 		}
-		
-		res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-		if (res == 0)
-			bytes_read = return_data(dev, data, length) ;
-		else
-			bytes_read = 0;
-	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+		set->ready_tail = NULL;
+		for (dev = set->ready_head; dev; dev = dev->next_ready)
+			set->ready_tail = dev;
+
+		if (n > 0 || milliseconds == 0)
+			break;
+		if (milliseconds < 0)
+			pthread_cond_wait(&set->condition, &set->mutex);
+		else if (pthread_cond_timedwait(&set->condition, &set->mutex, &ts) == ETIMEDOUT)
+			break;
 	}
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
+	pthread_mutex_unlock(&set->mutex);
 
-	return bytes_read;
+	return n;
 }
 
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
@@ -1051,15 +3764,43 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	hid_device **p;
+
 	if (!dev)
 		return;
+
+	if (dev->set)
+		hid_device_set_remove(dev->set, dev);
 	
-	/* Cause read_thread() to stop. */
+	/* Stop reading the device, and wait for the event thread to be
+	   done with the transfer, and with the watermark callback which its
+	   last report may have triggered. shutdown_thread is set with the
+	   mutex locked, so that readers don't resubmit the transfer
+	   afterwards. */
+	pthread_mutex_lock(&dev->mutex);
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	if (dev->transfer_submitted)
+		libusb_cancel_transfer(dev->transfer);
+	while (dev->transfer_submitted || dev->watermark_notifications > 0)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* Take it off its shard's list, so that the event thread leaves
+	   it alone. */
+	pthread_mutex_lock(&dev->shard->mutex);
+	for (p = &dev->shard->devices; *p != dev; p = &(*p)->next_in_shard)
+		;
+	*p = dev->next_in_shard;
+	dev->shard->load -= dev->bandwidth;
+	pthread_mutex_unlock(&dev->shard->mutex);
+
+	/* No more reports arrive now. Drop those which the input callback
+	   hasn't had, and wait for it to be done with the device. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->input_callback = NULL;
+	while (dev->callback_scheduled)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 	
 	/* Clean up the Transfer objects allocated in read_thread(). */
 	free(dev->transfer->buffer);
@@ -1071,16 +3812,197 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 	
-	/* Clear out the queue of received reports. */
+	/* Clear out the queues of received reports. */
 	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
+	clear_queues(dev);
 	pthread_mutex_unlock(&dev->mutex);
 	
 	free_hid_device(dev);
 }
 
+void HID_API_EXPORT hid_init_context_config(struct hid_context_config *config)
+{
+	config->queue_length = DEFAULT_QUEUE_LENGTH;
+	config->input_mode = HID_INPUT_MODE_FIFO;
+	config->event_thread_priority = 0;
+	config->event_threads = 1;
+	config->shard_assignment = HID_SHARD_ROUND_ROBIN;
+	config->pin_event_threads = 0;
+	config->callback_workers = 0;
+}
+
+static void free_callback_pool(struct callback_pool *pool, int num_running);
+
+/* Starts a pool of callback workers. Returns NULL on failure. */
+static struct callback_pool *create_callback_pool(int num_workers)
+{
+	struct callback_pool *pool;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->workers = calloc(num_workers, sizeof(struct callback_worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->condition, NULL);
+	pool->num_workers = num_workers;
+	pool->next_worker = 0;
+	pool->num_tasks = 0;
+	pool->shutdown = 0;
+
+	/* Workers steal from each other, so all the deques have to be set
+	   up before the first one starts. */
+	for (i = 0; i < num_workers; i++) {
+		struct callback_worker *w = &pool->workers[i];
+		w->pool = pool;
+		pthread_mutex_init(&w->mutex, NULL);
+		w->top = NULL;
+		w->bottom = NULL;
+	}
+	for (i = 0; i < num_workers; i++) {
+		int res = pthread_create(&pool->workers[i].thread, NULL, callback_thread, &pool->workers[i]);
+		if (res != 0) {
+			LOG("can't start a callback worker: %d\n", res);
+			free_callback_pool(pool, i);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/* Stops the first num_running workers of a pool, whose deques are empty
+   since all the devices were closed, and frees it. */
+static void free_callback_pool(struct callback_pool *pool, int num_running)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->condition);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < num_running; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	for (i = 0; i < pool->num_workers; i++)
+		pthread_mutex_destroy(&pool->workers[i].mutex);
+	pthread_cond_destroy(&pool->condition);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool);
+}
+
+/* Chooses the CPU of each event thread of a context, cycling through
+   the CPUs which the process may run on. */
+static void assign_cpus(hid_context *ctx)
+{
+	cpu_set_t allowed;
+	int cpu = -1;
+	int i;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0)
+		return;
+	for (i = 0; i < ctx->num_shards; i++) {
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(cpu, &allowed));
+		ctx->shards[i].cpu = cpu;
+	}
+}
+
+hid_context * HID_API_EXPORT hid_context_init(const struct hid_context_config *config)
+{
+	hid_context *ctx;
+	int i;
+
+	if (config && (config->queue_length < 0 || config->event_thread_priority < 0 ||
+	               config->event_threads < 0 || config->callback_workers < 0 ||
+	               (config->shard_assignment != HID_SHARD_ROUND_ROBIN &&
+	                config->shard_assignment != HID_SHARD_BANDWIDTH)))
+		return NULL;
+
+	ctx = calloc(1, sizeof(hid_context));
+	if (!ctx)
+		return NULL;
+	if (config)
+		ctx->config = *config;
+	else
+		hid_init_context_config(&ctx->config);
+	if (ctx->config.event_threads == 0)
+		ctx->config.event_threads = 1;
+
+	ctx->shards = calloc(ctx->config.event_threads, sizeof(struct event_shard));
+	if (!ctx->shards) {
+		free(ctx);
+		return NULL;
+	}
+	for (i = 0; i < ctx->config.event_threads; i++) {
+		struct event_shard *shard = &ctx->shards[i];
+		if (libusb_init(&shard->usb) < 0) {
+			while (i-- > 0) {
+				libusb_exit(ctx->shards[i].usb);
+				pthread_mutex_destroy(&ctx->shards[i].mutex);
+			}
+			free(ctx->shards);
+			free(ctx);
+			return NULL;
+		}
+		shard->context = ctx;
+		pthread_mutex_init(&shard->mutex, NULL);
+		shard->devices = NULL;
+		shard->load = 0;
+		shard->cpu = -1;
+		shard->thread_running = 0;
+		shard->shutdown_thread = 0;
+	}
+	ctx->num_shards = ctx->config.event_threads;
+	ctx->next_shard = 0;
+	if (ctx->config.pin_event_threads)
+		assign_cpus(ctx);
+
+	ctx->callbacks = NULL;
+	if (ctx->config.callback_workers > 0) {
+		ctx->callbacks = create_callback_pool(ctx->config.callback_workers);
+		if (!ctx->callbacks) {
+			hid_context_exit(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+void HID_API_EXPORT hid_context_exit(hid_context *ctx)
+{
+	int i;
+
+	if (!ctx)
+		return;
+
+	for (i = 0; i < ctx->num_shards; i++) {
+		struct event_shard *shard = &ctx->shards[i];
+
+		/* hid_close() takes the device off the list. */
+		while (shard->devices)
+			hid_close(shard->devices);
+
+		if (shard->thread_running) {
+			__atomic_store_n(&shard->shutdown_thread, 1, __ATOMIC_RELEASE);
+			pthread_join(shard->thread, NULL);
+		}
+		libusb_exit(shard->usb);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	if (ctx->callbacks)
+		free_callback_pool(ctx->callbacks, ctx->callbacks->num_workers);
+	free(ctx->shards);
+	free(ctx);
+}
+
 
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
@@ -1099,17 +4021,24 @@ int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *s
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
 {
-	wchar_t *str;
+	return get_usb_string_buf(dev->device_handle, string_index, string, maxlen);
+}
+
+const struct hid_report_descriptor HID_API_EXPORT * HID_API_CALL hid_get_report_descriptor(hid_device *dev)
+{
+	return dev->report_descriptor;
+}
 
-	str = get_usb_string(dev->device_handle, string_index);
-	if (str) {
-		wcsncpy(string, str, maxlen);
-		string[maxlen-1] = L'\0';
-		free(str);
-		return 0;
+HID_API_EXPORT hid_report_encoder * HID_API_CALL hid_get_report_encoder(hid_device *dev, int type)
+{
+	switch (type) {
+	case HID_REPORT_OUTPUT:
+		return dev->output_encoder;
+	case HID_REPORT_FEATURE:
+		return dev->feature_encoder;
+	default:
+		return NULL;
 	}
-	else
-		return -1;
 }
 
 
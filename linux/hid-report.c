@@ -0,0 +1,1186 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Alan Ott
+ Signal 11 Software
+
+ 8/22/2009
+ Report Descriptor Parser
+
+ Copyright 2009, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
+
+/* This file is shared by both Linux implementations (hid.c and
+   hid-libusb.c). It doesn't depend on either of them. */
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Limits which keep a malformed descriptor from using up memory. The
+   same limits are used by the Linux kernel's HID parser. */
+#define MAX_GLOBAL_STACK 4
+#define MAX_USAGES 12288
+#define MAX_REPORT_BITS (16384 * 8)
+
+/* The value of a Global item, and the number of bytes it was given in,
+   which is needed to know whether it is sign-extended. */
+struct item_value {
+	uint32_t raw;
+	int size;
+};
+
+struct global_state {
+	uint16_t usage_page;
+	struct item_value logical_minimum;
+	struct item_value logical_maximum;
+	struct item_value physical_minimum;
+	struct item_value physical_maximum;
+	int unit_exponent;
+	uint32_t unit;
+	uint32_t report_size;
+	uint32_t report_count;
+	uint8_t report_id;
+};
+
+/* A usage from a Local item. Usages given in four bytes are extended
+   usages, which carry their own Usage Page in the upper 16 bits. */
+struct local_usage {
+	uint32_t value;
+	int extended; /* boolean */
+};
+
+struct local_state {
+	struct local_usage *usages;
+	int num_usages;
+	int usages_cap;
+	struct local_usage usage_minimum;
+	int have_usage_minimum; /* boolean */
+	int delimiter_depth;
+	int delimiter_usages;
+};
+
+struct parser {
+	struct global_state global;
+	struct global_state global_stack[MAX_GLOBAL_STACK];
+	int global_stack_depth;
+	struct local_state local;
+	int collection_depth;
+	int have_top_usage; /* boolean */
+
+	/* Length in bits of each report, by report ID and type. */
+	uint32_t report_bits[256][HID_REPORT_TYPE_COUNT];
+
+	struct hid_report_descriptor *desc;
+	size_t fields_cap;
+};
+
+static int32_t sign_extend(uint32_t raw, int size)
+{
+	switch (size) {
+	case 1:
+		return (int8_t)raw;
+	case 2:
+		return (int16_t)raw;
+	default:
+		return (int32_t)raw;
+	}
+}
+
+/* Logical and Physical Minimum are always signed. The matching Maximum
+   is only signed when the Minimum is negative, since many devices give
+   e.g. a Logical Maximum of 255 in one byte. */
+static void resolve_range(const struct item_value *min, const struct item_value *max,
+                          int *minimum, int *maximum)
+{
+	*minimum = sign_extend(min->raw, min->size);
+	if (*minimum < 0)
+		*maximum = sign_extend(max->raw, max->size);
+	else
+		*maximum = (max->raw > INT32_MAX)? INT32_MAX: (int)max->raw;
+}
+
+static void resolve_usage(const struct local_usage *u, uint16_t usage_page,
+                          unsigned short *page, unsigned short *usage)
+{
+	*page = u->extended? (u->value >> 16): usage_page;
+	*usage = u->value & 0xffff;
+}
+
+static void reset_local(struct local_state *local)
+{
+	local->num_usages = 0;
+	local->have_usage_minimum = 0;
+	local->delimiter_depth = 0;
+	local->delimiter_usages = 0;
+}
+
+static int add_usage(struct local_state *local, uint32_t value, int extended)
+{
+	if (local->num_usages >= MAX_USAGES)
+		return -1;
+
+	if (local->num_usages == local->usages_cap) {
+		int cap = local->usages_cap? local->usages_cap * 2: 16;
+		struct local_usage *usages = realloc(local->usages, cap * sizeof(*usages));
+		if (!usages)
+			return -1;
+		local->usages = usages;
+		local->usages_cap = cap;
+	}
+
+	local->usages[local->num_usages].value = value;
+	local->usages[local->num_usages].extended = extended;
+	local->num_usages++;
+
+	return 0;
+}
+
+static struct hid_report_field *add_field(struct parser *p)
+{
+	struct hid_report_descriptor *desc = p->desc;
+	struct hid_report_field *field;
+
+	if (desc->num_fields == p->fields_cap) {
+		size_t cap = p->fields_cap? p->fields_cap * 2: 16;
+		struct hid_report_field *fields = realloc(desc->fields, cap * sizeof(*fields));
+		if (!fields)
+			return NULL;
+		desc->fields = fields;
+		p->fields_cap = cap;
+	}
+
+	field = &desc->fields[desc->num_fields++];
+	memset(field, 0, sizeof(*field));
+	field->report_id = p->global.report_id;
+	field->bit_size = p->global.report_size;
+	field->unit = p->global.unit;
+	field->unit_exponent = p->global.unit_exponent;
+	resolve_range(&p->global.logical_minimum, &p->global.logical_maximum,
+	              &field->logical_minimum, &field->logical_maximum);
+	resolve_range(&p->global.physical_minimum, &p->global.physical_maximum,
+	              &field->physical_minimum, &field->physical_maximum);
+
+	return field;
+}
+
+/* Handles an Input, Output or Feature item. The return value is 0 on
+   success and -1 on failure. */
+static int handle_main_data(struct parser *p, int type, uint32_t flags)
+{
+	struct global_state *g = &p->global;
+	struct local_state *l = &p->local;
+	uint32_t *bits = &p->report_bits[g->report_id][type];
+	uint32_t total;
+	uint32_t i;
+
+	if (g->report_size > 256 || g->report_count > MAX_USAGES)
+		return -1;
+	total = g->report_size * g->report_count;
+	if (*bits + total > MAX_REPORT_BITS)
+		return -1;
+
+	/* Constant items without usages are padding. */
+	if ((flags & 0x1) && l->num_usages == 0) {
+		*bits += total;
+		return 0;
+	}
+
+	if (flags & 0x2) {
+		/* Variable: one field per element. Elements past the end of
+		   the usage list take the last usage. */
+		for (i = 0; i < g->report_count; i++) {
+			struct hid_report_field *field = add_field(p);
+			if (!field)
+				return -1;
+			field->type = type;
+			field->flags = flags;
+			field->bit_offset = *bits + i * g->report_size;
+			field->report_count = 1;
+			if (l->num_usages > 0) {
+				int u = ((int)i < l->num_usages)? (int)i: l->num_usages - 1;
+				resolve_usage(&l->usages[u], g->usage_page,
+				              &field->usage_page, &field->usage);
+			}
+			else
+				field->usage_page = g->usage_page;
+			field->usage_minimum = field->usage;
+			field->usage_maximum = field->usage;
+		}
+	}
+	else if (g->report_count > 0) {
+		/* Array: one field whose elements select from the usages. */
+		struct hid_report_field *field = add_field(p);
+		if (!field)
+			return -1;
+		field->type = type;
+		field->flags = flags;
+		field->bit_offset = *bits;
+		field->report_count = g->report_count;
+		if (l->num_usages > 0) {
+			/* The usages needn't be contiguous or ascending, so
+			   the elements are looked up in a table. */
+			unsigned int *usages = malloc(l->num_usages * sizeof(*usages));
+			int u;
+			if (!usages)
+				return -1;
+			field->usage_minimum = 0xffff;
+			for (u = 0; u < l->num_usages; u++) {
+				unsigned short page, usage;
+				resolve_usage(&l->usages[u], g->usage_page, &page, &usage);
+				usages[u] = (unsigned int)page << 16 | usage;
+				if (usage < field->usage_minimum)
+					field->usage_minimum = usage;
+				if (usage > field->usage_maximum)
+					field->usage_maximum = usage;
+			}
+			field->usages = usages;
+			field->num_usages = l->num_usages;
+			field->usage_page = usages[0] >> 16;
+			field->usage = usages[0] & 0xffff;
+		}
+		else
+			field->usage_page = g->usage_page;
+	}
+
+	*bits += total;
+	return 0;
+}
+
+/* Handles one short item. The return value is 0 on success and -1 if
+   the descriptor is malformed. */
+static int handle_item(struct parser *p, int tag, uint32_t data, int size)
+{
+	struct global_state *g = &p->global;
+	struct local_state *l = &p->local;
+	int res = 0;
+
+	switch (tag) {
+	/* Main items. Each one ends the scope of the Local items. */
+	case 0x80: /* Input */
+		res = handle_main_data(p, HID_REPORT_INPUT, data);
+		reset_local(l);
+		break;
+	case 0x90: /* Output */
+		res = handle_main_data(p, HID_REPORT_OUTPUT, data);
+		reset_local(l);
+		break;
+	case 0xb0: /* Feature */
+		res = handle_main_data(p, HID_REPORT_FEATURE, data);
+		reset_local(l);
+		break;
+	case 0xa0: /* Collection */
+		if (p->collection_depth == 0 && !p->have_top_usage) {
+			if (l->num_usages > 0)
+				resolve_usage(&l->usages[0], g->usage_page,
+				              &p->desc->usage_page, &p->desc->usage);
+			else
+				p->desc->usage_page = g->usage_page;
+			p->have_top_usage = 1;
+		}
+		p->collection_depth++;
+		reset_local(l);
+		break;
+	case 0xc0: /* End Collection */
+		if (p->collection_depth > 0)
+			p->collection_depth--;
+		reset_local(l);
+		break;
+
+	/* Global items */
+	case 0x04: /* Usage Page */
+		g->usage_page = data;
+		break;
+	case 0x14: /* Logical Minimum */
+		g->logical_minimum.raw = data;
+		g->logical_minimum.size = size;
+		break;
+	case 0x24: /* Logical Maximum */
+		g->logical_maximum.raw = data;
+		g->logical_maximum.size = size;
+		break;
+	case 0x34: /* Physical Minimum */
+		g->physical_minimum.raw = data;
+		g->physical_minimum.size = size;
+		break;
+	case 0x44: /* Physical Maximum */
+		g->physical_maximum.raw = data;
+		g->physical_maximum.size = size;
+		break;
+	case 0x54: /* Unit Exponent */
+		/* The specification gives this as a 4-bit signed nibble, but
+		   some devices give a whole signed value instead. */
+		g->unit_exponent = (data & ~0xfu)? sign_extend(data, size):
+		                   ((data & 0x8)? (int)data - 16: (int)data);
+		break;
+	case 0x64: /* Unit */
+		g->unit = data;
+		break;
+	case 0x74: /* Report Size */
+		g->report_size = data;
+		break;
+	case 0x84: /* Report ID */
+		/* ID 0 is reserved, but some devices declare it anyway, and
+		   send their reports prefixed with a 0. Those reports are
+		   kept under ID 0. An ID which doesn't fit in the prefix is
+		   ignored. Either way, the reports are numbered. */
+		if (data <= 255)
+			g->report_id = data;
+		p->desc->uses_numbered_reports = 1;
+		break;
+	case 0x94: /* Report Count */
+		g->report_count = data;
+		break;
+	case 0xa4: /* Push */
+		if (p->global_stack_depth == MAX_GLOBAL_STACK)
+			return -1;
+		p->global_stack[p->global_stack_depth++] = *g;
+		break;
+	case 0xb4: /* Pop */
+		if (p->global_stack_depth == 0)
+			return -1;
+		*g = p->global_stack[--p->global_stack_depth];
+		break;
+
+	/* Local items */
+	case 0x08: /* Usage */
+		/* Only the first usage of each delimited set is used. */
+		if (l->delimiter_depth > 0 && l->delimiter_usages++ > 0)
+			break;
+		res = add_usage(l, data, size == 4);
+		break;
+	case 0x18: /* Usage Minimum */
+		l->usage_minimum.value = data;
+		l->usage_minimum.extended = (size == 4);
+		l->have_usage_minimum = 1;
+		break;
+	case 0x28: /* Usage Maximum */
+		if (l->have_usage_minimum) {
+			uint32_t u;
+			uint32_t min = l->usage_minimum.value & 0xffff;
+			uint32_t max = data & 0xffff;
+			uint32_t page = l->usage_minimum.value & 0xffff0000;
+			for (u = min; u <= max && res == 0; u++)
+				res = add_usage(l, page | u, l->usage_minimum.extended);
+			l->have_usage_minimum = 0;
+		}
+		break;
+	case 0xa8: /* Delimiter */
+		if (data) {
+			l->delimiter_depth++;
+			l->delimiter_usages = 0;
+		}
+		else if (l->delimiter_depth > 0)
+			l->delimiter_depth--;
+		break;
+
+	default:
+		/* Designators, strings and reserved items are ignored. */
+		break;
+	}
+
+	return res;
+}
+
+static int compare_fields(const void *a, const void *b)
+{
+	const struct hid_report_field *fa = a, *fb = b;
+	if (fa->report_id != fb->report_id)
+		return fa->report_id - fb->report_id;
+	if (fa->type != fb->type)
+		return fa->type - fb->type;
+	return (fa->bit_offset > fb->bit_offset) - (fa->bit_offset < fb->bit_offset);
+}
+
+/* Fills in desc->reports from the report lengths gathered by the parser.
+   The return value is 0 on success and -1 on failure. */
+static int build_reports(struct parser *p)
+{
+	struct hid_report_descriptor *desc = p->desc;
+	int id, type;
+
+	desc->reports = calloc(256, sizeof(struct hid_report_info));
+	if (!desc->reports)
+		return -1;
+
+	for (id = 0; id < 256; id++) {
+		struct hid_report_info *info = &desc->reports[desc->num_reports];
+		int used = 0;
+		for (type = 0; type < HID_REPORT_TYPE_COUNT; type++) {
+			info->length[type] = (p->report_bits[id][type] + 7) / 8;
+			if (info->length[type])
+				used = 1;
+		}
+		if (used) {
+			info->report_id = id;
+			desc->num_reports++;
+		}
+	}
+
+	return 0;
+}
+
+struct hid_report_descriptor HID_API_EXPORT * HID_API_CALL hid_parse_report_descriptor(const unsigned char *data, size_t length)
+{
+	struct parser *p;
+	struct hid_report_descriptor *desc;
+	size_t i = 0;
+
+	p = calloc(1, sizeof(struct parser));
+	desc = calloc(1, sizeof(struct hid_report_descriptor));
+	if (!p || !desc)
+		goto err;
+	p->desc = desc;
+
+	while (i < length) {
+		int key = data[i];
+		int data_len;
+		uint32_t value = 0;
+		int j;
+
+		if (key == 0xfe) {
+			/* This is a Long Item. The next byte contains the
+			   length of the data section. No long item tags are
+			   defined, so they are skipped. See the HID
+			   specification, version 1.11, section 6.2.2.3. */
+			if (i + 1 >= length)
+				break;
+			i += 3 + data[i+1];
+			continue;
+		}
+
+		/* This is a Short Item. The bottom two bits of the key
+		   contain the size code for the data section. See the HID
+		   specification, version 1.11, section 6.2.2.2. */
+		data_len = (key & 0x3) == 3? 4: (key & 0x3);
+		if (i + 1 + data_len > length)
+			break; /* truncated */
+
+		for (j = 0; j < data_len; j++)
+			value |= (uint32_t)data[i+1+j] << (8 * j);
+
+		if (handle_item(p, key & 0xfc, value, data_len) < 0)
+			goto err;
+
+		i += 1 + data_len;
+	}
+
+	if (desc->num_fields > 1)
+		qsort(desc->fields, desc->num_fields, sizeof(struct hid_report_field), compare_fields);
+
+	if (build_reports(p) < 0)
+		goto err;
+
+	free(p->local.usages);
+	free(p);
+	return desc;
+
+err:
+	if (p)
+		free(p->local.usages);
+	free(p);
+	hid_free_report_descriptor(desc);
+	return NULL;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_free_report_descriptor(struct hid_report_descriptor *descriptor)
+{
+	size_t i;
+
+	if (!descriptor)
+		return;
+	for (i = 0; i < descriptor->num_fields; i++)
+		free((unsigned int *)descriptor->fields[i].usages);
+	free(descriptor->fields);
+	free(descriptor->reports);
+	free(descriptor);
+}
+
+/* One value to extract from a report. The value is found by loading the
+   eight bytes at byte_offset as a little-endian word, shifting it right
+   by shift and masking it, which works for any field of up to 32 bits. */
+struct extract_op {
+	uint32_t byte_offset;
+	uint32_t end_byte; /* first byte past the value */
+	uint8_t shift;
+	uint8_t bit_size;
+	uint8_t sign_shift; /* 64 - bit_size for signed values, else 0 */
+	uint8_t is_array; /* boolean */
+	uint64_t mask;
+	/* physical_value = value * scale + offset */
+	double scale;
+	double offset;
+	/* For Array elements, the value selects usages[value - minimum] if
+	   it lies between minimum and maximum and within the table. */
+	int64_t minimum;
+	int64_t maximum;
+	unsigned short usage_page;
+	unsigned short usage;
+	const unsigned int *usages;
+	unsigned int num_usages;
+	const struct hid_report_field *field;
+	unsigned int index;
+};
+
+struct report_plan {
+	struct extract_op *ops;
+	int num_ops;
+	int known; /* boolean: the descriptor has this report */
+	uint32_t length; /* length of the report, not counting the report ID */
+	uint32_t load_length; /* bytes every op can load 8 bytes from */
+};
+
+/* Extracts one value from each of count reports, stride bytes apart
+   starting at reports, into out. Every report must have 8 readable bytes
+   at op->byte_offset. */
+typedef void (*column_kernel_fn)(const struct extract_op *op, const unsigned char *reports,
+                                 size_t stride, size_t count, int *out);
+
+/* Reports shorter than a plan's load_length are copied into a zero-padded
+   buffer of this size, so that every op can still load 8 bytes. */
+#define PADDED_REPORT_SIZE 64
+
+struct hid_report_decoder_ {
+	int uses_numbered_reports;
+	int max_values;
+	struct report_plan plans[256];
+	column_kernel_fn column_kernel;
+};
+
+/* Extracts the value of op from a report of which avail bytes, starting
+   at data, can be read. */
+static int64_t extract_value(const struct extract_op *op, const unsigned char *data, size_t avail)
+{
+	uint64_t raw = 0;
+
+	/* An unaligned 64-bit load, unless it would run past the end of
+	   the report. */
+	if (op->byte_offset + 8 <= avail)
+		memcpy(&raw, data + op->byte_offset, 8);
+	else
+		memcpy(&raw, data + op->byte_offset, avail - op->byte_offset);
+	raw = (le64toh(raw) >> op->shift) & op->mask;
+	if (op->sign_shift)
+		return (int64_t)(raw << op->sign_shift) >> op->sign_shift;
+	return (int64_t)raw;
+}
+
+static void decode_column_scalar(const struct extract_op *op, const unsigned char *reports,
+                                 size_t stride, size_t count, int *out)
+{
+	const unsigned char *p = reports + op->byte_offset;
+	size_t r;
+
+	for (r = 0; r < count; r++, p += stride) {
+		uint64_t raw;
+		memcpy(&raw, p, 8);
+		raw = (le64toh(raw) >> op->shift) & op->mask;
+		if (op->sign_shift)
+			out[r] = (int64_t)(raw << op->sign_shift) >> op->sign_shift;
+		else
+			out[r] = raw;
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+/* The SIMD kernels shift, mask and sign-extend in 32-bit lanes, so they
+   only handle values which lie within 4 bytes of op->byte_offset, and
+   leave the rest to decode_column_scalar(). Sign extension and masking
+   are both done by shifting the value to the top of the lane and back. */
+
+__attribute__((target("sse2")))
+static void decode_column_sse2(const struct extract_op *op, const unsigned char *reports,
+                               size_t stride, size_t count, int *out)
+{
+	const unsigned char *p = reports + op->byte_offset;
+	size_t r = 0;
+
+	if (op->shift + op->bit_size <= 32) {
+		__m128i down = _mm_cvtsi32_si128(op->shift);
+		__m128i top = _mm_cvtsi32_si128(32 - op->bit_size);
+		int is_signed = (op->sign_shift != 0);
+
+		for (; r + 4 <= count; r += 4, p += 4 * stride) {
+			uint32_t w[4];
+			__m128i v;
+			memcpy(&w[0], p, 4);
+			memcpy(&w[1], p + stride, 4);
+			memcpy(&w[2], p + 2 * stride, 4);
+			memcpy(&w[3], p + 3 * stride, 4);
+			v = _mm_setr_epi32(le32toh(w[0]), le32toh(w[1]), le32toh(w[2]), le32toh(w[3]));
+			v = _mm_sll_epi32(_mm_srl_epi32(v, down), top);
+			v = is_signed? _mm_sra_epi32(v, top): _mm_srl_epi32(v, top);
+			_mm_storeu_si128((__m128i *)(out + r), v);
+		}
+	}
+
+	decode_column_scalar(op, reports + r * stride, stride, count - r, out + r);
+}
+
+__attribute__((target("avx2")))
+static void decode_column_avx2(const struct extract_op *op, const unsigned char *reports,
+                               size_t stride, size_t count, int *out)
+{
+	const unsigned char *p = reports + op->byte_offset;
+	size_t r = 0;
+
+	/* The gather offsets are 32-bit. */
+	if (op->shift + op->bit_size <= 32 && stride <= INT32_MAX / 8) {
+		__m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+		                                     _mm256_set1_epi32((int)stride));
+		__m128i down = _mm_cvtsi32_si128(op->shift);
+		__m128i top = _mm_cvtsi32_si128(32 - op->bit_size);
+		int is_signed = (op->sign_shift != 0);
+
+		for (; r + 8 <= count; r += 8, p += 8 * stride) {
+			__m256i v = _mm256_i32gather_epi32((const int *)p, offsets, 1);
+			v = _mm256_sll_epi32(_mm256_srl_epi32(v, down), top);
+			v = is_signed? _mm256_sra_epi32(v, top): _mm256_srl_epi32(v, top);
+			_mm256_storeu_si256((__m256i *)(out + r), v);
+		}
+	}
+
+	decode_column_scalar(op, reports + r * stride, stride, count - r, out + r);
+}
+#endif /* HAVE_X86_KERNELS */
+
+static double pow10_int(int exponent)
+{
+	double res = 1.0;
+	while (exponent > 0) {
+		res *= 10.0;
+		exponent--;
+	}
+	while (exponent < 0) {
+		res /= 10.0;
+		exponent++;
+	}
+	return res;
+}
+
+static void compile_op(struct extract_op *op, const struct hid_report_field *field, unsigned int index)
+{
+	uint32_t bit = field->bit_offset + index * field->bit_size;
+
+	memset(op, 0, sizeof(*op));
+	op->field = field;
+	op->index = index;
+	op->byte_offset = bit / 8;
+	op->end_byte = (bit + field->bit_size + 7) / 8;
+	op->shift = bit % 8;
+	op->bit_size = field->bit_size;
+	op->mask = ((uint64_t)1 << field->bit_size) - 1;
+	if (field->logical_minimum < 0)
+		op->sign_shift = 64 - field->bit_size;
+	op->usage_page = field->usage_page;
+	op->usage = field->usage;
+	op->scale = 1.0;
+
+	if (!(field->flags & 0x2)) {
+		op->is_array = 1;
+		op->usages = field->usages;
+		op->num_usages = field->num_usages;
+		op->minimum = field->logical_minimum;
+		op->maximum = field->logical_maximum;
+	}
+	else if ((field->physical_minimum || field->physical_maximum) &&
+	         field->logical_maximum != field->logical_minimum) {
+		double exp = pow10_int(field->unit_exponent);
+		double resolution = (double)(field->physical_maximum - field->physical_minimum) /
+		                    ((double)field->logical_maximum - field->logical_minimum);
+		op->scale = resolution * exp;
+		op->offset = (field->physical_minimum - field->logical_minimum * resolution) * exp;
+	}
+}
+
+HID_API_EXPORT hid_report_decoder * HID_API_CALL hid_report_decoder_create(const struct hid_report_descriptor *descriptor, int type)
+{
+	hid_report_decoder *dec;
+	int counts[256];
+	size_t i;
+	unsigned int e;
+
+	if (!descriptor || type < 0 || type >= HID_REPORT_TYPE_COUNT)
+		return NULL;
+
+	dec = calloc(1, sizeof(hid_report_decoder));
+	if (!dec)
+		return NULL;
+	dec->uses_numbered_reports = descriptor->uses_numbered_reports;
+
+	for (i = 0; i < descriptor->num_reports; i++) {
+		struct report_plan *plan = &dec->plans[descriptor->reports[i].report_id];
+		plan->length = descriptor->reports[i].length[type];
+		if (plan->length)
+			plan->known = 1;
+	}
+
+	/* Pick the fastest column kernel this CPU supports. */
+	hid_report_decoder_set_kernel(dec, HID_DECODE_KERNEL_AVX2);
+	if (!dec->column_kernel)
+		hid_report_decoder_set_kernel(dec, HID_DECODE_KERNEL_SSE2);
+	if (!dec->column_kernel)
+		hid_report_decoder_set_kernel(dec, HID_DECODE_KERNEL_SCALAR);
+
+	/* Fields wider than an int can't be decoded into one. */
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < descriptor->num_fields; i++) {
+		const struct hid_report_field *field = &descriptor->fields[i];
+		if (field->type == type && field->bit_size > 0 && field->bit_size <= 32)
+			counts[field->report_id] += field->report_count;
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (counts[i] == 0)
+			continue;
+		dec->plans[i].ops = calloc(counts[i], sizeof(struct extract_op));
+		if (!dec->plans[i].ops) {
+			hid_report_decoder_free(dec);
+			return NULL;
+		}
+		if (counts[i] > dec->max_values)
+			dec->max_values = counts[i];
+	}
+
+	/* The fields are in order of bit offset, so the ops are too. */
+	for (i = 0; i < descriptor->num_fields; i++) {
+		const struct hid_report_field *field = &descriptor->fields[i];
+		struct report_plan *plan = &dec->plans[field->report_id];
+		if (field->type != type || field->bit_size == 0 || field->bit_size > 32)
+			continue;
+		for (e = 0; e < field->report_count; e++) {
+			struct extract_op *op = &plan->ops[plan->num_ops++];
+			compile_op(op, field, e);
+			if (op->byte_offset + 8 > plan->load_length)
+				plan->load_length = op->byte_offset + 8;
+		}
+	}
+
+	return dec;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_report_decoder_free(hid_report_decoder *decoder)
+{
+	int i;
+
+	if (!decoder)
+		return;
+	for (i = 0; i < 256; i++)
+		free(decoder->plans[i].ops);
+	free(decoder);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_report_decoder_max_values(hid_report_decoder *decoder)
+{
+	return decoder->max_values;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_report_decoder *decoder, const unsigned char *data, size_t length, struct hid_field_value *values, size_t max_values)
+{
+	const struct report_plan *plan;
+	unsigned char padded[PADDED_REPORT_SIZE];
+	size_t avail; /* bytes which can be loaded from data */
+	size_t n = 0;
+	int i;
+
+	/* Skip the report ID. */
+	if (decoder->uses_numbered_reports) {
+		if (length < 1)
+			return -1;
+		plan = &decoder->plans[data[0]];
+		data++;
+		length--;
+	}
+	else
+		plan = &decoder->plans[0];
+
+	if (!plan->known)
+		return -1;
+
+	/* Most reports are short enough that copying them is cheaper than
+	   checking each load against the end of the report. */
+	avail = length;
+	if (length < plan->load_length && plan->load_length <= sizeof(padded)) {
+		memcpy(padded, data, length);
+		memset(padded + length, 0, plan->load_length - length);
+		data = padded;
+		avail = plan->load_length;
+	}
+
+	for (i = 0; i < plan->num_ops && n < max_values; i++) {
+		const struct extract_op *op = &plan->ops[i];
+		struct hid_field_value *v;
+		int64_t x;
+
+		if (op->end_byte > length)
+			continue;
+		x = extract_value(op, data, avail);
+
+		v = &values[n++];
+		v->field = op->field;
+		v->index = op->index;
+		v->value = (int)x;
+		if (op->is_array) {
+			int64_t u = x - op->minimum;
+			if (x >= op->minimum && x <= op->maximum && u < op->num_usages) {
+				v->usage_page = op->usages[u] >> 16;
+				v->usage = op->usages[u] & 0xffff;
+			}
+			else {
+				v->usage_page = 0;
+				v->usage = 0;
+			}
+			v->physical_value = (double)x;
+		}
+		else {
+			v->usage_page = op->usage_page;
+			v->usage = op->usage;
+			v->physical_value = x * op->scale + op->offset;
+		}
+	}
+
+	return n;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_report_decoder_set_kernel(hid_report_decoder *decoder, int kernel)
+{
+	switch (kernel) {
+	case HID_DECODE_KERNEL_SCALAR:
+		decoder->column_kernel = decode_column_scalar;
+		return 0;
+#ifdef HAVE_X86_KERNELS
+	case HID_DECODE_KERNEL_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		decoder->column_kernel = decode_column_sse2;
+		return 0;
+	case HID_DECODE_KERNEL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		decoder->column_kernel = decode_column_avx2;
+		return 0;
+#endif
+	default:
+		return -1;
+	}
+}
+
+/* Number of reports hid_decode_reports_columnar() decodes at once, so that
+   they stay in the cache while each of their columns is extracted. */
+#define COLUMN_BLOCK 256
+
+int HID_API_EXPORT HID_API_CALL hid_decode_reports_columnar(hid_report_decoder *decoder, const unsigned char *reports, size_t stride, size_t num_reports, int **columns, size_t num_columns)
+{
+	const struct report_plan *plan;
+	const unsigned char *payload;
+	size_t report_length, buffer_length;
+	size_t block, c;
+
+	if (num_reports == 0)
+		return 0;
+
+	/* Every report has the ID of the first. */
+	if (decoder->uses_numbered_reports) {
+		plan = &decoder->plans[reports[0]];
+		payload = reports + 1;
+		report_length = plan->length + 1;
+	}
+	else {
+		plan = &decoder->plans[0];
+		payload = reports;
+		report_length = plan->length;
+	}
+
+	if (!plan->known || stride < report_length)
+		return -1;
+
+	/* Bytes which can be read, starting at payload. */
+	buffer_length = (num_reports - 1) * stride + report_length - (payload - reports);
+
+	for (block = 0; block < num_reports; block += COLUMN_BLOCK) {
+		size_t count = num_reports - block;
+		if (count > COLUMN_BLOCK)
+			count = COLUMN_BLOCK;
+
+		for (c = 0; c < num_columns && c < (size_t)plan->num_ops; c++) {
+			const struct extract_op *op = &plan->ops[c];
+			size_t fast = 0, r;
+
+			if (!columns[c])
+				continue;
+
+			/* Reports which have 8 bytes to load from at
+			   op->byte_offset go to the kernel. Only the last few
+			   reports of the buffer can fall short of that. */
+			if (buffer_length >= op->byte_offset + 8)
+				fast = (buffer_length - op->byte_offset - 8) / stride + 1;
+			fast = (fast > block)? fast - block: 0;
+			if (fast > count)
+				fast = count;
+
+			decoder->column_kernel(op, payload + block * stride, stride, fast,
+			                       columns[c] + block);
+			for (r = fast; r < count; r++) {
+				const unsigned char *data = payload + (block + r) * stride;
+				columns[c][block + r] = extract_value(op, data, buffer_length - (block + r) * stride);
+			}
+		}
+	}
+
+	return num_reports;
+}
+
+/* Where to store one value in a report: the value is masked, shifted left
+   by shift and merged into the num_bytes bytes at byte_offset. */
+struct insert_op {
+	uint32_t byte_offset;
+	uint32_t num_bytes;
+	uint8_t shift;
+	uint64_t mask;
+};
+
+/* A Variable field, found by key (Usage Page << 16 | Usage). */
+struct usage_entry {
+	uint32_t key;
+	struct insert_op op;
+};
+
+/* An Array field, whose elements select one of usages, which are keys
+   like those of usage_entry. */
+struct array_entry {
+	const unsigned int *usages;
+	unsigned int num_usages;
+	int logical_minimum;
+	uint32_t bit_offset;
+	uint32_t bit_size;
+	uint32_t report_count;
+};
+
+struct encode_plan {
+	/* Sorted by key, and then by bit offset. */
+	struct usage_entry *usages;
+	int num_usages;
+	struct array_entry *arrays;
+	int num_arrays;
+	int known; /* boolean: the descriptor has this report */
+	uint32_t length; /* length of the report, not counting the report ID */
+};
+
+struct hid_report_encoder_ {
+	struct encode_plan plans[256];
+};
+
+static void compile_insert_op(struct insert_op *op, uint32_t bit, uint32_t bit_size)
+{
+	op->byte_offset = bit / 8;
+	op->num_bytes = (bit % 8 + bit_size + 7) / 8;
+	op->shift = bit % 8;
+	op->mask = ((uint64_t)1 << bit_size) - 1;
+}
+
+static void insert_value(const struct insert_op *op, unsigned char *data, uint64_t value)
+{
+	uint64_t word = 0;
+
+	memcpy(&word, data + op->byte_offset, op->num_bytes);
+	word = le64toh(word);
+	word &= ~(op->mask << op->shift);
+	word |= (value & op->mask) << op->shift;
+	word = htole64(word);
+	memcpy(data + op->byte_offset, &word, op->num_bytes);
+}
+
+static int compare_usage_entries(const void *a, const void *b)
+{
+	const struct usage_entry *ea = a, *eb = b;
+	if (ea->key != eb->key)
+		return (ea->key > eb->key) - (ea->key < eb->key);
+	if (ea->op.byte_offset != eb->op.byte_offset)
+		return (ea->op.byte_offset > eb->op.byte_offset) - (ea->op.byte_offset < eb->op.byte_offset);
+	return ea->op.shift - eb->op.shift;
+}
+
+HID_API_EXPORT hid_report_encoder * HID_API_CALL hid_report_encoder_create(const struct hid_report_descriptor *descriptor, int type)
+{
+	hid_report_encoder *enc;
+	int num_usages[256], num_arrays[256];
+	size_t i;
+	int id;
+
+	if (!descriptor || type < 0 || type >= HID_REPORT_TYPE_COUNT)
+		return NULL;
+
+	enc = calloc(1, sizeof(hid_report_encoder));
+	if (!enc)
+		return NULL;
+
+	for (i = 0; i < descriptor->num_reports; i++) {
+		struct encode_plan *plan = &enc->plans[descriptor->reports[i].report_id];
+		plan->length = descriptor->reports[i].length[type];
+		if (plan->length)
+			plan->known = 1;
+	}
+
+	/* Fields wider than an int can't be encoded from one. */
+	memset(num_usages, 0, sizeof(num_usages));
+	memset(num_arrays, 0, sizeof(num_arrays));
+	for (i = 0; i < descriptor->num_fields; i++) {
+		const struct hid_report_field *field = &descriptor->fields[i];
+		if (field->type != type || field->bit_size == 0 || field->bit_size > 32)
+			continue;
+		if (field->flags & 0x2)
+			num_usages[field->report_id]++;
+		else
+			num_arrays[field->report_id]++;
+	}
+
+	for (id = 0; id < 256; id++) {
+		struct encode_plan *plan = &enc->plans[id];
+		if (num_usages[id])
+			plan->usages = calloc(num_usages[id], sizeof(struct usage_entry));
+		if (num_arrays[id])
+			plan->arrays = calloc(num_arrays[id], sizeof(struct array_entry));
+		if ((num_usages[id] && !plan->usages) || (num_arrays[id] && !plan->arrays)) {
+			hid_report_encoder_free(enc);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < descriptor->num_fields; i++) {
+		const struct hid_report_field *field = &descriptor->fields[i];
+		struct encode_plan *plan = &enc->plans[field->report_id];
+		if (field->type != type || field->bit_size == 0 || field->bit_size > 32)
+			continue;
+		if (field->flags & 0x2) {
+			struct usage_entry *entry = &plan->usages[plan->num_usages++];
+			entry->key = (uint32_t)field->usage_page << 16 | field->usage;
+			compile_insert_op(&entry->op, field->bit_offset, field->bit_size);
+		}
+		else {
+			struct array_entry *entry = &plan->arrays[plan->num_arrays++];
+			entry->usages = field->usages;
+			entry->num_usages = field->num_usages;
+			entry->logical_minimum = field->logical_minimum;
+			entry->bit_offset = field->bit_offset;
+			entry->bit_size = field->bit_size;
+			entry->report_count = field->report_count;
+		}
+	}
+
+	for (id = 0; id < 256; id++) {
+		struct encode_plan *plan = &enc->plans[id];
+		if (plan->num_usages > 1)
+			qsort(plan->usages, plan->num_usages, sizeof(struct usage_entry), compare_usage_entries);
+	}
+
+	return enc;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_report_encoder_free(hid_report_encoder *encoder)
+{
+	int i;
+
+	if (!encoder)
+		return;
+	for (i = 0; i < 256; i++) {
+		free(encoder->plans[i].usages);
+		free(encoder->plans[i].arrays);
+	}
+	free(encoder);
+}
+
+/* Returns the index-th Variable field of plan with the given key, or NULL
+   if there isn't one. */
+static const struct usage_entry *find_usage(const struct encode_plan *plan, uint32_t key, unsigned int index)
+{
+	int lo = 0, hi = plan->num_usages;
+
+	/* Find the first entry with the key. */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (plan->usages[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (index >= (unsigned int)(plan->num_usages - lo) ||
+	    plan->usages[lo + index].key != key)
+		return NULL;
+	return &plan->usages[lo + index];
+}
+
+int HID_API_EXPORT HID_API_CALL hid_encode_report(hid_report_encoder *encoder, unsigned char report_id, const struct hid_usage_value *values, size_t num_values, unsigned char *data, size_t length)
+{
+	const struct encode_plan *plan = &encoder->plans[report_id];
+	unsigned char *payload = data + 1;
+	size_t i;
+
+	if (!plan->known || length < plan->length + 1)
+		return -1;
+
+	data[0] = report_id;
+	memset(payload, 0, plan->length);
+
+	for (i = 0; i < num_values; i++) {
+		const struct hid_usage_value *v = &values[i];
+		uint32_t key = (uint32_t)v->usage_page << 16 | v->usage;
+		const struct usage_entry *entry;
+		int a;
+
+		entry = find_usage(plan, key, v->index);
+		if (entry) {
+			insert_value(&entry->op, payload, (uint32_t)v->value);
+			continue;
+		}
+
+		/* Select the usage in an element of an Array field. */
+		for (a = 0; a < plan->num_arrays; a++) {
+			const struct array_entry *array = &plan->arrays[a];
+			struct insert_op op;
+			unsigned int u;
+			for (u = 0; u < array->num_usages && array->usages[u] != key; u++)
+				;
+			if (u == array->num_usages)
+				continue;
+			if (v->index >= array->report_count)
+				return -1;
+			compile_insert_op(&op, array->bit_offset + v->index * array->bit_size, array->bit_size);
+			insert_value(&op, payload, (uint32_t)(array->logical_minimum + u));
+			break;
+		}
+		if (a == plan->num_arrays)
+			return -1;
+	}
+
+	return plan->length + 1;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -21,10 +21,14 @@
         http://github.com/signal11/hidapi .
 ********************************************************/
 
+/* For ppoll() */
+#define _GNU_SOURCE
+
 /* C */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <locale.h>
 #include <errno.h>
 
@@ -36,12 +40,32 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 /* Linux */
 #include <linux/hidraw.h>
 #include <linux/version.h>
 #include <libudev.h>
 
+/* The io_uring engine of device sets is built if the headers are new
+   enough. Whether the running kernel supports it is checked when it is
+   selected. */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
 #include "hidapi.h"
 
 /* Definitions from linux/hidraw.h. Since these are new, some distros
@@ -53,10 +77,119 @@
 #define HIDIOCGFEATURE(len)    _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x07, len)
 #endif
 
+/* A fixed-size ring of input reports, kept in user space. When it is
+   full, the oldest report is dropped, as the kernel does. */
+struct report_ring {
+	unsigned char *data; /* num_slots slots of slot_size bytes */
+	size_t *lens;
+	size_t slot_size;
+	unsigned int num_slots;
+	unsigned int head; /* slot of the oldest report */
+	unsigned int count;
+	unsigned long received; /* reports pushed */
+	unsigned long dropped; /* reports dropped to make room */
+};
+
+/* Number of reports the read thread queues unless
+   hid_start_read_thread() says otherwise. */
+#define DEFAULT_READ_QUEUE_LENGTH 1024
+
+/* Number of reports the ring of a device in an io_uring set holds. */
+#define URING_RING_SLOTS 64
+
+/* Number of submission queue entries of an io_uring set. */
+#define URING_ENTRIES 256
+
+#ifdef HAVE_IO_URING
+/* The rings shared with the kernel, mapped into user space. */
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_map_size;
+	size_t cq_map_size;
+	size_t sqes_size;
+};
+#endif
+
 struct hid_device_ {
 	int device_handle;
 	int blocking;
 	int uses_numbered_reports;
+	struct hid_report_descriptor *report_descriptor;
+	hid_report_encoder *output_encoder;
+	hid_report_encoder *feature_encoder;
+	hid_device_set *set; /* The set the device is in, or NULL */
+	hid_device *next_member;
+
+	/* Used while the device is in an io_uring set: the reports which
+	   have been read, the buffer the posted read fills, and whether a
+	   read is posted or has failed. */
+	struct report_ring *ring;
+	unsigned char *read_buf;
+	int read_pending;
+	int read_error;
+
+	/* The read thread started by hid_start_read_thread(), and the queue
+	   it fills, protected by mutex. The thread stops when stop_fd is
+	   written to. notify_fd is readable while the queue holds reports,
+	   and is what device sets wait on. */
+	int thread_running;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	struct report_ring *queue;
+	int stop_fd;
+	int notify_fd;
+
+	/* Reports returned by hid_read() without a queue, for
+	   hid_get_input_stats(). */
+	unsigned long reports_read;
+
+	/* How readers wait for reports; see hid_set_wait_strategy(). */
+	int wait_strategy;
+	int spin_us;
+
+	/* The context the device was opened through, or NULL, and the next
+	   device of the context, protected by the context's mutex. */
+	hid_context *context;
+	hid_device *next_in_context;
+};
+
+/* The kernel reads the devices, so a context only holds the
+   configuration which the devices opened through it start out with, and
+   the list of them, for hid_context_exit(). */
+struct hid_context_ {
+	struct hid_context_config config;
+	pthread_mutex_t mutex; /* Protects devices */
+	hid_device *devices;
+};
+
+/* With HID_IO_ENGINE_DEFAULT, the devices of a set are watched by one
+   epoll instance. Their fds are registered with the device as data, so
+   epoll_wait() returns the ready devices directly.
+
+   With HID_IO_ENGINE_IO_URING, a read is kept posted on the fd of each
+   device, and the completions are reaped in batches into the rings of
+   the devices. hid_read() and hid_write() on the devices go through the
+   io_uring too. */
+struct hid_device_set_ {
+	int epoll_fd;
+	hid_device *members;
+	int engine;
+#ifdef HAVE_IO_URING
+	struct uring uring;
+#endif
 };
 
 
@@ -64,10 +197,36 @@ static __u32 kernel_version = 0;
 
 hid_device *new_hid_device()
 {
+	pthread_condattr_t attr;
 	hid_device *dev = calloc(1, sizeof(hid_device));
 	dev->device_handle = -1;
 	dev->blocking = 1;
 	dev->uses_numbered_reports = 0;
+	dev->report_descriptor = NULL;
+	dev->output_encoder = NULL;
+	dev->feature_encoder = NULL;
+	dev->set = NULL;
+	dev->next_member = NULL;
+	dev->ring = NULL;
+	dev->read_buf = NULL;
+	dev->read_pending = 0;
+	dev->read_error = 0;
+	dev->thread_running = 0;
+	dev->queue = NULL;
+	dev->stop_fd = -1;
+	dev->notify_fd = -1;
+	dev->reports_read = 0;
+	dev->wait_strategy = HID_WAIT_BLOCK;
+	dev->spin_us = 0;
+	dev->context = NULL;
+	dev->next_in_context = NULL;
+	pthread_mutex_init(&dev->mutex, NULL);
+	/* Wait on CLOCK_MONOTONIC, so deadlines don't move when the
+	   system clock is set. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dev->condition, &attr);
+	pthread_condattr_destroy(&attr);
 
 	return dev;
 }
@@ -77,86 +236,45 @@ static void register_error(hid_device *device, const char *op)
 
 }
 
-/* Get an attribute value from a udev_device and return it as a whar_t
-   string. The returned string must be freed with free() when done.*/
-static wchar_t *copy_udev_string(struct udev_device *dev, const char *udev_name)
+/* Get an attribute value from a udev_device and copy it into string as a
+   wchar_t string. maxlen is the size of string in multiples of wchar_t.
+   The return value is 0 on success and -1 if the attribute is missing. */
+static int copy_udev_string_buf(struct udev_device *dev, const char *udev_name, wchar_t *string, size_t maxlen)
 {
 	const char *str;
-	wchar_t *ret = NULL;
 	str = udev_device_get_sysattr_value(dev, udev_name);
-	if (str) {
-		/* Convert the string from UTF-8 to wchar_t */
-		size_t wlen = mbstowcs(NULL, str, 0);
-		ret = calloc(wlen+1, sizeof(wchar_t));
-		mbstowcs(ret, str, wlen+1);
-		ret[wlen] = 0x0000;
-	}
-	
-	return ret;
-}
+	if (!str)
+		return -1;
 
-/* uses_numbered_reports() returns 1 if report_descriptor describes a device
-   which contains numbered reports. */ 
-static int uses_numbered_reports(__u8 *report_descriptor, __u32 size) {
-	int i = 0;
-	int size_code;
-	int data_len, key_size;
-	
-	while (i < size) {
-		int key = report_descriptor[i];
+	/* Convert the string from UTF-8 to wchar_t */
+	if (mbstowcs(string, str, maxlen) == (size_t)-1)
+		return -1;
+	string[maxlen-1] = 0x0000;
 
-		/* Check for the Report ID key */
-		if (key == 0x85/*Report ID*/) {
-			/* This device has a Report ID, which means it uses
-			   numbered reports. */
-			return 1;
-		}
-		
-		//printf("key: %02hhx\n", key);
-		
-		if ((key & 0xf0) == 0xf0) {
-			/* This is a Long Item. The next byte contains the
-			   length of the data section (value) for this key.
-			   See the HID specification, version 1.11, section
-			   6.2.2.3, titled "Long Items." */
-			if (i+1 < size)
-				data_len = report_descriptor[i+1];
-			else
-				data_len = 0; /* malformed report */
-			key_size = 3;
-		}
-		else {
-			/* This is a Short Item. The bottom two bits of the
-			   key contain the size code for the data section
-			   (value) for this key.  Refer to the HID
-			   specification, version 1.11, section 6.2.2.2,
-			   titled "Short Items." */
-			size_code = key & 0x3;
-			switch (size_code) {
-			case 0:
-			case 1:
-			case 2:
-				data_len = size_code;
-				break;
-			case 3:
-				data_len = 4;
-				break;
-			default:
-				/* Can't ever happen since size_code is & 0x3 */
-				data_len = 0;
-				break;
-			};
-			key_size = 1;
-		}
-		
-		/* Skip over this key and it's associated data */
-		i += data_len + key_size;
-	}
-	
-	/* Didn't find a Report ID key. Device doesn't use numbered reports. */
 	return 0;
 }
 
+/* Reads the report descriptor which the kernel caches in sysfs for the
+   HID device hid_dev (of subsystem "hid"). This doesn't involve the
+   device itself. The return value is the length of the descriptor, or
+   -1 on failure. */
+static int read_sysfs_report_descriptor(struct udev_device *hid_dev, __u8 *buf, size_t len)
+{
+	char path[PATH_MAX];
+	int fd;
+	ssize_t res;
+
+	snprintf(path, sizeof(path), "%s/report_descriptor",
+	         udev_device_get_syspath(hid_dev));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	res = read(fd, buf, len);
+	close(fd);
+
+	return res;
+}
+
 static int get_device_string(hid_device *dev, const char *key, wchar_t *string, size_t maxlen)
 {
 	struct udev *udev;
@@ -204,14 +322,43 @@ end:
 }
 
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* enumerate() calls an enum_sink_fn once for each matching device. The
+   record and its strings are only valid for the duration of the call, and
+   its next pointer is always NULL. Returning non-zero stops the
+   enumeration. This is the same contract as hid_enumerate_each()'s
+   callback, which is passed straight through. */
+typedef hid_enumerate_cb enum_sink_fn;
+
+/* Returns non-zero if the bits of value selected by mask match want. */
+#define MATCH_MASKED(value, want, mask) ((((value) ^ (want)) & (mask)) == 0)
+
+static int serial_matches(const struct hid_enumerate_filter *filter, const wchar_t *serial)
+{
+	if (!filter->serial_number)
+		return 1;
+	if (!serial)
+		return 0;
+	return wcsncmp(serial, filter->serial_number, wcslen(filter->serial_number)) == 0;
+}
+
+static int usage_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
+{
+	return (!filter->usage_page || filter->usage_page == info->usage_page) &&
+	       (!filter->usage || filter->usage == info->usage);
+}
+
+/* Walks the hidraw devices, and hands the ones which match filter to sink.
+   Each criterion is checked as soon as the sysfs attribute it needs has
+   been read, cheapest first, so that nothing more is read for a device
+   once it is known not to match. The return value is the number of
+   devices handed to sink, or -1 on failure. */
+static int scan_devices(const struct hid_enumerate_filter *filter,
+                        enum_sink_fn sink, void *user_data)
 {
 	struct udev *udev;
 	struct udev_enumerate *enumerate;
 	struct udev_list_entry *devices, *dev_list_entry;
-	
-	struct hid_device_info *root = NULL; // return object
-	struct hid_device_info *cur_dev = NULL;
+	int count = 0;
 	
 	setlocale(LC_ALL,"");
 
@@ -219,7 +366,7 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	udev = udev_new();
 	if (!udev) {
 		printf("Can't create udev\n");
-		return NULL;
+		return -1;
 	}
 
 	/* Create a list of the devices in the 'hidraw' subsystem. */
@@ -227,7 +374,7 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
 	udev_enumerate_scan_devices(enumerate);
 	devices = udev_enumerate_get_list_entry(enumerate);
-	/* For each item, see if it matches the vid/pid, and if so
+	/* For each item, see if it matches the filter, and if so
 	   create a udev_device record for it */
 	udev_list_entry_foreach(dev_list_entry, devices) {
 		const char *sysfs_path;
@@ -235,8 +382,15 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		const char *str;
 		struct udev_device *hid_dev; // The device's HID interface.
 		struct udev_device *dev; // The actual hardware device.
-		unsigned short dev_vid;
-		unsigned short dev_pid;
+		struct udev_device *intf_dev; // The device's USB interface.
+		struct udev_device *hid_parent; // The HID device under the interface.
+		struct hid_device_info info;
+		wchar_t serial[256];
+		wchar_t manufacturer[256];
+		wchar_t product[256];
+		__u8 rpt_desc[HID_MAX_DESCRIPTOR_SIZE];
+		int rpt_len;
+		int done = 0;
 		
 		/* Get the filename of the /sys entry for the device
 		   and create a udev_device object (dev) representing it */
@@ -259,75 +413,489 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 			goto next;
 		}
 
-		/* Get the VID/PID of the device */
+		/* Fill out the record as the filter is checked. The strings
+		   live on the stack until sink() has copied what it needs. */
+		memset(&info, 0, sizeof(info));
+		info.path = (char*) dev_path;
+
+		/* Bus Number */
+		if (filter->bus_number > 0) {
+			str = udev_device_get_sysattr_value(dev, "busnum");
+			if (!str || strtol(str, NULL, 10) != filter->bus_number)
+				goto next;
+		}
+
+		/* Get the VID/PID of the device, and check them against
+		   the filter */
 		str = udev_device_get_sysattr_value(dev,"idVendor");
-		dev_vid = (str)? strtol(str, NULL, 16): 0x0;
+		info.vendor_id = (str)? strtol(str, NULL, 16): 0x0;
 		str = udev_device_get_sysattr_value(dev, "idProduct");
-		dev_pid = (str)? strtol(str, NULL, 16): 0x0;
-
-		/* Check the VID/PID against the arguments */
-		if ((vendor_id == 0x0 && product_id == 0x0) ||
-		    (vendor_id == dev_vid && product_id == dev_pid)) {
-			struct hid_device_info *tmp;
-			size_t len;
-
-		    	/* VID/PID match. Create the record. */
-			tmp = malloc(sizeof(struct hid_device_info));
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
-			}
-			cur_dev = tmp;
-			
-			/* Fill out the record */
-			cur_dev->next = NULL;
-			str = dev_path;
-			if (str) {
-				len = strlen(str);
-				cur_dev->path = calloc(len+1, sizeof(char));
-				strncpy(cur_dev->path, str, len+1);
-				cur_dev->path[len] = '\0';
-			}
-			else
-				cur_dev->path = NULL;
-			
-			/* Serial Number */
-			cur_dev->serial_number
-				= copy_udev_string(dev, "serial");
-
-			/* Manufacturer and Product strings */
-			cur_dev->manufacturer_string
-				= copy_udev_string(dev, "manufacturer");
-			cur_dev->product_string
-				= copy_udev_string(dev, "product");
-			
-			/* VID/PID */
-			cur_dev->vendor_id = dev_vid;
-			cur_dev->product_id = dev_pid;
-
-			/* Release Number */
-			str = udev_device_get_sysattr_value(dev, "bcdDevice");
-			cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
-			
-			/* Interface Number (Unsupported on Linux/hidraw) */
-			cur_dev->interface_number = -1;
+		info.product_id = (str)? strtol(str, NULL, 16): 0x0;
+		if (!MATCH_MASKED(info.vendor_id, filter->vendor_id, filter->vendor_id_mask) ||
+		    !MATCH_MASKED(info.product_id, filter->product_id, filter->product_id_mask))
+			goto next;
+
+		/* Interface Number */
+		intf_dev = udev_device_get_parent_with_subsystem_devtype(
+		       hid_dev,
+		       "usb",
+		       "usb_interface");
+		str = (intf_dev)? udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber"): NULL;
+		info.interface_number = (str)? strtol(str, NULL, 16): -1;
+		if (filter->interface_number >= 0 &&
+		    filter->interface_number != info.interface_number)
+			goto next;
+
+		/* Serial Number */
+		if (copy_udev_string_buf(dev, "serial", serial, 256) == 0)
+			info.serial_number = serial;
+		if (!serial_matches(filter, info.serial_number))
+			goto next;
 
+		/* Usage Page and Usage, from the report descriptor which the
+		   kernel keeps in sysfs. */
+		hid_parent = udev_device_get_parent_with_subsystem_devtype(
+		       hid_dev,
+		       "hid",
+		       NULL);
+		rpt_len = (hid_parent)?
+			read_sysfs_report_descriptor(hid_parent, rpt_desc, sizeof(rpt_desc)): -1;
+		if (rpt_len > 0) {
+			struct hid_report_descriptor *parsed;
+			parsed = hid_parse_report_descriptor(rpt_desc, rpt_len);
+			if (parsed) {
+				info.usage_page = parsed->usage_page;
+				info.usage = parsed->usage;
+				hid_free_report_descriptor(parsed);
+			}
 		}
-		else
+		if (!usage_matches(filter, &info))
 			goto next;
 
+		/* Manufacturer and Product strings */
+		if (copy_udev_string_buf(dev, "manufacturer", manufacturer, 256) == 0)
+			info.manufacturer_string = manufacturer;
+		if (copy_udev_string_buf(dev, "product", product, 256) == 0)
+			info.product_string = product;
+
+		/* Release Number */
+		str = udev_device_get_sysattr_value(dev, "bcdDevice");
+		info.release_number = (str)? strtol(str, NULL, 16): 0x0;
+
+		count++;
+		done = sink(&info, user_data);
+
 	next:
 		udev_device_unref(hid_dev);
 		/* dev doesn't need to be (and can't be) unref()d. It will
 		   cause a double-free() error. I'm not sure why. */
+		if (done)
+			break;
 	}
 	/* Free the enumerator and udev objects. */
 	udev_enumerate_unref(enumerate);
 	udev_unref(udev);
 	
-	return root;
+	return count;
+}
+
+/* Sets up filter the way hid_enumerate() has always matched: everything
+   if both IDs are 0, and the exact VID/PID otherwise. */
+static void init_vid_pid_filter(struct hid_enumerate_filter *filter,
+                                unsigned short vendor_id, unsigned short product_id)
+{
+	hid_init_enumerate_filter(filter);
+	if (vendor_id != 0x0 || product_id != 0x0) {
+		filter->vendor_id = vendor_id;
+		filter->vendor_id_mask = 0xffff;
+		filter->product_id = product_id;
+		filter->product_id_mask = 0xffff;
+	}
+}
+
+/* List of hid_device_info records built up by append_to_list(). */
+struct list_sink {
+	struct hid_device_info *root;
+	struct hid_device_info *cur;
+};
+
+static wchar_t *dup_wcs(const wchar_t *s)
+{
+	return (s)? wcsdup(s): NULL;
+}
+
+static int append_to_list(const struct hid_device_info *info, void *user_data)
+{
+	struct list_sink *list = user_data;
+	struct hid_device_info *tmp;
+
+	tmp = malloc(sizeof(struct hid_device_info));
+	if (list->cur) {
+		list->cur->next = tmp;
+	}
+	else {
+		list->root = tmp;
+	}
+	list->cur = tmp;
+
+	*tmp = *info;
+	tmp->next = NULL;
+	tmp->path = (info->path)? strdup(info->path): NULL;
+	tmp->serial_number = dup_wcs(info->serial_number);
+	tmp->manufacturer_string = dup_wcs(info->manufacturer_string);
+	tmp->product_string = dup_wcs(info->product_string);
+
+	return 0;
+}
+
+/* Caller-provided records and string pool filled in by append_to_pool(). */
+struct pool_sink {
+	struct hid_device_info *devs;
+	size_t num_devs;
+	char *strings;
+	size_t strings_len;
+
+	size_t count;        /* Devices seen, whether they fit or not. */
+	size_t strings_used; /* Bytes of the pool needed so far. */
+	int full;            /* Set once a record didn't fit. */
+};
+
+/* Reserves len bytes aligned to align from the string pool. Space is
+   accounted for even when it doesn't fit, in which case NULL is
+   returned. Offsets are aligned from the start of the pool, which is
+   wchar_t-aligned, so the space needed doesn't depend on where the pool
+   is, and a size query with no pool gives the size to allocate. */
+static void *pool_alloc(struct pool_sink *pool, size_t len, size_t align)
+{
+	size_t off = pool->strings_used;
+	off += (align - off % align) % align;
+	pool->strings_used = off + len;
+	if (pool->strings_used > pool->strings_len)
+		return NULL;
+	return pool->strings + off;
+}
+
+static char *pool_strdup(struct pool_sink *pool, const char *s)
+{
+	char *p;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	len = strlen(s) + 1;
+	p = pool_alloc(pool, len, 1);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+static wchar_t *pool_wcsdup(struct pool_sink *pool, const wchar_t *s)
+{
+	wchar_t *p;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	len = (wcslen(s) + 1) * sizeof(wchar_t);
+	p = pool_alloc(pool, len, sizeof(wchar_t));
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+static int append_to_pool(const struct hid_device_info *info, void *user_data)
+{
+	struct pool_sink *pool = user_data;
+	struct hid_device_info rec = *info;
+
+	rec.next = NULL;
+	rec.serial_number = pool_wcsdup(pool, info->serial_number);
+	rec.manufacturer_string = pool_wcsdup(pool, info->manufacturer_string);
+	rec.product_string = pool_wcsdup(pool, info->product_string);
+	rec.path = pool_strdup(pool, info->path);
+
+	/* Only write the record if it and its strings fit. Once one doesn't,
+	   stop writing so that the records stay contiguous. */
+	if (!pool->full &&
+	    pool->count < pool->num_devs &&
+	    pool->strings_used <= pool->strings_len) {
+		pool->devs[pool->count] = rec;
+		if (pool->count > 0)
+			pool->devs[pool->count-1].next = &pool->devs[pool->count];
+	}
+	else
+		pool->full = 1;
+	pool->count++;
+
+	return 0;
+}
+
+/* Returns non-zero if info, which was produced by scan_devices(), matches
+   every criterion of filter. */
+static int info_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
+{
+	return MATCH_MASKED(info->vendor_id, filter->vendor_id, filter->vendor_id_mask) &&
+	       MATCH_MASKED(info->product_id, filter->product_id, filter->product_id_mask) &&
+	       (filter->interface_number < 0 || filter->interface_number == info->interface_number) &&
+	       usage_matches(filter, info) &&
+	       serial_matches(filter, info->serial_number);
+}
+
+/* Process-wide enumeration cache. A snapshot holds the full list of HID
+   devices as of one generation of the device set. It is reference
+   counted so that the sinks can run without cache_mutex held. */
+struct cache_snapshot {
+	struct hid_device_info *devs;
+	unsigned long generation;
+	int refs;
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int cache_enabled = 0;
+static struct cache_snapshot *cache = NULL; /* Protected by cache_mutex */
+
+/* Bumped whenever the set of devices on the system changes. */
+static unsigned long device_generation = 1;
+
+/* udev monitor used to notice hidraw devices coming and going. */
+static struct udev *monitor_udev = NULL;
+static struct udev_monitor *monitor = NULL;
+static int monitor_state = 0; /* 0: not tried, 1: receiving, -1: unavailable */
+
+/* Names in /sys/class/hidraw at the last check_bus(), hashed. */
+static unsigned long hidraw_signature = 0;
+
+/* Checks whether the set of hidraw devices has changed since the last
+   call, and bumps device_generation if it has. This is done by draining a
+   udev monitor, or where one can't be created, by comparing the names in
+   /sys/class/hidraw with the last call. Called with cache_mutex locked. */
+static void check_bus(void)
+{
+	DIR *dir;
+	struct dirent *ent;
+	unsigned long sig = 5381;
+
+	if (monitor_state == 0) {
+		monitor_udev = udev_new();
+		monitor = (monitor_udev)? udev_monitor_new_from_netlink(monitor_udev, "udev"): NULL;
+		if (monitor &&
+		    udev_monitor_filter_add_match_subsystem_devtype(monitor, "hidraw", NULL) >= 0 &&
+		    udev_monitor_enable_receiving(monitor) >= 0) {
+			monitor_state = 1;
+		}
+		else {
+			if (monitor)
+				udev_monitor_unref(monitor);
+			if (monitor_udev)
+				udev_unref(monitor_udev);
+			monitor = NULL;
+			monitor_udev = NULL;
+			monitor_state = -1;
+		}
+	}
+
+	if (monitor_state == 1) {
+		struct pollfd fds;
+		fds.fd = udev_monitor_get_fd(monitor);
+		fds.events = POLLIN;
+		fds.revents = 0;
+		while (poll(&fds, 1, 0) > 0 && (fds.revents & POLLIN)) {
+			struct udev_device *dev = udev_monitor_receive_device(monitor);
+			if (!dev)
+				break;
+			udev_device_unref(dev);
+			__sync_fetch_and_add(&device_generation, 1);
+		}
+		return;
+	}
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir)
+		return;
+	while ((ent = readdir(dir)) != NULL) {
+		const char *c;
+		for (c = ent->d_name; *c; c++)
+			sig = sig * 33 + *c;
+	}
+	closedir(dir);
+
+	if (sig != hidraw_signature) {
+		hidraw_signature = sig;
+		__sync_fetch_and_add(&device_generation, 1);
+	}
+}
+
+static void release_snapshot(struct cache_snapshot *snap)
+{
+	/* Called with cache_mutex locked. */
+	if (--snap->refs == 0) {
+		hid_free_enumeration(snap->devs);
+		free(snap);
+	}
+}
+
+/* Hands the devices in filter to sink, from the cache if it is enabled and
+   up to date, and from a fresh scan otherwise. Filters on the bus number
+   always scan, because the cached records don't carry it. */
+static int enumerate(const struct hid_enumerate_filter *filter,
+                     enum_sink_fn sink, void *user_data)
+{
+	struct cache_snapshot *snap;
+	struct hid_device_info *cur;
+	int count = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (!cache_enabled || filter->bus_number > 0) {
+		pthread_mutex_unlock(&cache_mutex);
+		return scan_devices(filter, sink, user_data);
+	}
+
+	check_bus();
+	if (!cache || cache->generation != __sync_fetch_and_add(&device_generation, 0)) {
+		/* Rescan with cache_mutex held, so that other threads wait
+		   for this scan rather than starting their own. Read the
+		   generation first, so that a change during the scan causes
+		   another one next time. */
+		struct hid_enumerate_filter match_all;
+		struct list_sink list;
+
+		snap = malloc(sizeof(struct cache_snapshot));
+		snap->generation = __sync_fetch_and_add(&device_generation, 0);
+		snap->refs = 1;
+		hid_init_enumerate_filter(&match_all);
+		list.root = NULL;
+		list.cur = NULL;
+		if (scan_devices(&match_all, append_to_list, &list) < 0) {
+			free(snap);
+			pthread_mutex_unlock(&cache_mutex);
+			return -1;
+		}
+		snap->devs = list.root;
+
+		if (cache)
+			release_snapshot(cache);
+		cache = snap;
+	}
+	snap = cache;
+	snap->refs++;
+	pthread_mutex_unlock(&cache_mutex);
+
+	for (cur = snap->devs; cur; cur = cur->next) {
+		struct hid_device_info info;
+
+		if (!info_matches(filter, cur))
+			continue;
+		info = *cur;
+		info.next = NULL;
+		count++;
+		if (sink(&info, user_data))
+			break;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	release_snapshot(snap);
+	pthread_mutex_unlock(&cache_mutex);
+
+	return count;
+}
+
+int HID_API_EXPORT hid_set_enumerate_cache(int enable)
+{
+	pthread_mutex_lock(&cache_mutex);
+	cache_enabled = enable;
+	if (!enable && cache) {
+		release_snapshot(cache);
+		cache = NULL;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	return 0;
+}
+
+unsigned long HID_API_EXPORT hid_enumerate_generation(void)
+{
+	pthread_mutex_lock(&cache_mutex);
+	check_bus();
+	pthread_mutex_unlock(&cache_mutex);
+
+	return __sync_fetch_and_add(&device_generation, 0);
+}
+
+void HID_API_EXPORT hid_init_enumerate_filter(struct hid_enumerate_filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->interface_number = -1;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	init_vid_pid_filter(&filter, vendor_id, product_id);
+	return hid_enumerate_filtered(&filter);
+}
+
+struct hid_device_info HID_API_EXPORT *hid_enumerate_filtered(const struct hid_enumerate_filter *filter)
+{
+	struct hid_enumerate_filter match_all;
+	struct list_sink list;
+
+	if (!filter) {
+		hid_init_enumerate_filter(&match_all);
+		filter = &match_all;
+	}
+
+	list.root = NULL; // return object
+	list.cur = NULL;
+	enumerate(filter, append_to_list, &list);
+
+	return list.root;
+}
+
+int HID_API_EXPORT hid_enumerate_each(const struct hid_enumerate_filter *filter, hid_enumerate_cb callback, void *user_data)
+{
+	struct hid_enumerate_filter match_all;
+
+	if (!filter) {
+		hid_init_enumerate_filter(&match_all);
+		filter = &match_all;
+	}
+
+	return enumerate(filter, callback, user_data);
+}
+
+int HID_API_EXPORT hid_enumerate_into(unsigned short vendor_id, unsigned short product_id, struct hid_device_info *devs, size_t num_devs, void *strings, size_t *strings_len)
+{
+	struct hid_enumerate_filter filter;
+	struct pool_sink pool;
+
+	if ((uintptr_t)strings % sizeof(wchar_t) != 0)
+		return -1;
+
+	init_vid_pid_filter(&filter, vendor_id, product_id);
+
+	pool.devs = devs;
+	pool.num_devs = num_devs;
+	pool.strings = strings;
+	pool.strings_len = *strings_len;
+	pool.count = 0;
+	pool.strings_used = 0;
+	pool.full = 0;
+
+	if (enumerate(&filter, append_to_pool, &pool) < 0)
+		return -1;
+
+	*strings_len = pool.strings_used;
+	return pool.count;
+}
+
+int HID_API_EXPORT hid_set_enumerate_timeout(int milliseconds)
+{
+	/* Strings come from sysfs, so there is nothing to wait for. */
+	if (milliseconds <= 0)
+		return -1;
+
+	return 0;
 }
 
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
@@ -344,11 +912,12 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 	}
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+/* Returns the path of the first device with the given IDs, and serial
+   number if it isn't NULL, or NULL. The caller frees it. */
+static char *find_path(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	char *path_to_open = NULL;
 	
 	devs = hid_enumerate(vendor_id, product_id);
 	cur_dev = devs;
@@ -357,25 +926,34 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar
 		    cur_dev->product_id == product_id) {
 			if (serial_number) {
 				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
+					path_to_open = strdup(cur_dev->path);
 					break;
 				}
 			}
 			else {
-				path_to_open = cur_dev->path;
+				path_to_open = strdup(cur_dev->path);
 				break;
 			}
 		}
 		cur_dev = cur_dev->next;
 	}
 
+	hid_free_enumeration(devs);
+	
+	return path_to_open;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+{
+	char *path_to_open = find_path(vendor_id, product_id, serial_number);
+	hid_device *handle = NULL;
+
 	if (path_to_open) {
 		/* Open the device */
 		handle = hid_open_path(path_to_open);
+		free(path_to_open);
 	}
 
-	hid_free_enumeration(devs);
-	
 	return handle;
 }
 
@@ -424,10 +1002,19 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 		if (res < 0) {
 			perror("HIDIOCGRDESC");
 		} else {
-			/* Determine if this device uses numbered reports. */
-			dev->uses_numbered_reports =
-				uses_numbered_reports(rpt_desc.value,
-				                      rpt_desc.size);
+			/* Parse it, and determine if this device uses
+			   numbered reports. */
+			dev->report_descriptor =
+				hid_parse_report_descriptor(rpt_desc.value,
+				                            rpt_desc.size);
+			if (dev->report_descriptor) {
+				dev->uses_numbered_reports =
+					dev->report_descriptor->uses_numbered_reports;
+				dev->output_encoder = hid_report_encoder_create(
+					dev->report_descriptor, HID_REPORT_OUTPUT);
+				dev->feature_encoder = hid_report_encoder_create(
+					dev->report_descriptor, HID_REPORT_FEATURE);
+			}
 		}
 		
 		return dev;
@@ -440,41 +1027,837 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 }
 
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+static long long get_time_ns(void)
 {
-	int bytes_written;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	bytes_written = write(dev->device_handle, data, length);
+/* Turns a timeout in milliseconds into a CLOCK_MONOTONIC deadline in
+   nanoseconds. -1 (wait forever) stays -1, and 0 (don't wait) stays 0,
+   which is always in the past. */
+static long long deadline_after(int milliseconds)
+{
+	if (milliseconds < 0)
+		return -1;
+	if (milliseconds == 0)
+		return 0;
+	return get_time_ns() + milliseconds * 1000000LL;
+}
 
-	return bytes_written;
+/* Stores the time left until deadline (which is not -1) in ts, which is
+   zero if the deadline has passed. */
+static void time_left(long long deadline, struct timespec *ts)
+{
+	long long left = deadline - get_time_ns();
+
+	if (left < 0)
+		left = 0;
+	ts->tv_sec = left / 1000000000LL;
+	ts->tv_nsec = left % 1000000000LL;
 }
 
+/* Tells the CPU that this is a spin loop. */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Returns when to stop spinning for a read with the given deadline, or 0
+   if the device's wait strategy is not to spin. */
+static long long spin_end_time(hid_device *dev, long long deadline)
 {
-	int bytes_read;
+	long long end;
 
-	if (milliseconds != 0) {
-		/* milliseconds is -1 or > 0. In both cases, we want to
-		   call poll() and wait for data to arrive. -1 means
-		   INFINITE. */
-		int ret;
-		struct pollfd fds;
+	if (dev->wait_strategy == HID_WAIT_BLOCK || deadline == 0)
+		return 0;
 
-		fds.fd = dev->device_handle;
-		fds.events = POLLIN;
-		fds.revents = 0;
-		ret = poll(&fds, 1, milliseconds);
-		if (ret == -1 || ret == 0)
-			/* Error or timeout */
-			return ret;
+	if (dev->wait_strategy == HID_WAIT_BUSY_POLL)
+		end = LLONG_MAX;
+	else
+		end = get_time_ns() + dev->spin_us * 1000LL;
+	if (deadline > 0 && end > deadline)
+		end = deadline;
+
+	return end;
+}
+
+static struct report_ring *report_ring_new(unsigned int num_slots, size_t slot_size)
+{
+	struct report_ring *ring = calloc(1, sizeof(struct report_ring));
+	if (!ring)
+		return NULL;
+
+	ring->data = malloc(num_slots * slot_size);
+	ring->lens = calloc(num_slots, sizeof(size_t));
+	if (!ring->data || !ring->lens) {
+		free(ring->data);
+		free(ring->lens);
+		free(ring);
+		return NULL;
 	}
+	ring->slot_size = slot_size;
+	ring->num_slots = num_slots;
 
-	bytes_read = read(dev->device_handle, data, length);
+	return ring;
+}
+
+static void report_ring_free(struct report_ring *ring)
+{
+	if (!ring)
+		return;
+	free(ring->data);
+	free(ring->lens);
+	free(ring);
+}
+
+static void report_ring_push(struct report_ring *ring, const unsigned char *data, size_t len)
+{
+	unsigned int slot;
+
+	if (ring->count == ring->num_slots) {
+		/* Drop the oldest report. */
+		ring->head = (ring->head + 1) % ring->num_slots;
+		__atomic_store_n(&ring->count, ring->count - 1, __ATOMIC_RELAXED);
+		ring->dropped++;
+	}
+	ring->received++;
+
+	slot = (ring->head + ring->count) % ring->num_slots;
+	if (len > ring->slot_size)
+		len = ring->slot_size;
+	memcpy(ring->data + slot * ring->slot_size, data, len);
+	ring->lens[slot] = len;
+	/* Spinning readers look at count without the mutex. */
+	__atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the oldest report into data and removes it. The ring must not
+   be empty. */
+static int report_ring_pop(struct report_ring *ring, unsigned char *data, size_t length)
+{
+	size_t len = ring->lens[ring->head];
+
+	if (len > length)
+		len = length;
+	memcpy(data, ring->data + ring->head * ring->slot_size, len);
+	ring->head = (ring->head + 1) % ring->num_slots;
+	__atomic_store_n(&ring->count, ring->count - 1, __ATOMIC_RELAXED);
+
+	return len;
+}
+
+/* Returns the size of the largest Input report of a device, including
+   the report ID, or the largest report hidraw can return if the report
+   descriptor is unknown. */
+static size_t max_input_report_size(hid_device *dev)
+{
+	const struct hid_report_descriptor *desc = dev->report_descriptor;
+	size_t i, max = 0;
+
+	if (!desc)
+		return 4096;
+	for (i = 0; i < desc->num_reports; i++) {
+		if (desc->reports[i].length[HID_REPORT_INPUT] > max)
+			max = desc->reports[i].length[HID_REPORT_INPUT];
+	}
+	if (max == 0)
+		return 4096;
+
+	return max + (desc->uses_numbered_reports? 1: 0);
+}
+
+#ifdef HAVE_IO_URING
+
+/* Tags in the low bits of the user_data of requests which aren't reads.
+   The user_data of a read is the device it is for. */
+#define URING_TAG_WRITE 1
+#define URING_TAG_CANCEL 2
+
+/* A write in flight, which the caller waits for, with a copy of the
+   report, since the kernel may read it after io_uring_enter() returns. If
+   the caller gives up on it, abandoned is set, and its completion frees
+   it. */
+struct uring_write {
+	int done;
+	int res;
+	int abandoned;
+	unsigned char data[];
+};
+
+static int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	/* Waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11). */
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_size > u->sq_map_size)
+			u->sq_map_size = u->cq_map_size;
+		u->cq_map_size = u->sq_map_size;
+	}
+
+	u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_map = u->sq_map;
+	else {
+		u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE,
+		                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED)
+			goto fail_sq;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	u->sq_head = (unsigned int *)((char *)u->sq_map + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_map + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_map + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_map + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned int *)((char *)u->cq_map + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_map + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_map + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+
+	return 0;
+
+fail_cq:
+	if (u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_size);
+fail_sq:
+	munmap(u->sq_map, u->sq_map_size);
+fail:
+	close(u->fd);
+	return -1;
+}
+
+static void uring_exit(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_size);
+	munmap(u->sq_map, u->sq_map_size);
+	close(u->fd);
+}
+
+/* Returns the number of requests which the kernel hasn't taken yet. */
+static unsigned int uring_pending(struct uring *u)
+{
+	return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Submits the pending requests, and if min_complete isn't 0, waits until
+   that many completions are there, or nanoseconds (if not -1) pass.
+   Returns 0 on success, including timeouts and signals, or -1. */
+static int uring_enter(struct uring *u, unsigned int min_complete, long long nanoseconds)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	int res;
+
+	memset(&arg, 0, sizeof(arg));
+	if (min_complete > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (nanoseconds >= 0) {
+			ts.tv_sec = nanoseconds / 1000000000LL;
+			ts.tv_nsec = nanoseconds % 1000000000LL;
+			arg.ts = (uintptr_t)&ts;
+		}
+	}
+
+	res = syscall(__NR_io_uring_enter, u->fd, uring_pending(u), min_complete,
+	              flags, &arg, sizeof(arg));
+	if (res < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+		return -1;
+
+	return 0;
+}
+
+/* Returns a zeroed submission queue entry, submitting the pending ones
+   first if the queue is full, or NULL. There is no kernel polling thread,
+   so the kernel only looks at the queue in io_uring_enter(), and the
+   entry can be filled in after it has been added. */
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *u->sq_tail;
+	unsigned int index;
+
+	if (uring_pending(u) >= u->sq_entries) {
+		if (uring_enter(u, 0, 0) < 0 || uring_pending(u) >= u->sq_entries)
+			return NULL;
+	}
+
+	index = tail & *u->sq_mask;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+/* Posts a read on a device's fd, into its read buffer. */
+static int uring_post_read(hid_device_set *set, hid_device *dev)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&set->uring);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = dev->device_handle;
+	sqe->addr = (uintptr_t)dev->read_buf;
+	sqe->len = dev->ring->slot_size;
+	sqe->user_data = (uintptr_t)dev;
+	dev->read_pending = 1;
+
+	return 0;
+}
+
+static void uring_complete(hid_device_set *set, uint64_t user_data, int res)
+{
+	hid_device *dev;
+
+	if (user_data == URING_TAG_CANCEL)
+		return;
+	if (user_data & URING_TAG_WRITE) {
+		struct uring_write *w = (struct uring_write *)(uintptr_t)(user_data & ~(uint64_t)URING_TAG_WRITE);
+		if (w->abandoned) {
+			free(w);
+			return;
+		}
+		w->res = res;
+		w->done = 1;
+		return;
+	}
+
+	dev = (hid_device *)(uintptr_t)user_data;
+	dev->read_pending = 0;
+	if (res > 0)
+		report_ring_push(dev->ring, dev->read_buf, res);
+	else if (res != -EINTR && res != -EAGAIN && res != -ECANCELED)
+		dev->read_error = 1; /* The device is most likely gone. */
+
+	/* Post the next read, unless the device is being removed. */
+	if (dev->set == set && !dev->read_error) {
+		if (uring_post_read(set, dev) < 0)
+			dev->read_error = 1;
+	}
+}
+
+/* Handles every completion which is there. */
+static void uring_reap(hid_device_set *set)
+{
+	struct uring *u = &set->uring;
+	unsigned int head = *u->cq_head;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		uint64_t user_data = cqe->user_data;
+		int res = cqe->res;
+
+		/* Free the entry first, since handling it can post
+		   another request. */
+		head++;
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		uring_complete(set, user_data, res);
+	}
+}
+
+/* Submits the pending requests, and waits for a completion until
+   deadline (or forever, if deadline is -1). Returns 1 if the time is up,
+   0 if there may be new completions, or -1. */
+static int uring_wait(hid_device_set *set, long long deadline)
+{
+	struct uring *u = &set->uring;
+	long long wait = -1;
+
+	if (deadline >= 0) {
+		wait = deadline - get_time_ns();
+		if (wait <= 0) {
+			if (uring_pending(u) > 0 && uring_enter(u, 0, 0) < 0)
+				return -1;
+			return 1;
+		}
+	}
+
+	return uring_enter(u, 1, wait);
+}
+
+static int uring_add(hid_device_set *set, hid_device *dev)
+{
+	int flags;
+
+	dev->ring = report_ring_new(URING_RING_SLOTS, max_input_report_size(dev));
+	dev->read_buf = malloc(max_input_report_size(dev));
+	if (!dev->ring || !dev->read_buf)
+		goto fail;
+
+	/* Reads on a non-blocking fd would complete with -EAGAIN instead of
+	   waiting for a report. Non-blocking reads are done in user space
+	   instead. */
+	flags = fcntl(dev->device_handle, F_GETFL, 0);
+	if (flags >= 0 && (flags & O_NONBLOCK))
+		fcntl(dev->device_handle, F_SETFL, flags & ~O_NONBLOCK);
+
+	dev->read_error = 0;
+	if (uring_post_read(set, dev) < 0 || uring_enter(&set->uring, 0, 0) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	report_ring_free(dev->ring);
+	free(dev->read_buf);
+	dev->ring = NULL;
+	dev->read_buf = NULL;
+	return -1;
+}
+
+/* Cancels the read posted for a device which was taken out of its set,
+   and frees its buffers once the read is done. */
+static void uring_remove(hid_device_set *set, hid_device *dev)
+{
+	if (dev->read_pending) {
+		struct io_uring_sqe *sqe = uring_get_sqe(&set->uring);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = (uintptr_t)dev;
+			sqe->user_data = URING_TAG_CANCEL;
+		}
+		while (dev->read_pending) {
+			if (uring_enter(&set->uring, 1, -1) < 0)
+				break;
+			uring_reap(set);
+		}
+	}
+
+	if (!dev->blocking) {
+		int flags = fcntl(dev->device_handle, F_GETFL, 0);
+		if (flags >= 0)
+			fcntl(dev->device_handle, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	report_ring_free(dev->ring);
+	free(dev->read_buf);
+	dev->ring = NULL;
+	dev->read_buf = NULL;
+}
+
+static int uring_set_wait(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds)
+{
+	long long deadline = deadline_after(milliseconds);
+
+	for (;;) {
+		hid_device *dev;
+		size_t n = 0;
+		int res;
+
+		uring_reap(set);
+		for (dev = set->members; dev && n < max_ready; dev = dev->next_member) {
+			if (dev->ring->count > 0 || dev->read_error)
+				ready[n++] = dev;
+		}
+		if (n > 0) {
+			/* Post the reads which were reaped. */
+			if (uring_pending(&set->uring) > 0 && uring_enter(&set->uring, 0, 0) < 0)
+				return -1;
+			return n;
+		}
+
+		res = uring_wait(set, deadline);
+		if (res != 0)
+			return (res < 0)? -1: 0;
+	}
+}
+
+static int uring_read(hid_device *dev, unsigned char *data, size_t length, long long deadline)
+{
+	hid_device_set *set = dev->set;
+
+	for (;;) {
+		int res;
+
+		uring_reap(set);
+		if (dev->ring->count > 0) {
+			if (uring_pending(&set->uring) > 0 && uring_enter(&set->uring, 0, 0) < 0)
+				return -1;
+			return report_ring_pop(dev->ring, data, length);
+		}
+		if (dev->read_error)
+			return -1;
+
+		res = uring_wait(set, deadline);
+		if (res != 0)
+			return (res < 0)? -1: 0;
+	}
+}
+
+static int uring_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	hid_device_set *set = dev->set;
+	struct uring_write *w;
+	struct io_uring_sqe *sqe;
+	int res;
+
+	w = malloc(sizeof(*w) + length);
+	if (!w)
+		return -1;
+	w->done = 0;
+	w->res = 0;
+	w->abandoned = 0;
+	memcpy(w->data, data, length);
+
+	sqe = uring_get_sqe(&set->uring);
+	if (!sqe) {
+		free(w);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = dev->device_handle;
+	sqe->addr = (uintptr_t)w->data;
+	sqe->len = length;
+	sqe->user_data = (uintptr_t)w | URING_TAG_WRITE;
+
+	/* Reads which complete meanwhile are handled too. */
+	while (!w->done) {
+		if (uring_enter(&set->uring, 1, -1) < 0) {
+			/* The request may still be submitted, or complete,
+			   later on. */
+			w->abandoned = 1;
+			return -1;
+		}
+		uring_reap(set);
+	}
+
+	res = w->res;
+	free(w);
+	return (res < 0)? -1: res;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* Returns nonzero if the device's reads and writes go through the
+   io_uring of its set. */
+static int uses_uring(hid_device *dev)
+{
+	return dev->ring != NULL;
+}
+
+/* Makes notify_fd readable. This should be called with dev->mutex
+   locked. */
+static void notify_readable(hid_device *dev)
+{
+	uint64_t one = 1;
+	if (write(dev->notify_fd, &one, sizeof(one)) < 0) {
+		/* The counter is already nonzero. */
+	}
+}
+
+static void *read_thread(void *param)
+{
+	hid_device *dev = param;
+	unsigned char *buf = malloc(dev->queue->slot_size);
+	struct pollfd fds[2];
+	int error = 0;
+
+	fds[0].fd = dev->device_handle;
+	fds[0].events = POLLIN;
+	fds[1].fd = dev->stop_fd;
+	fds[1].events = POLLIN;
+
+	while (buf) {
+		int res;
+
+		fds[0].revents = fds[1].revents = 0;
+		res = poll(fds, 2, -1);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			error = 1;
+			break;
+		}
+		if (fds[1].revents)
+			break; /* hid_close() */
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			error = 1; /* The device is gone. */
+			break;
+		}
+
+		res = read(dev->device_handle, buf, dev->queue->slot_size);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			error = 1;
+			break;
+		}
+
+		pthread_mutex_lock(&dev->mutex);
+		if (dev->queue->count == 0) {
+			/* Readers only wait while the queue is empty. */
+			pthread_cond_broadcast(&dev->condition);
+			notify_readable(dev);
+		}
+		report_ring_push(dev->queue, buf, res);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+
+	/* Wake any readers, so they can return the error. */
+	pthread_mutex_lock(&dev->mutex);
+	if (error || !buf) {
+		__atomic_store_n(&dev->read_error, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&dev->condition);
+		notify_readable(dev);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	free(buf);
+	return NULL;
+}
+
+/* Reads a report from the read thread's queue, waiting for one until
+   deadline as read_until() does. */
+static int queue_read(hid_device *dev, unsigned char *data, size_t length, long long deadline)
+{
+	int bytes_read;
+	struct timespec ts;
+	long long spin_end;
+
+	spin_end = spin_end_time(dev, deadline);
+	if (spin_end > 0) {
+		/* Spin until the read thread queues a report. If busy
+		   polling runs out of time, stop there. */
+		while (__atomic_load_n(&dev->queue->count, __ATOMIC_ACQUIRE) == 0 &&
+		       !__atomic_load_n(&dev->read_error, __ATOMIC_ACQUIRE)) {
+			if (get_time_ns() >= spin_end) {
+				if (dev->wait_strategy == HID_WAIT_BUSY_POLL)
+					deadline = 0;
+				break;
+			}
+			cpu_relax();
+		}
+	}
+
+	/* dev->condition waits on CLOCK_MONOTONIC, so the deadline can be
+	   used as it is. */
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	for (;;) {
+		if (dev->queue->count > 0) {
+			bytes_read = report_ring_pop(dev->queue, data, length);
+			if (dev->queue->count == 0 && !dev->read_error) {
+				/* Make notify_fd unreadable again. */
+				uint64_t value;
+				if (read(dev->notify_fd, &value, sizeof(value)) < 0) {
+					/* It already was. */
+				}
+			}
+			break;
+		}
+		if (dev->read_error) {
+			bytes_read = -1;
+			break;
+		}
+
+		if (deadline == -1)
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		else if (deadline == 0 ||
+		         pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts) == ETIMEDOUT) {
+			bytes_read = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return bytes_read;
+}
+
+static void stop_read_thread(hid_device *dev)
+{
+	uint64_t one = 1;
+
+	if (!dev->thread_running)
+		return;
+
+	if (write(dev->stop_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(dev->thread, NULL);
+	dev->thread_running = 0;
+	close(dev->stop_fd);
+	close(dev->notify_fd);
+	dev->stop_fd = dev->notify_fd = -1;
+	report_ring_free(dev->queue);
+	dev->queue = NULL;
+}
+
+int HID_API_EXPORT hid_start_read_thread(hid_device *dev, int queue_length)
+{
+	if (dev->thread_running || dev->set || queue_length < 0)
+		return -1;
+
+	dev->queue = report_ring_new(queue_length? queue_length: DEFAULT_READ_QUEUE_LENGTH,
+	                             max_input_report_size(dev));
+	dev->stop_fd = eventfd(0, EFD_CLOEXEC);
+	dev->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (!dev->queue || dev->stop_fd < 0 || dev->notify_fd < 0)
+		goto fail;
+	dev->read_error = 0;
+
+	if (pthread_create(&dev->thread, NULL, read_thread, dev) != 0)
+		goto fail;
+	dev->thread_running = 1;
+
+	return 0;
+
+fail:
+	report_ring_free(dev->queue);
+	if (dev->stop_fd >= 0)
+		close(dev->stop_fd);
+	if (dev->notify_fd >= 0)
+		close(dev->notify_fd);
+	dev->queue = NULL;
+	dev->stop_fd = dev->notify_fd = -1;
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_wait_strategy(hid_device *dev, int strategy, int spin_microseconds)
+{
+	if (strategy != HID_WAIT_BLOCK && strategy != HID_WAIT_SPIN_THEN_BLOCK &&
+	    strategy != HID_WAIT_BUSY_POLL)
+		return -1;
+	if (spin_microseconds < 0)
+		return -1;
+
+	dev->wait_strategy = strategy;
+	dev->spin_us = spin_microseconds;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_input_stats(hid_device *dev, struct hid_input_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (dev->thread_running) {
+		pthread_mutex_lock(&dev->mutex);
+		stats->received = dev->queue->received;
+		stats->dropped = dev->queue->dropped;
+		stats->queued = dev->queue->count;
+		pthread_mutex_unlock(&dev->mutex);
+	}
+	else if (dev->ring) {
+		stats->received = dev->ring->received;
+		stats->dropped = dev->ring->dropped;
+		stats->queued = dev->ring->count;
+	}
+	else {
+		/* The kernel doesn't say how many reports it dropped. */
+		stats->received = dev->reports_read;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int bytes_written;
+
+#ifdef HAVE_IO_URING
+	if (uses_uring(dev))
+		return uring_write(dev, data, length);
+#endif
+
+	bytes_written = write(dev->device_handle, data, length);
+
+	return bytes_written;
+}
+
+
+/* Reads a report, waiting for one until deadline, a CLOCK_MONOTONIC time
+   in nanoseconds. -1 waits forever, and 0 doesn't wait at all. */
+static int read_until(hid_device *dev, unsigned char *data, size_t length, long long deadline)
+{
+	int bytes_read;
+
+	if (dev->thread_running) {
+		bytes_read = queue_read(dev, data, length, deadline);
+		goto got_report;
+	}
+#ifdef HAVE_IO_URING
+	if (uses_uring(dev)) {
+		bytes_read = uring_read(dev, data, length, deadline);
+		goto got_report;
+	}
+#endif
+
+	if (deadline != 0) {
+		/* deadline is -1 or a time. In both cases, we want to
+		   call ppoll() and wait for data to arrive. -1 means
+		   INFINITE. */
+		int ret = 0;
+		struct pollfd fds;
+		struct timespec ts;
+		long long spin_end = spin_end_time(dev, deadline);
+
+		fds.fd = dev->device_handle;
+		fds.events = POLLIN;
+		fds.revents = 0;
+
+		/* Spin on poll() without a timeout first, if the wait
+		   strategy says so. Busy polling only stops when the time
+		   is up. */
+		if (spin_end > 0) {
+			while ((ret = poll(&fds, 1, 0)) == 0 &&
+			       get_time_ns() < spin_end)
+				cpu_relax();
+			if (ret == 0 && dev->wait_strategy == HID_WAIT_BUSY_POLL)
+				return 0;
+		}
+		if (ret == 0) {
+			if (deadline == -1)
+				ret = ppoll(&fds, 1, NULL, NULL);
+			else {
+				time_left(deadline, &ts);
+				ret = ppoll(&fds, 1, &ts, NULL);
+			}
+		}
+		if (ret == -1 || ret == 0)
+			/* Error or timeout */
+			return ret;
+	}
+
+	bytes_read = read(dev->device_handle, data, length);
 	if (bytes_read < 0 && errno == EAGAIN)
 		bytes_read = 0;
-	
-	if (bytes_read >= 0 &&
+	if (bytes_read > 0)
+		dev->reports_read++;
+
+got_report:
+	if (bytes_read > 0 &&
 	    kernel_version < KERNEL_VERSION(2,6,34) &&
 	    dev->uses_numbered_reports) {
 		/* Work around a kernel bug. Chop off the first byte. */
@@ -485,15 +1868,239 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return read_until(dev, data, length, deadline_after(milliseconds));
+}
+
+int HID_API_EXPORT hid_read_deadline(hid_device *dev, unsigned char *data, size_t length, long long deadline_ns)
+{
+	return read_until(dev, data, length, (deadline_ns < 0)? -1: deadline_ns);
+}
+
+hid_device_set * HID_API_EXPORT hid_device_set_create(void)
+{
+	hid_device_set *set = calloc(1, sizeof(hid_device_set));
+	if (!set)
+		return NULL;
+
+	set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (set->epoll_fd < 0) {
+		free(set);
+		return NULL;
+	}
+	set->members = NULL;
+	set->engine = HID_IO_ENGINE_DEFAULT;
+
+	return set;
+}
+
+void HID_API_EXPORT hid_device_set_free(hid_device_set *set)
+{
+	if (!set)
+		return;
+	while (set->members)
+		hid_device_set_remove(set, set->members);
+#ifdef HAVE_IO_URING
+	if (set->engine == HID_IO_ENGINE_IO_URING)
+		uring_exit(&set->uring);
+#endif
+	close(set->epoll_fd);
+	free(set);
+}
+
+int HID_API_EXPORT hid_device_set_set_engine(hid_device_set *set, int engine)
+{
+	if (set->members)
+		return -1;
+	if (engine == set->engine)
+		return 0;
+
+	switch (engine) {
+	case HID_IO_ENGINE_DEFAULT:
+#ifdef HAVE_IO_URING
+		uring_exit(&set->uring);
+#endif
+		break;
+#ifdef HAVE_IO_URING
+	case HID_IO_ENGINE_IO_URING:
+		/* Fails if the kernel doesn't support io_uring, or it is
+		   disabled. The set keeps using epoll then. */
+		if (uring_init(&set->uring, URING_ENTRIES) < 0)
+			return -1;
+		break;
+#endif
+	default:
+		return -1;
+	}
+	set->engine = engine;
+
+	return 0;
+}
+
+/* Returns the fd which is readable while the device has input. With a read
+   thread, the thread drains the device fd, so this is notify_fd. */
+static int epoll_fd_of(hid_device *dev)
+{
+	return dev->thread_running? dev->notify_fd: dev->device_handle;
+}
+
+int HID_API_EXPORT hid_device_set_add(hid_device_set *set, hid_device *dev)
+{
+	struct epoll_event ev;
+
+	if (dev->set)
+		return -1;
+
+#ifdef HAVE_IO_URING
+	if (set->engine == HID_IO_ENGINE_IO_URING) {
+		if (dev->thread_running)
+			return -1; /* The read thread already reads the fd. */
+		if (uring_add(set, dev) < 0)
+			return -1;
+		dev->set = set;
+		dev->next_member = set->members;
+		set->members = dev;
+		return 0;
+	}
+#endif
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+	if (epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, epoll_fd_of(dev), &ev) < 0)
+		return -1;
+	dev->set = set;
+	dev->next_member = set->members;
+	set->members = dev;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_device_set_remove(hid_device_set *set, hid_device *dev)
+{
+	hid_device **p;
+
+	if (dev->set != set)
+		return -1;
+
+	for (p = &set->members; *p != dev; p = &(*p)->next_member)
+		;
+	*p = dev->next_member;
+	dev->set = NULL;
+#ifdef HAVE_IO_URING
+	if (set->engine == HID_IO_ENGINE_IO_URING) {
+		uring_remove(set, dev);
+		return 0;
+	}
+#endif
+	return epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, epoll_fd_of(dev), NULL);
+}
+
+int HID_API_EXPORT hid_device_set_wait(hid_device_set *set, hid_device **ready, size_t max_ready, int milliseconds)
+{
+	struct epoll_event events[64];
+	int i, n;
+
+	if (max_ready == 0)
+		return -1;
+#ifdef HAVE_IO_URING
+	if (set->engine == HID_IO_ENGINE_IO_URING)
+		return uring_set_wait(set, ready, max_ready, milliseconds);
+#endif
+	if (max_ready > sizeof(events) / sizeof(events[0]))
+		max_ready = sizeof(events) / sizeof(events[0]);
+
+	do {
+		n = epoll_wait(set->epoll_fd, events, max_ready, milliseconds);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+
+	/* EPOLLERR and EPOLLHUP are always reported. They mean that the
+	   device is gone, which hid_read() reports too. */
+	for (i = 0; i < n; i++)
+		ready[i] = events[i].data.ptr;
+
+	return n;
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT hid_read_report_id_timeout(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds)
+{
+	/* Reports are queued by the kernel, in one queue. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_input_mode(hid_device *dev, int mode, int queue_length)
+{
+	return (mode == HID_INPUT_MODE_FIFO && queue_length == 0)? 0: -1;
+}
+
+int HID_API_EXPORT hid_enable_snapshots(hid_device *dev)
+{
+	/* There's no reader thread to keep them up to date. */
+	return -1;
+}
+
+int HID_API_EXPORT hid_read_snapshot(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, unsigned long *sequence)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_change_only(hid_device *dev, int enable)
+{
+	/* Reports are queued by the kernel. */
+	return enable? -1: 0;
+}
+
+int HID_API_EXPORT hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length)
+{
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_decimation(hid_device *dev, int n)
+{
+	return (n == 0 || n == 1)? 0: -1;
+}
+
+int HID_API_EXPORT hid_set_aggregation(hid_device *dev, int function, int milliseconds)
+{
+	return (milliseconds == 0)? 0: -1;
+}
+
+int HID_API_EXPORT hid_set_flow_control(hid_device *dev, int high_watermark, int low_watermark, hid_watermark_callback callback, void *user_data)
+{
+	/* hidraw can't stop the kernel from polling the device. */
+	return (high_watermark == 0)? 0: -1;
+}
+
+int HID_API_EXPORT hid_set_demand_polling(hid_device *dev, int idle_milliseconds)
+{
+	/* The kernel polls the device while it is open. */
+	return (idle_milliseconds == 0)? 0: -1;
+}
+
+int HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	/* Not supported; reports are read from the device. */
+	return (callback == NULL)? 0: -1;
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	int flags, res;
 
+	if (uses_uring(dev)) {
+		/* The fd stays blocking; see uring_add(). */
+		dev->blocking = !nonblock;
+		return 0;
+	}
+
 	flags = fcntl(dev->device_handle, F_GETFL, 0);
 	if (flags >= 0) {
 		if (nonblock)
@@ -542,10 +2149,104 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
+	if (dev->set)
+		hid_device_set_remove(dev->set, dev);
+	if (dev->context) {
+		hid_device **p;
+		pthread_mutex_lock(&dev->context->mutex);
+		for (p = &dev->context->devices; *p != dev; p = &(*p)->next_in_context)
+			;
+		*p = dev->next_in_context;
+		pthread_mutex_unlock(&dev->context->mutex);
+	}
+	stop_read_thread(dev);
 	close(dev->device_handle);
+	pthread_cond_destroy(&dev->condition);
+	pthread_mutex_destroy(&dev->mutex);
+	hid_report_encoder_free(dev->output_encoder);
+	hid_report_encoder_free(dev->feature_encoder);
+	hid_free_report_descriptor(dev->report_descriptor);
 	free(dev);
 }
 
+void HID_API_EXPORT hid_init_context_config(struct hid_context_config *config)
+{
+	config->queue_length = 0;
+	config->input_mode = HID_INPUT_MODE_FIFO;
+	config->event_thread_priority = 0;
+	config->event_threads = 1;
+	config->shard_assignment = HID_SHARD_ROUND_ROBIN;
+	config->pin_event_threads = 0;
+	config->callback_workers = 0;
+}
+
+hid_context * HID_API_EXPORT hid_context_init(const struct hid_context_config *config)
+{
+	hid_context *ctx;
+
+	/* Only the kernel's FIFO is supported. */
+	if (config && (config->queue_length < 0 || config->input_mode != HID_INPUT_MODE_FIFO ||
+	               config->event_threads < 0 || config->callback_workers < 0))
+		return NULL;
+
+	ctx = calloc(1, sizeof(hid_context));
+	if (!ctx)
+		return NULL;
+	if (config)
+		ctx->config = *config;
+	else
+		hid_init_context_config(&ctx->config);
+	pthread_mutex_init(&ctx->mutex, NULL);
+	ctx->devices = NULL;
+
+	return ctx;
+}
+
+void HID_API_EXPORT hid_context_exit(hid_context *ctx)
+{
+	if (!ctx)
+		return;
+
+	while (ctx->devices)
+		hid_close(ctx->devices);
+	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx);
+}
+
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
+{
+	hid_device *dev = hid_open_path(path);
+	if (!dev)
+		return NULL;
+
+	if (ctx->config.queue_length > 0 &&
+	    hid_start_read_thread(dev, ctx->config.queue_length) < 0) {
+		hid_close(dev);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx->mutex);
+	dev->context = ctx;
+	dev->next_in_context = ctx->devices;
+	ctx->devices = dev;
+	pthread_mutex_unlock(&ctx->mutex);
+
+	return dev;
+}
+
+hid_device * HID_API_EXPORT hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	char *path_to_open = find_path(vendor_id, product_id, serial_number);
+	hid_device *handle = NULL;
+
+	if (path_to_open) {
+		handle = hid_context_open_path(ctx, path_to_open);
+		free(path_to_open);
+	}
+
+	return handle;
+}
+
 
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
@@ -567,6 +2268,23 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 	return -1;
 }
 
+const struct hid_report_descriptor HID_API_EXPORT * HID_API_CALL hid_get_report_descriptor(hid_device *dev)
+{
+	return dev->report_descriptor;
+}
+
+HID_API_EXPORT hid_report_encoder * HID_API_CALL hid_get_report_encoder(hid_device *dev, int type)
+{
+	switch (type) {
+	case HID_REPORT_OUTPUT:
+		return dev->output_encoder;
+	case HID_REPORT_FEATURE:
+		return dev->feature_encoder;
+	default:
+		return NULL;
+	}
+}
+
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {